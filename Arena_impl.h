@@ -0,0 +1,71 @@
+#ifndef _ARENA_IMPL_H_
+#define _ARENA_IMPL_H_
+
+#include <Arduino.h>
+#include <new>
+
+#include "constants.h"
+#include "QOIF2_impl.h"
+
+// All the memory playing takes, set aside once at compile time and used again for every file -
+// so switching files doesn't allocate anything, and can't fail or fragment the heap however long
+// the badge runs. There's a slot for each decoder that can be open at once (the one playing and
+// the next one), the memory they share for a file read in whole (see QOIF2ResidentMemory), the
+// frame cache, and the decoders' shared pixel buffers (see qoif2_pixel_buffers()), and it has to
+// fit in ARENA_BUDGET_BYTES or it won't build.
+
+#define ARENA_SLOTS 2
+
+typedef struct {
+    alignas(QOIF2) uint8_t img[sizeof(QOIF2)];
+    QOIF2Memory mem;
+} ArenaSlot;
+
+typedef struct {
+    ArenaSlot slots[ARENA_SLOTS];
+    QOIF2ResidentMemory resident;
+    uint8_t frame_cache[FRAME_CACHE_BYTES ? FRAME_CACHE_BYTES : 1];
+} Arena;
+
+#define ARENA_BYTES (sizeof(Arena) + 2 * sizeof(QOIF2PixelBuffer))
+static_assert(ARENA_BYTES <= ARENA_BUDGET_BYTES, "buffers don't fit in ARENA_BUDGET_BYTES");
+
+Arena arena;
+
+// A decoder in the slot's memory, which mustn't already have one open
+QOIF2* arena_open(uint8_t slot, PixelSink* sink, ByteSource* src) {
+    ArenaSlot* s = &arena.slots[slot];
+    s->mem.resident = &arena.resident;
+    return new (s->img) QOIF2(sink, src, &s->mem);
+}
+
+void arena_close(QOIF2* img) {
+    img->~QOIF2();
+}
+
+#if defined(ARDUINO)
+extern "C" char* sbrk(int incr);
+#endif
+
+void arena_report() {
+    char line[64];
+    Serial.println("Memory:");
+    snprintf(line, sizeof(line), "  decoders     %6lu x %u", (unsigned long) sizeof(ArenaSlot), ARENA_SLOTS);
+    Serial.println(line);
+    snprintf(line, sizeof(line), "  resident     %6lu", (unsigned long) sizeof(arena.resident));
+    Serial.println(line);
+    snprintf(line, sizeof(line), "  frame cache  %6lu", (unsigned long) sizeof(arena.frame_cache));
+    Serial.println(line);
+    snprintf(line, sizeof(line), "  pixels       %6lu", (unsigned long) (2 * sizeof(QOIF2PixelBuffer)));
+    Serial.println(line);
+    snprintf(line, sizeof(line), "  total        %6lu of %lu", (unsigned long) ARENA_BYTES, (unsigned long) ARENA_BUDGET_BYTES);
+    Serial.println(line);
+#if defined(ARDUINO)
+    // between the top of the heap and the stack
+    char top;
+    snprintf(line, sizeof(line), "  free         %6lu", (unsigned long) (&top - sbrk(0)));
+    Serial.println(line);
+#endif
+}
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef _BYTESOURCE_IMPL_H_
+#define _BYTESOURCE_IMPL_H_
+
+#include <Arduino.h>
+
+// Anything the decoders can stream from - a file on the SD card, or memory on the host
+class ByteSource {
+public:
+    virtual ~ByteSource() {}
+
+    // Returns the number of bytes read, less than len at the end of the data
+    virtual int read(uint8_t* buf, int len) = 0;
+    virtual bool seek(uint32_t pos) = 0;
+    virtual uint32_t position() = 0;
+    virtual uint32_t size() = 0;
+};
+
+#if defined(ARDUINO)
+#include <SD.h>
+
+class SDFileSource : public ByteSource {
+private:
+    File* fp;
+
+public:
+    SDFileSource(File* fp) {
+        this->fp = fp;
+    }
+
+    int read(uint8_t* buf, int len) {
+        return this->fp->read(buf, len);
+    }
+
+    bool seek(uint32_t pos) {
+        return this->fp->seek(pos);
+    }
+
+    uint32_t position() {
+        return this->fp->position();
+    }
+
+    uint32_t size() {
+        return this->fp->size();
+    }
+};
+#endif
+
+#endif
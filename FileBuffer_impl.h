@@ -1,76 +1,251 @@
 #ifndef FILEBUFFER_IMPL_H
 #define FILEBUFFER_IMPL_H
 
+#include <Arduino.h>
+
+#include "ByteSource_impl.h"
+#include "Profiler_impl.h"
+
+// The first FILEBUFFER_GUARD bytes of the ring are mirrored just past its end, so anything up to
+// this long can be read straight out of the buffer even where it wraps around
+#define FILEBUFFER_GUARD 64
+
+// The ring a buffer of size bytes gets, and the memory it takes with the guard
+constexpr int filebuffer_ring(int size, int ring = FILEBUFFER_GUARD) {
+    return ring < size ? filebuffer_ring(size, ring << 1) : ring;
+}
+#define FILEBUFFER_MEM(size) (filebuffer_ring(size) + FILEBUFFER_GUARD)
+
+// Buffers a file as an endless loop: once it's read up to end_pos it carries on from reset_pos,
+// so the start of an animation is already buffered by the time the end of it has played.
 class FileBuffer {
 public:
     uint8_t *buf;
-    int max_size = 0, head = 0, tail = 0, size = 0;
-    File *fp;
-    long reset_pos = 0;
+    // max_size is a power of two, so positions wrap with mask
+    int max_size = 0, mask = 0, head = 0, tail = 0, size = 0;
+    ByteSource *src;
+    long reset_pos = 0, end_pos = 0, file_pos = 0;
+    // times the reader had to wait for the card because read-ahead hadn't kept up, and for how long
+    uint32_t stalls = 0, stall_us = 0;
+    // everything read from src
+    uint32_t bytes_read = 0;
+    // Resident buffers hold all of the file up to end_pos, read once and then looped over in
+    // memory - size has to be at least that much. They aren't rings, positions just count up from
+    // base, where the file was when the buffer was made.
+    bool resident = false;
+    long base = 0;
 
-    FileBuffer(File *fp, int size) {
-        this->max_size = size;
-        this->buf = (uint8_t*) malloc(size);
-        this->fp = fp;
-        this->reset_pos = this->fp->position();
-        this->fill();
+    // end_pos defaults to the end of the file. Without fill, nothing's read until it's needed
+    // or read ahead.
+    FileBuffer(ByteSource *src, int size, long end_pos = -1, bool fill = true, bool resident = false) {
+        this->owned = true;
+        this->init(src, (uint8_t*) malloc(FILEBUFFER_MEM(size)), size, end_pos, fill, resident);
+    }
+
+    // Same, in the FILEBUFFER_MEM(size) bytes at mem (just size if it's resident) - which it
+    // leaves alone when it's done
+    FileBuffer(ByteSource *src, uint8_t* mem, int size, long end_pos = -1, bool fill = true, bool resident = false) {
+        this->init(src, mem, size, end_pos, fill, resident);
     }
 
     ~FileBuffer() {
-        free(this->buf);
+        if (this->owned)
+            free(this->buf);
+    }
+
+private:
+    bool owned = false;
+
+    void init(ByteSource *src, uint8_t* mem, int size, long end_pos, bool fill, bool resident) {
+        this->resident = resident;
+        // positions in a resident buffer don't wrap, so the mask keeps everything
+        this->max_size = resident ? size : filebuffer_ring(size);
+        this->mask = resident ? -1 : this->max_size - 1;
+        this->buf = mem;
+        this->src = src;
+        this->base = this->reset_pos = this->file_pos = this->src->position();
+        this->end_pos = end_pos < 0 ? (long) this->src->size() : end_pos;
+        if (fill)
+            this->fill();
+    }
+
+    // One read into the free space at head, which mustn't wrap
+    int read_some(int sz) {
+        PROFILE_ZONE("card read");
+        if (this->file_pos >= this->end_pos && !this->resident) {
+            this->src->seek(this->reset_pos);
+            this->file_pos = this->reset_pos;
+        }
+        sz = min((long) sz, this->end_pos - this->file_pos);
+        int read_b = this->src->read(this->buf + this->head, sz);
+        if (read_b < 0)
+            read_b = 0;
+        this->bytes_read += read_b;
+        if (read_b > 0 && this->head < FILEBUFFER_GUARD && !this->resident)
+            memcpy(this->buf + this->max_size + this->head, this->buf + this->head, min(read_b, FILEBUFFER_GUARD - this->head));
+        this->size += read_b;
+        this->head = (this->head + read_b) & this->mask;
+        // a file shorter than it claimed to be just ends early
+        this->file_pos = read_b < sz ? this->end_pos : this->file_pos + read_b;
+        return read_b;
     }
 
+    void stall() {
+        // a resident file that's all been read only has to go back to the start
+        if (this->resident && this->file_pos >= this->end_pos) {
+            this->fill_resident();
+            return;
+        }
+        unsigned long start = micros();
+        this->fill();
+        this->stalls++;
+        this->stall_us += micros() - start;
+    }
+
+    // Reads whatever's left of a resident file, and once it's all been read, goes back to the
+    // start of the loop
+    void fill_resident() {
+        if (this->file_pos < this->end_pos)
+            this->src->seek(this->file_pos);
+        while (this->file_pos < this->end_pos && this->read_some(this->end_pos - this->file_pos));
+        if (!this->size) {
+            this->tail = this->reset_pos - this->base;
+            this->size = this->head - this->tail;
+        }
+    }
+
+public:
     void fill() {
-        int max_read, read_b;
+        PROFILE_ZONE("buffer fill");
+        if (this->resident) {
+            this->fill_resident();
+            return;
+        }
         while (this->size < this->max_size) {
-            if (this->tail <= this->head) {
-                // read to end of buffer
-                max_read = min(this->max_size - this->size, this->max_size - this->head);
-                read_b = this->fp->read(this->buf + this->head, max_read);
-            } else {
-                // read from head -> tail
-                max_read = this->tail - this->head;
-                read_b = this->fp->read(this->buf + this->head, max_read);
-            }
-            this->size += read_b;
-            this->head = (this->head + read_b) % this->max_size;
-            if (read_b < max_read) {
-                // If we hit EOF, reset to starting pos & bail - we may not need data going forward
-                this->fp->seek(this->reset_pos);
+            // only stops short if there's nothing at all to loop over
+            if (!this->read_some(min(this->max_size - this->size, this->max_size - this->head)))
                 return;
-            }
         }
     }
 
-    int read(uint8_t* dest, int sz) {
-        if (this->size < sz) {
-            this->fill();
-            if (this->size < sz) {
-                return -1;
-            }
+    // Where in the file the next byte read comes from
+    long tell() {
+        long pos = this->file_pos - this->size;
+        if (this->end_pos > this->reset_pos) {
+            while (pos < this->reset_pos)
+                pos += this->end_pos - this->reset_pos;
         }
-        for (int offset = 0; offset < sz; offset++, this->size--, this->tail = (this->tail + 1) % this->max_size) {
-            dest[offset] = this->buf[this->tail];
+        return pos;
+    }
+
+    // Drops everything buffered and carries on from pos. Nothing is read until it's needed, or
+    // read ahead.
+    void seek(long pos) {
+        if (this->resident) {
+            // it's all in memory already, or will be
+            this->fill_resident();
+            this->tail = pos - this->base;
+            this->size = this->head - this->tail;
+            return;
         }
+        this->head = this->tail = this->size = 0;
+        this->file_pos = pos;
+        this->src->seek(pos);
+    }
+
+    // Same, but pos is also where the loop starts from now on
+    void restart(long pos) {
+        this->reset_pos = pos;
+        this->seek(pos);
+    }
+
+    // Makes a streaming buffer resident, in size bytes at mem, keeping what it's read of the loop
+    // so none of that's read again. Only before any of the loop's been used - the next byte read
+    // has to be the one at reset_pos.
+    void make_resident(uint8_t* mem, int size) {
+        // a loop shorter than the ring may be in it more than once
+        int n = min((long) this->size, this->end_pos - this->reset_pos);
+        int first = min(n, this->max_size - this->tail);
+        memcpy(mem, this->buf + this->tail, first);
+        memcpy(mem + first, this->buf, n - first);
+        if (this->owned)
+            free(this->buf);
+        this->owned = false;
+        this->buf = mem;
+        this->resident = true;
+        this->max_size = size;
+        this->mask = -1;
+        this->base = this->reset_pos;
+        this->tail = 0;
+        this->head = this->size = n;
+        this->file_pos = this->base + n;
+        if (this->file_pos < this->end_pos)
+            this->src->seek(this->file_pos);
+    }
+
+    // Reads ahead by one bounded slice, if there's room for all of it - small enough to do while
+    // waiting on something else. Returns the bytes read, 0 once the buffer is full.
+    int fill_slice(int sz) {
+        if (this->resident)
+            return this->file_pos < this->end_pos ? this->read_some(min((long) sz, this->end_pos - this->file_pos)) : 0;
+        if (this->max_size - this->size < sz)
+            return 0;
+        return this->read_some(min(sz, this->max_size - this->head));
+    }
+
+    // Returns the unread data that's contiguous in memory, and its length in len - at least
+    // min(want, FILEBUFFER_GUARD) bytes unless the data has run out. Nothing is used up until
+    // consume() is called.
+    const uint8_t* peek(int* len, int want = 1) {
+        if (this->size < want)
+            this->stall();
+        *len = min(this->size, this->max_size + FILEBUFFER_GUARD - this->tail);
+        return this->buf + this->tail;
+    }
+
+    void consume(int sz) {
+        sz = min(sz, this->size);
+        this->tail = (this->tail + sz) & this->mask;
+        this->size -= sz;
+    }
+
+    int read(uint8_t* dest, int sz) {
+        int avail;
+        const uint8_t* src = this->peek(&avail, sz);
+        if (this->size < sz)
+            return -1;
+        if (avail >= sz) {
+            memcpy(dest, src, sz);
+        } else {
+            memcpy(dest, src, avail);
+            memcpy(dest + avail, this->buf + FILEBUFFER_GUARD, sz - avail);
+        }
+        this->consume(sz);
         return sz;
     }
 
     uint8_t readByte() {
-        uint8_t b;
-        this->read(&b, 1);
+        if (this->size < 1) {
+            this->stall();
+            if (this->size < 1)
+                return 0;
+        }
+        uint8_t b = this->buf[this->tail];
+        this->tail = (this->tail + 1) & this->mask;
+        this->size--;
         return b;
     }
 
     int skip(int sz) {
         if (this->size < sz) {
-            this->fill();
+            this->stall();
             if (this->size < sz) {
                 return -1;
             }
         }
-        this->tail = (this->tail + sz) % this->max_size;
+        this->consume(sz);
         return sz;
     }
 };
 
-#endif
\ No newline at end of file
+#endif
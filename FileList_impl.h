@@ -3,12 +3,44 @@
 
 #include <SD.h>
 #include "prefs.h"
+#include "QOIF2_impl.h"
 
 #define GIF_FILE 1
 #define BMP_FILE 2
 #define ANIM_FILE 4
 #define QOIF2_FILE 8
 
+// The animations in the directory are listed in an index file on the card, so changing file is
+// one seek and read however many there are. The index is checked against the directory once, in
+// init(), and rebuilt if a file was added, removed or changed size.
+#define FILELIST_INDEX_FILENAME "/_files.idx"
+#define FILELIST_INDEX_MAGIC 0x78646966 // "fidx"
+#define FILELIST_INDEX_VERSION 2
+// longest path a file can be played from, directory and terminator included - a name that's too
+// long for it isn't listed
+#define FILELIST_PATH_LEN 128
+
+typedef struct {
+    char name[FILELIST_PATH_LEN];
+    uint32_t size;
+    uint16_t type;
+    // from the file's header, 0 if it doesn't have one
+    uint16_t width, height;
+    uint8_t version;
+    uint8_t reserved;
+} __attribute__ ((packed)) FileListEntry;
+
+// At the very end of the index, after the entries. It's written last, so an index that was
+// never finished doesn't look like one.
+typedef struct {
+    uint32_t count;
+    // of the names and sizes of everything listed, in directory order
+    uint32_t signature;
+    uint16_t entry_size;
+    uint16_t version;
+    uint32_t magic;
+} __attribute__ ((packed)) FileListFooter;
+
 class FileList {
     public:
         bool is_gif = false, is_bmp = false, is_anim = false, is_qoif2 = false;
@@ -19,11 +51,11 @@ class FileList {
         }
 
         void init(Prefs* prefs) {
-            this->read_num_files(0, true, prefs->last_filename);
+            this->open_list(prefs->last_filename);
         }
 
         void init() {
-            this->read_num_files(0, true);
+            this->open_list(NULL);
         }
 
         int get_num_files() {
@@ -38,69 +70,215 @@ class FileList {
             return this->filename;
         }
 
+        // Name, size and header of the current file
+        const FileListEntry* get_cur_entry() {
+            return &this->entry;
+        }
+
+        // False if the index couldn't be written, and every change of file walks the directory
+        bool is_indexed() {
+            return this->index_file;
+        }
+
+        // The file dir places on from the current one, without changing to it - NULL if there
+        // aren't any. Overwritten by the next call.
+        const FileListEntry* peek_file(int dir) {
+            int index = this->index + dir;
+            if (this->num_files == 0)
+                return NULL;
+            index %= this->num_files;
+            if (index < 0)
+                index += this->num_files;
+            if (!this->read_entry(index, &this->peek_entry))
+                return NULL;
+            return &this->peek_entry;
+        }
+
+        // Full path of an entry, in a buffer that's overwritten every time
+        const char* get_path(const FileListEntry* entry) {
+            static char path[FILELIST_PATH_LEN];
+#if !defined(ESP32)
+            // Copy the directory name into the pathname buffer - ESP32 SD Library includes the full path name in the filename, so no need to add the directory name
+            strcpy(path, this->directory);
+            // Append the filename to the pathname
+            strcat(path, entry->name);
+#else
+            strcpy(path, entry->name);
+#endif
+            return path;
+        }
+
         void set_file(int index) {
-            this->read_num_files(index, true);
+            this->load(index);
         }
 
         void next_file(Prefs* prefs) {
-            this->change_file(prefs, 1, true);
+            this->change_file(prefs, 1);
         }
 
         void prev_file(Prefs* prefs) {
-            this->change_file(prefs, -1, true);
+            this->change_file(prefs, -1);
         }
 
     private:
         const char* directory;
-        char filename[128];
+        char filename[FILELIST_PATH_LEN] = "";
         int num_files = 0, index = 0;
+        File index_file;
+        FileListEntry entry, peek_entry;
+
+        void open_list(const char* last_filename) {
+            uint32_t signature;
+            int found = 0;
+
+            if (this->index_file)
+                this->index_file.close();
+            this->num_files = this->walk(&signature, NULL, -1, NULL);
+            if (!this->open_index(signature)) {
+                Serial.print("Indexing ");
+                Serial.print(this->num_files);
+                Serial.println(" files");
+                this->build_index();
+                if (!this->open_index(signature))
+                    Serial.println("Can't write file index, walking the directory instead");
+            }
 
-        void change_file(Prefs* prefs, int dir, bool set_index) {
-            this->read_num_files(this->index + dir, set_index);
+            // Only done once, so it's fine to look through every entry for it
+            if (last_filename != NULL && last_filename[0]) {
+                for (int i = 0; i < this->num_files; i++) {
+                    if (this->read_entry(i, &this->entry) && strcmp(this->get_path(&this->entry), last_filename) == 0) {
+                        found = i;
+                        break;
+                    }
+                }
+            }
+            this->load(found);
+        }
+
+        void change_file(Prefs* prefs, int dir) {
+            this->load(this->index + dir);
             if (prefs != NULL) {
                 set_pref_last_filename(prefs, (const char *)this->filename);
                 write_prefs(prefs);
             }
         }
 
-        void read_num_files(int index, bool set_index, char* last_filename) {
-            int count = 0, curindex = -1;
-            uint16_t ftype;
+        void load(int index) {
+            if (index >= this->num_files) {
+                index = 0;
+            } else if (index < 0) {
+                index = this->num_files - 1;
+            }
+            if (!this->read_entry(index, &this->entry))
+                return;
 
-            if (set_index) {
-                if (index >= this->num_files) {
-                    index = 0;
-                } else if (index < 0) {
-                    index = this->num_files - 1;
-                }
+            this->is_gif = this->entry.type & GIF_FILE;
+            this->is_bmp = this->entry.type & BMP_FILE;
+            this->is_anim = this->entry.type & ANIM_FILE;
+            this->is_qoif2 = this->entry.type & QOIF2_FILE;
+            this->index = index;
+            strcpy(this->filename, this->get_path(&this->entry));
+        }
+
+        // Keeps the index open if it matches the directory
+        bool open_index(uint32_t signature) {
+            FileListFooter footer;
+
+            this->index_file = SD.open(FILELIST_INDEX_FILENAME);
+            if (!this->index_file)
+                return false;
+            if (this->index_file.size() == this->num_files * sizeof(FileListEntry) + sizeof(FileListFooter)
+                && this->index_file.seek(this->index_file.size() - sizeof(FileListFooter))
+                && this->index_file.read((uint8_t*) &footer, sizeof(footer)) == sizeof(footer)
+                && footer.magic == FILELIST_INDEX_MAGIC
+                && footer.version == FILELIST_INDEX_VERSION
+                && footer.entry_size == sizeof(FileListEntry)
+                && footer.count == (uint32_t) this->num_files
+                && footer.signature == signature)
+                return true;
+
+            this->index_file.close();
+            return false;
+        }
+
+        void build_index() {
+            FileListFooter footer;
+            uint32_t signature;
+
+            SD.remove(FILELIST_INDEX_FILENAME);
+            File out = SD.open(FILELIST_INDEX_FILENAME, FILE_WRITE);
+            if (!out)
+                return;
+            footer.count = this->walk(&signature, &out, -1, NULL);
+            footer.signature = signature;
+            footer.entry_size = sizeof(FileListEntry);
+            footer.version = FILELIST_INDEX_VERSION;
+            footer.magic = FILELIST_INDEX_MAGIC;
+            out.write((uint8_t*) &footer, sizeof(footer));
+            out.close();
+        }
+
+        bool read_entry(int index, FileListEntry* entry) {
+            if (index < 0 || index >= this->num_files)
+                return false;
+            if (this->index_file) {
+                return this->index_file.seek(index * sizeof(FileListEntry))
+                    && this->index_file.read((uint8_t*) entry, sizeof(FileListEntry)) == sizeof(FileListEntry);
             }
+            uint32_t signature;
+            return this->walk(&signature, NULL, index, entry) > index;
+        }
 
+        // Goes through the animations in the directory, counting them and working out their
+        // signature. Each one is written to out if it's given, and if find is one of them it's
+        // filled in to entry and the walk stops there.
+        int walk(uint32_t* signature, File* out, int find, FileListEntry* entry) {
+            FileListEntry e;
+            int count = 0;
+
+            // FNV-1a
+            *signature = 2166136261;
             File directory = SD.open(this->directory);
             if (!directory) {
-                return;
+                return 0;
             }
 
             File file = directory.openNextFile();
             while (file) {
-                ftype = this->is_anim_file(file.name());
-                if (ftype) {
-                    count++;
-                    curindex++;
-                    if (set_index && ((last_filename != NULL && strcmp((char*)file.name(), last_filename) == 0 || (last_filename == NULL && index == curindex)))) {
-                        this->is_gif = ftype & GIF_FILE;
-                        this->is_bmp = ftype & BMP_FILE;
-                        this->is_anim = ftype & ANIM_FILE;
-                        this->is_qoif2 = ftype & QOIF2_FILE;
-                        this->index = curindex;
-#if !defined(ESP32)
-                        // Copy the directory name into the pathname buffer - ESP32 SD Library includes the full path name in the filename, so no need to add the directory name
-                        strcpy(this->filename, this->directory);
-                        // Append the filename to the pathname
-                        strcat(this->filename, (char*)file.name());
-#else
-                        strcpy(this->filename, (char*)file.name());
-#endif
+                const char* name = file.name();
+                uint16_t ftype = this->is_anim_file(name);
+                if (ftype && !this->fits_path(name)) {
+                    // only said when counting them, which is once a list
+                    if (out == NULL && find < 0) {
+                        Serial.print("Name too long to play: ");
+                        Serial.println(name);
+                    }
+                } else if (ftype) {
+                    uint32_t size = file.size();
+                    for (const char* c = name; ; c++) {
+                        *signature = (*signature ^ (uint8_t) *c) * 16777619;
+                        if (!*c)
+                            break;
+                    }
+                    for (int i = 0; i < 4; i++)
+                        *signature = (*signature ^ ((size >> (i * 8)) & 0xff)) * 16777619;
+
+                    if (out != NULL || count == find) {
+                        memset(&e, 0, sizeof(e));
+                        strcpy(e.name, name);
+                        e.size = size;
+                        e.type = ftype;
+                        if (ftype & QOIF2_FILE)
+                            this->read_header(&file, &e);
+                        if (out != NULL)
+                            out->write((uint8_t*) &e, sizeof(e));
+                        if (count == find) {
+                            *entry = e;
+                            count++;
+                            break;
+                        }
                     }
+                    count++;
                 }
                 file.close();
                 file = directory.openNextFile();
@@ -109,48 +287,53 @@ class FileList {
             file.close();
             directory.close();
 
-            this->num_files = count;
+            return count;
         }
 
-        void read_num_files(int index, bool set_index) {
-            this->read_num_files(index, set_index, NULL);
+        void read_header(File* file, FileListEntry* entry) {
+            QOIF2FileHeader header;
+            if (file->read((uint8_t*) &header, sizeof(header)) != sizeof(header) || header.magic != QOIF2_MAGIC)
+                return;
+            entry->width = header.width;
+            entry->height = header.height;
+            entry->version = header.version;
         }
 
-        uint16_t is_anim_file(const char* filename) {
-            String filename_string(filename);
-            uint16_t out = 0;
+        // Whether get_path() has room for the name
+        bool fits_path(const char* name) {
+#if !defined(ESP32)
+            return strlen(this->directory) + strlen(name) < FILELIST_PATH_LEN;
+#else
+            return strlen(name) < FILELIST_PATH_LEN;
+#endif
+        }
 
+        uint16_t is_anim_file(const char* filename) {
 #if defined(ESP32)
             // ESP32 filename includes the full path, so need to remove the path before looking at the filename
-            int pathindex = filename_string.lastIndexOf("/");
-            if (pathindex >= 0)
-                filename_string.remove(0, pathindex + 1);
+            const char* slash = strrchr(filename, '/');
+            if (slash != NULL)
+                filename = slash + 1;
 #endif
 
-            Serial.print("\"");
-            Serial.print(filename_string);
-            Serial.print("\"");
-
-            if ((filename_string[0] == '_') || (filename_string[0] == '~') || (filename_string[0] == '.')) {
-                Serial.println(" ignoring: leading _/~/. character");
+            if ((filename[0] == '_') || (filename[0] == '~') || (filename[0] == '.'))
                 return 0;
-            }
 
-            filename_string.toUpperCase();
-            // if (filename_string.endsWith(String(".SDA")) == true)
-            //     out = ANIM_FILE;
-            if (filename_string.endsWith(String(".QOX")) == true)
-                out = QOIF2_FILE;
-            // else if (filename_string.endsWith(String(".GIF")) == true)
-            //     out = GIF_FILE;
-            // else if (filename_string.endsWith(String(".BMP")) == true)
-            //     out = BMP_FILE;
-            else
-                Serial.println(" ignoring: doesn't end with .GIF or .BMP or .SDA");
-
-            Serial.println();
-
-            return out;
+            // if (this->ends_with(filename, ".SDA"))
+            //     return ANIM_FILE;
+            if (this->ends_with(filename, ".QOX"))
+                return QOIF2_FILE;
+            // if (this->ends_with(filename, ".GIF"))
+            //     return GIF_FILE;
+            // if (this->ends_with(filename, ".BMP"))
+            //     return BMP_FILE;
+
+            return 0;
+        }
+
+        bool ends_with(const char* filename, const char* ext) {
+            size_t len = strlen(filename), ext_len = strlen(ext);
+            return len >= ext_len && strcasecmp(filename + len - ext_len, ext) == 0;
         }
 };
 
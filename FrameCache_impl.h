@@ -0,0 +1,143 @@
+#ifndef _FRAMECACHE_IMPL_H_
+#define _FRAMECACHE_IMPL_H_
+
+#include <Arduino.h>
+
+// Blocks of an animation exactly as they were sent to the display, so later loops can be sent
+// again from RAM instead of being read and decoded again. Holds as many whole blocks from the
+// start of the loop as fit in the budget, and the decoder's state at the first one that didn't,
+// so streaming can pick up from there.
+
+typedef struct {
+    uint8_t flags;
+    uint16_t duration;
+    uint16_t x, y, width, height;
+    // bytes of segments that follow
+    uint32_t len;
+} FrameCacheBlock;
+
+// Each segment is a uint32_t pixel count, with FRAMECACHE_COLOR set if it's all one color, then
+// the color or the pixels - padded so the next segment is 4 byte aligned. FRAMECACHE_SKIP is
+// pixels left as they were, with nothing after the count.
+#define FRAMECACHE_COLOR 0x80000000
+#define FRAMECACHE_SKIP 0x40000000
+
+class FrameCache {
+private:
+    uint32_t block_start = 0;
+    bool owned = false;
+
+    bool reserve(uint32_t sz) {
+        if (this->used + sz > this->budget) {
+            this->stop();
+            return false;
+        }
+        return true;
+    }
+
+    // Out of room - drop the block being recorded, and keep what's already complete
+    void stop() {
+        this->used = this->block_start;
+        this->recording = false;
+        this->complete = true;
+        this->whole_loop = false;
+    }
+
+public:
+    uint8_t* mem = NULL;
+    uint32_t budget = 0, used = 0;
+    int blocks = 0;
+    // recording stops once the loop's done or the budget's used up, and complete is set
+    bool recording = false, complete = false, whole_loop = false;
+    // where streaming carries on after the last block held, and the decoder's state there
+    uint32_t resume_pos = 0;
+    uint16_t resume_px = 0, resume_cache[64];
+    // and the palette, for files that have one
+    uint16_t resume_palette[256];
+    // or the previous pixel and cache of a 24 bit file - the decoder fills in whichever it uses
+    uint32_t resume_rgb = 0, resume_rgb_cache[64];
+    // blocks sent from the cache, and decoded from the file
+    uint32_t hits = 0, misses = 0;
+
+    FrameCache(uint32_t budget) {
+        this->mem = budget ? (uint8_t*) malloc(budget) : NULL;
+        this->budget = this->mem ? budget : 0;
+        this->owned = true;
+    }
+
+    // Same, in budget bytes at mem - which it leaves alone when it's done
+    FrameCache(uint32_t budget, uint8_t* mem) {
+        this->mem = mem;
+        this->budget = mem ? budget : 0;
+    }
+
+    ~FrameCache() {
+        if (this->owned)
+            free(this->mem);
+    }
+
+    // Empties the cache, and starts recording from the next block unless record is false
+    void clear(bool record = true) {
+        this->used = this->block_start = 0;
+        this->blocks = 0;
+        this->recording = record && this->budget > 0;
+        this->complete = this->whole_loop = false;
+        this->hits = this->misses = 0;
+    }
+
+    // The decoder's state at pos has to be in the resume_ fields already
+    void start_block(uint32_t pos, uint8_t flags, uint16_t duration, uint16_t x, uint16_t y, uint16_t w, uint16_t h) {
+        this->resume_pos = pos;
+        this->block_start = this->used;
+        if (!this->reserve(sizeof(FrameCacheBlock)))
+            return;
+        FrameCacheBlock* b = (FrameCacheBlock*) (this->mem + this->used);
+        *b = {flags, duration, x, y, w, h, 0};
+        this->used += sizeof(FrameCacheBlock);
+    }
+
+    void add_pixels(const uint16_t* px, uint32_t len) {
+        uint32_t sz = (len * sizeof(uint16_t) + 3) & ~3;
+        if (!this->reserve(sizeof(uint32_t) + sz))
+            return;
+        *(uint32_t*) (this->mem + this->used) = len;
+        memcpy(this->mem + this->used + sizeof(uint32_t), px, len * sizeof(uint16_t));
+        this->used += sizeof(uint32_t) + sz;
+    }
+
+    void add_color(uint16_t color, uint32_t len) {
+        if (!this->reserve(2 * sizeof(uint32_t)))
+            return;
+        *(uint32_t*) (this->mem + this->used) = len | FRAMECACHE_COLOR;
+        *(uint32_t*) (this->mem + this->used + sizeof(uint32_t)) = color;
+        this->used += 2 * sizeof(uint32_t);
+    }
+
+    void add_skip(uint32_t len) {
+        if (!this->reserve(sizeof(uint32_t)))
+            return;
+        *(uint32_t*) (this->mem + this->used) = len | FRAMECACHE_SKIP;
+        this->used += sizeof(uint32_t);
+    }
+
+    void end_block() {
+        FrameCacheBlock* b = (FrameCacheBlock*) (this->mem + this->block_start);
+        b->len = this->used - this->block_start - sizeof(FrameCacheBlock);
+        this->blocks++;
+    }
+
+    // Reached the trailer with everything recorded
+    void end_loop() {
+        this->recording = false;
+        this->complete = true;
+        this->whole_loop = true;
+    }
+
+    // Percentage of blocks sent from the cache
+    float hit_rate() {
+        uint32_t total = this->hits + this->misses;
+        return total ? 100.0 * this->hits / total : 0;
+    }
+};
+
+#endif
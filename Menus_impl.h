@@ -2,7 +2,8 @@
 #define _MENUS_IMPL_H_
 
 #include "Adafruit_ILI9341.h"
-#include "TouchScreen.h"
+#include "TouchSampler_impl.h"
+#include "Profiler_impl.h"
 
 #include "colors.h"
 #include "prefs.h"
@@ -24,6 +25,7 @@ uint16_t _write_centered_text(Adafruit_ILI9341* tft, int16_t top, const char* te
 }
 
 uint16_t _render_menu_base(Adafruit_ILI9341* tft, const char* heading) {
+    PROFILE_ZONE("menu base");
     tft->fillScreen(COLOR_BLACK);
     tft->drawRoundRect(0, 0, 240, 320, 4, COLOR_PURPLE);
     tft->setTextColor(COLOR_WHITE, COLOR_BLACK);
@@ -37,11 +39,10 @@ uint16_t _render_menu_base(Adafruit_ILI9341* tft, const char* heading) {
 class Button {
 protected:
     Adafruit_ILI9341* tft;
-    TouchScreen* ts;
+    TouchSampler* touch;
     const char* text;
     uint16_t x1, y1, w, h, text_x, text_y, press_color;
     bool is_pressed = false;
-    long released_at = 0;
 
     bool contains(int16_t x, int16_t y) {
         return
@@ -56,12 +57,12 @@ protected:
     }
 
 public:
-    Button(Adafruit_ILI9341* tft, TouchScreen* ts, const char* text, uint16_t top, float left, float width) {
+    Button(Adafruit_ILI9341* tft, TouchSampler* touch, const char* text, uint16_t top, float left, float width) {
         int16_t  x1, y1;
         uint16_t w, h;
 
         this->tft = tft;
-        this->ts = ts;
+        this->touch = touch;
         this->text = text;
         this->x1 = ((SCREEN_WIDTH - (BUTTON_H_MARGIN * 2)) * left) + BUTTON_H_MARGIN;
         this->y1 = top;
@@ -73,6 +74,7 @@ public:
     }
 
     uint16_t render() {
+        PROFILE_ZONE("button");
         this->tft->fillRect(this->x1, this->y1, this->w, this->h, COLOR_BLACK);
         if (this->is_pressed) {
             this->tft->fillRoundRect(this->x1, this->y1, this->w, this->h, 4, this->get_bgcolor());
@@ -88,31 +90,19 @@ public:
         return this->y1 + this->h;
     }
 
+    // The touch is already filtered and debounced, so this is cheap enough to spin on
     bool check() {
-        TSPoint p = this->ts->getPoint();
-        int16_t x = map(p.x, X_MIN, X_MAX, 0, SCREEN_WIDTH);
-        int16_t y = map(p.y, Y_MIN, Y_MAX, 0, SCREEN_HEIGHT);
-        if (p.z > this->ts->pressureThreshhold) {
-            if (this->contains(x, y)) {
-                this->released_at = 0;
-                if (!this->is_pressed) {
-                    this->is_pressed = true;
-                    this->render();
-                }
-            } else {
-                this->released_at = 0;
-                if (this->is_pressed) {
-                    this->is_pressed = false;
-                    this->render();
-                }
-            }
-        } else {
-            if (!this->released_at) this->released_at = millis();
-            if (millis() - this->released_at >= 50 && this->is_pressed) {
-                this->is_pressed = false;
-                this->released_at = 0;
-                return true;
+        this->touch->poll();
+        TouchState touch = this->touch->get_state();
+        if (touch.down) {
+            bool inside = this->contains(touch.x, touch.y);
+            if (inside != this->is_pressed) {
+                this->is_pressed = inside;
+                this->render();
             }
+        } else if (this->is_pressed) {
+            this->is_pressed = false;
+            return true;
         }
         return false;
     }
@@ -179,6 +169,7 @@ public:
     }
 
     uint16_t render() {
+        PROFILE_ZONE("label");
         this->tft->fillRect(this->x1, this->y1, this->w, this->h, COLOR_BLACK);
         this->tft->setTextColor(COLOR_WHITE, COLOR_BLACK);
         this->tft->setCursor(this->text_x, this->text_y);
@@ -201,7 +192,7 @@ uint8_t _clamp_bri(uint8_t val, int8_t inc) {
     return val + inc;
 }
 
-void backlight_menu(Prefs* prefs, Adafruit_ILI9341* tft, TouchScreen* ts) {
+void backlight_menu(Prefs* prefs, Adafruit_ILI9341* tft, TouchSampler* touch) {
     backlight_menu_top:
     uint16_t top = _render_menu_base(tft, "Backlight");
 
@@ -219,44 +210,44 @@ void backlight_menu(Prefs* prefs, Adafruit_ILI9341* tft, TouchScreen* ts) {
     Label bri_lbl(tft, "Brightness", 1, top + CONTROL_V_MARGIN, 0, 1);
     top = bri_lbl.render();
 
-    Button bri_down(tft, ts, "-10", top + CONTROL_V_MARGIN, 0, .3);
+    Button bri_down(tft, touch, "-10", top + CONTROL_V_MARGIN, 0, .3);
     bri_down.render();
 
     Label bri_val(tft, brightness_s, 2, top + CONTROL_V_MARGIN, .33, .3);
     bri_val.render();
 
-    Button bri_up(tft, ts, "+10", top + CONTROL_V_MARGIN, .66, .3);
+    Button bri_up(tft, touch, "+10", top + CONTROL_V_MARGIN, .66, .3);
     top = bri_up.render();
 
-    Toggle auto_bri(tft, ts, "Auto Brightness", top + CONTROL_V_MARGIN, 0, 1);
+    Toggle auto_bri(tft, touch, "Auto Brightness", top + CONTROL_V_MARGIN, 0, 1);
     top = auto_bri.render();
     auto_bri.set_state(bri_auto);
 
     Label bri_auto_min_lbl(tft, "Auto Min", 1, top + CONTROL_V_MARGIN, 0, 1);
     top = bri_auto_min_lbl.render();
 
-    Button bri_auto_min_down(tft, ts, "-10", top + CONTROL_V_MARGIN, 0, .3);
+    Button bri_auto_min_down(tft, touch, "-10", top + CONTROL_V_MARGIN, 0, .3);
     bri_auto_min_down.render();
 
     Label bri_auto_min_val(tft, bri_auto_min_s, 2, top + CONTROL_V_MARGIN, .33, .3);
     bri_auto_min_val.render();
 
-    Button bri_auto_min_up(tft, ts, "+10", top + CONTROL_V_MARGIN, .66, .3);
+    Button bri_auto_min_up(tft, touch, "+10", top + CONTROL_V_MARGIN, .66, .3);
     top = bri_auto_min_up.render();
 
     Label bri_auto_max_lbl(tft, "Auto Max", 1, top + CONTROL_V_MARGIN, 0, 1);
     top = bri_auto_max_lbl.render();
 
-    Button bri_auto_max_down(tft, ts, "-10", top + CONTROL_V_MARGIN, 0, .3);
+    Button bri_auto_max_down(tft, touch, "-10", top + CONTROL_V_MARGIN, 0, .3);
     bri_auto_max_down.render();
 
     Label bri_auto_max_val(tft, bri_auto_max_s, 2, top + CONTROL_V_MARGIN, .33, .3);
     bri_auto_max_val.render();
 
-    Button bri_auto_max_up(tft, ts, "+10", top + CONTROL_V_MARGIN, .66, .3);
+    Button bri_auto_max_up(tft, touch, "+10", top + CONTROL_V_MARGIN, .66, .3);
     top = bri_auto_max_up.render();
 
-    Button back(tft, ts, "< Back", top + CONTROL_V_MARGIN, 0, 1);
+    Button back(tft, touch, "< Back", top + CONTROL_V_MARGIN, 0, 1);
     top = back.render();
 
     while (true) {
@@ -300,7 +291,7 @@ void backlight_menu(Prefs* prefs, Adafruit_ILI9341* tft, TouchScreen* ts) {
             bri_auto_max_up.render();
         }
         if (back.check()) {
-            write_prefs(prefs);
+            flush_prefs(prefs);
             return;
         }
 
@@ -312,7 +303,7 @@ void backlight_menu(Prefs* prefs, Adafruit_ILI9341* tft, TouchScreen* ts) {
     }
 }
 
-void display_menu(Prefs* prefs, Adafruit_ILI9341* tft, TouchScreen* ts) {
+void display_menu(Prefs* prefs, Adafruit_ILI9341* tft, TouchSampler* touch) {
     display_menu_top:
     uint16_t top = _render_menu_base(tft, "Display");
 
@@ -322,16 +313,16 @@ void display_menu(Prefs* prefs, Adafruit_ILI9341* tft, TouchScreen* ts) {
     Label disp_time_lbl(tft, "Image Display Time - Seconds", 1, top + CONTROL_V_MARGIN, 0, 1);
     top = disp_time_lbl.render();
 
-    Button disp_time_down(tft, ts, "-10", top + CONTROL_V_MARGIN, 0, .3);
+    Button disp_time_down(tft, touch, "-10", top + CONTROL_V_MARGIN, 0, .3);
     disp_time_down.render();
 
     Label disp_time_val(tft, display_time_s, 2, top + CONTROL_V_MARGIN, .33, .3);
     disp_time_val.render();
 
-    Button disp_time_up(tft, ts, "+10", top + CONTROL_V_MARGIN, .66, .3);
+    Button disp_time_up(tft, touch, "+10", top + CONTROL_V_MARGIN, .66, .3);
     top = disp_time_up.render();
 
-    Button back(tft, ts, "< Back", top + CONTROL_V_MARGIN, 0, 1);
+    Button back(tft, touch, "< Back", top + CONTROL_V_MARGIN, 0, 1);
     top = back.render();
 
     while (true) {
@@ -350,7 +341,7 @@ void display_menu(Prefs* prefs, Adafruit_ILI9341* tft, TouchScreen* ts) {
             disp_time_up.render();
         }
         if (back.check()) {
-            write_prefs(prefs);
+            flush_prefs(prefs);
             return;
         }
 
@@ -358,23 +349,23 @@ void display_menu(Prefs* prefs, Adafruit_ILI9341* tft, TouchScreen* ts) {
     }
 }
 
-void main_menu(Prefs* prefs, Adafruit_ILI9341* tft, TouchScreen* ts) {
+void main_menu(Prefs* prefs, Adafruit_ILI9341* tft, TouchSampler* touch) {
     main_menu_top:
     uint16_t top = _render_menu_base(tft, "Menu");
-    Button backlight(tft, ts, "Backlight", top + CONTROL_V_MARGIN, 0, 1);
+    Button backlight(tft, touch, "Backlight", top + CONTROL_V_MARGIN, 0, 1);
     top = backlight.render();
-    Button display(tft, ts, "Display", top + CONTROL_V_MARGIN, 0, 1);
+    Button display(tft, touch, "Display", top + CONTROL_V_MARGIN, 0, 1);
     top = display.render();
-    Button back(tft, ts, "< Back", top + CONTROL_V_MARGIN, 0, 1);
+    Button back(tft, touch, "< Back", top + CONTROL_V_MARGIN, 0, 1);
     top = back.render();
 
     while (true) {
         if (backlight.check()) {
-            backlight_menu(prefs, tft, ts);
+            backlight_menu(prefs, tft, touch);
             goto main_menu_top;
         }
         if (display.check()) {
-            display_menu(prefs, tft, ts);
+            display_menu(prefs, tft, touch);
             goto main_menu_top;
         }
         if (back.check()) {
@@ -0,0 +1,69 @@
+#ifndef _PIXELSINK_IMPL_H_
+#define _PIXELSINK_IMPL_H_
+
+#include <Arduino.h>
+
+// Anything the decoders can draw into - the badge's display, or a stand-in on the host
+class PixelSink {
+public:
+    virtual ~PixelSink() {}
+
+    virtual void startWrite() = 0;
+    virtual void endWrite() = 0;
+    // Blocks until any transfer started by writePixels has finished with its buffer
+    virtual void dmaWait() = 0;
+    // Whether dmaWait() would block right now
+    virtual bool dmaBusy() = 0;
+    virtual void setAddrWindow(uint16_t x, uint16_t y, uint16_t w, uint16_t h) = 0;
+    // May return before the transfer is done - colors must be left alone until dmaWait()
+    virtual void writePixels(uint16_t* colors, uint32_t len) = 0;
+    virtual void writeColor(uint16_t color, uint32_t len) = 0;
+    // The next transfers are a new frame, for sinks that time them to the panel
+    virtual void startFrame() {}
+    // How long a transfer down to line would be held back if it started now, for the same sinks
+    virtual uint32_t holdUs(uint16_t line) { return 0; }
+};
+
+#if defined(ARDUINO)
+#include "Adafruit_ILI9341.h"
+
+class ILI9341Sink : public PixelSink {
+private:
+    Adafruit_ILI9341* tft;
+
+public:
+    ILI9341Sink(Adafruit_ILI9341* tft) {
+        this->tft = tft;
+    }
+
+    void startWrite() {
+        this->tft->startWrite();
+    }
+
+    void endWrite() {
+        this->tft->endWrite();
+    }
+
+    void dmaWait() {
+        this->tft->dmaWait();
+    }
+
+    bool dmaBusy() {
+        return this->tft->dmaBusy();
+    }
+
+    void setAddrWindow(uint16_t x, uint16_t y, uint16_t w, uint16_t h) {
+        this->tft->setAddrWindow(x, y, w, h);
+    }
+
+    void writePixels(uint16_t* colors, uint32_t len) {
+        this->tft->writePixels(colors, len, false);
+    }
+
+    void writeColor(uint16_t color, uint32_t len) {
+        this->tft->writeColor(color, len);
+    }
+};
+#endif
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef _PROFILER_IMPL_H_
+#define _PROFILER_IMPL_H_
+
+#include <Arduino.h>
+
+#include "constants.h"
+
+// Where the time goes inside the hot paths. PROFILE_ZONE("name") times from where it is to the
+// end of the enclosing block, into a table of every zone's count, total and longest - zones
+// nest, each counting everything inside it. Send 'p' over Serial for the report and 'r' to start
+// again (see profiler_serial()). With PROFILER 0 it all compiles to nothing.
+//
+// Not for anything that runs in an interrupt, the table isn't guarded.
+
+#if PROFILER
+#define PROFILE_ZONES 16
+
+#if defined(ARDUINO)
+// DWT's cycle counter, which wraps every 35s at 120MHz - fine for anything that can be a zone
+#define PROFILE_TICKS_PER_US (F_CPU / 1000000)
+
+inline uint32_t profile_ticks() {
+    return DWT->CYCCNT;
+}
+#else
+#include <chrono>
+
+#define PROFILE_TICKS_PER_US 1000
+
+inline uint32_t profile_ticks() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+#endif
+
+typedef struct {
+    const char* name;
+    uint32_t count, longest;
+    uint64_t total;
+} ProfileZone;
+
+ProfileZone profile_zones[PROFILE_ZONES];
+uint8_t profile_zone_count = 0;
+
+// The zone's place in the table, PROFILE_ZONES if it's full
+uint8_t profile_zone(const char* name) {
+    if (profile_zone_count == PROFILE_ZONES)
+        return PROFILE_ZONES;
+    profile_zones[profile_zone_count] = {name, 0, 0, 0};
+    return profile_zone_count++;
+}
+
+class ProfileScope {
+private:
+    uint8_t zone;
+    uint32_t start;
+
+public:
+    ProfileScope(uint8_t zone) {
+        this->zone = zone;
+        this->start = profile_ticks();
+    }
+
+    ~ProfileScope() {
+        uint32_t ticks = profile_ticks() - this->start;
+        if (this->zone == PROFILE_ZONES)
+            return;
+        ProfileZone* z = &profile_zones[this->zone];
+        z->count++;
+        z->total += ticks;
+        if (ticks > z->longest)
+            z->longest = ticks;
+    }
+};
+
+#define PROFILE_JOIN2(a, b) a##b
+#define PROFILE_JOIN(a, b) PROFILE_JOIN2(a, b)
+// Each zone finds its place in the table the first time it's entered
+#define PROFILE_ZONE(name) \
+    static uint8_t PROFILE_JOIN(profile_zone_, __LINE__) = profile_zone(name); \
+    ProfileScope PROFILE_JOIN(profile_scope_, __LINE__)(PROFILE_JOIN(profile_zone_, __LINE__))
+
+void profiler_begin() {
+#if defined(ARDUINO)
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+}
+
+void profiler_reset() {
+    for (uint8_t i = 0; i < profile_zone_count; i++) {
+        profile_zones[i].count = 0;
+        profile_zones[i].longest = 0;
+        profile_zones[i].total = 0;
+    }
+}
+
+void profiler_report() {
+    char line[80];
+    Serial.println("Zone                  count     total us   mean ns    max us");
+    for (uint8_t i = 0; i < profile_zone_count; i++) {
+        ProfileZone* z = &profile_zones[i];
+        snprintf(line, sizeof(line), "%-16s %10lu %12lu %9lu %9lu", z->name, (unsigned long) z->count,
+            (unsigned long) (z->total / PROFILE_TICKS_PER_US),
+            (unsigned long) (z->count ? z->total * 1000 / z->count / PROFILE_TICKS_PER_US : 0),
+            (unsigned long) (z->longest / PROFILE_TICKS_PER_US));
+        Serial.println(line);
+    }
+}
+
+// Call whenever there's time to look at Serial
+void profiler_serial() {
+    while (Serial.available()) {
+        switch (Serial.read()) {
+            case 'p':
+                profiler_report();
+                break;
+            case 'r':
+                profiler_reset();
+                Serial.println("Profiler reset");
+                break;
+        }
+    }
+}
+
+#else
+#define PROFILE_ZONE(name)
+
+inline void profiler_begin() {}
+inline void profiler_reset() {}
+inline void profiler_report() {}
+inline void profiler_serial() {}
+#endif
+
+#endif
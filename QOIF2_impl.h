@@ -2,9 +2,14 @@
 #define _QOIF2_IMPL_H_
 
 #include <Arduino.h>
-#include "Adafruit_ILI9341.h"
+#include <new>
 
+#include "constants.h"
+#include "ByteSource_impl.h"
+#include "PixelSink_impl.h"
 #include "FileBuffer_impl.h"
+#include "FrameCache_impl.h"
+#include "Profiler_impl.h"
 
 // QOIF2
 typedef struct __attribute__ ((packed)) {
@@ -36,64 +41,876 @@ typedef struct __attribute__ ((packed)) {
     uint32_t y;
 } QOIF2BlockHeader2Big;
 
+// Version 3 - one per frame after the trailer, then the footer at the end of the file
+typedef struct __attribute__ ((packed)) {
+    uint32_t frame;
+    uint32_t offset;
+    uint32_t time_ms;
+    uint8_t flags;
+} QOIF2IndexEntry;
+
+typedef struct __attribute__ ((packed)) {
+    uint32_t count;
+    uint32_t index_offset;
+    uint32_t magic;
+} QOIF2Footer;
+
 #define QOIF2_E_MAGIC 1
 #define QOIF2_E_DIMENSIONS 2
 #define QOIF2_E_CHANNELS 3
 #define QOIF2_E_VERSION 4
 #define QOIF2_E_TRAILER 5
+#define QOIF2_E_DATA 6
+#define QOIF2_E_INDEX 7
+#define QOIF2_E_SEEK 8
 
 #define QOIF2_F_THUMB 1
 #define QOIF2_F_START 2
 #define QOIF2_F_END 4
 #define QOIF2_F_BIG 8
+// Version 3 - reset the decoder's state before this block, the first of a whole frame
+#define QOIF2_F_KEY 16
+// Version 4 - the block data starts with a palette, which is used from this block on
+#define QOIF2_F_PALETTE 32
+// Version 4 - the block's all one color, and its data (after any palette) is just that color as
+// 565 - drawn as one run, without decoding anything. It leaves the decoder's state alone.
+#define QOIF2_F_FILL 64
 
 #define QOIF2_B_ONE_FRAME 101
 #define QOIF2_B_END 102
 #define QOIF2_B_DELAY 103
 #define QOIF2_B_CONTINUE 104
+// Out of budget part way through the block, or the display's holding it back for longer than
+// the budget has left - the next call carries on with it
+#define QOIF2_B_PARTIAL 105
 
 #define QOIF2_MAGIC 0x46696f71
-#define QOIF2_VERSION 2
+#define QOIF2_INDEX_MAGIC 0x49696f71
+// Oldest version that still plays, and the newest
+#define QOIF2_VERSION_MIN 2
+#define QOIF2_VERSION 4
 // #define QOIF2_TRAILER b'\x00\x00\x00\x00\x00\x00\x00\x01'
 // #define QOIF2_READ_BUF_SZ 30000
 #define QOIF2_READ_BUF_SZ 10000
+// Bytes of the file buffered ahead of the decoder, a power of two for FileBuffer
+#define QOIF2_FILE_BUF_SZ 8192
+// Files whose blocks fit in this much are read into memory whole instead, and never touch the
+// card again however many times they loop - see QOIF2::resident_max
+#ifndef QOIF2_RESIDENT_BYTES
+#define QOIF2_RESIDENT_BYTES 32768
+#endif
+// Longest ops, RGB and skip - the decoder only starts an op when this much is in the buffer
+#define QOIF2_MAX_OP 3
+// Most read ahead from the card in one go, one SD sector
+#define QOIF2_FILL_SLICE 512
+// With a budget, block data is decoded this many bytes at a time between checking it
+#define QOIF2_BUDGET_SPAN 256
+// and the most pixels that can be sent before the next check, if they're all runs
+#define QOIF2_BUDGET_SPAN_PX (QOIF2_BUDGET_SPAN * 62)
+// Index entries read at once when looking for a keyframe to catch up to
+#define QOIF2_INDEX_CHUNK 8
+// Runs of identical pixels at least this long are sent with writeColor instead of being copied
+// into the pixel buffer, until qoif2_calibrate_run_threshold has measured the display
+#define QOIF2_RUN_THRESHOLD 512
+// Threshold for a display where writeColor never pays off
+#define QOIF2_RUN_NEVER 0xffff
+
+#define QOIF2_OP_INDEX 0
+#define QOIF2_OP_DIFF 1
+#define QOIF2_OP_LUMA 2
+#define QOIF2_OP_RUN 3
+#define QOIF2_OP_RGB 4
+// Version 4 - 0xff then a 2 byte count of pixels already on the screen, which aren't sent.
+// QOI's RGBA op in its place never appears in a 16 bit file.
+#define QOIF2_OP_SKIP 5
+// With this bit set in the count it's a literal instead - that many pixels follow, 565 little
+// endian like the RGB op, and they're copied as they are
+#define QOIF2_LITERAL 0x8000
+// Most of a literal copied in one go, so it never needs more than the file buffer holds
+#define QOIF2_LITERAL_CHUNK 2048
+// Version 4 files with 1 channel store palette indexes instead of 565 colors, in the RGB op and
+// literals - everything else still works on the colors they stand for. The file's palette is
+// after the header, and a block with QOIF2_F_PALETTE starts with one of its own. Each is a 2 byte
+// count of entries, then the entries as 565. Keyframes go back to the file's palette.
+#define QOIF2_PALETTE_SIZE 256
+// Pixel formats the decoder's built for, one instantiation of decode_block each so the decode
+// loop never checks which it's doing - picked from the file's channels when it's opened
+#define QOIF2_FMT_565 0
+#define QOIF2_FMT_PALETTE 1
+// 24 bit, decoded in 8 bit channels as the encoder works on them and sent as 565
+#define QOIF2_FMT_RGB 2
+// Longest op in a 24 bit file, QOI's RGBA - which is what 0xff is in them
+#define QOIF2_MAX_OP_RGB 5
+
+// Everything the decoder needs to know about a tag byte, so each op costs one table lookup
+typedef struct {
+    uint8_t op;
+    // cache index for QOIF2_OP_INDEX, pixel count for QOIF2_OP_RUN
+    uint8_t arg;
+    // added straight to the packed 565 pixel, wrapping - for luma this is only the green
+    // part, the second byte's red/blue part comes from QOIF2_LUMA_RB
+    uint16_t delta;
+} QOIF2Op;
+
+// Channels never leave their range in a valid file, so adding the packed deltas can't carry
+// from one channel into the next
+constexpr uint16_t qoif2_delta_565(int dr, int dg, int db) {
+    return (uint16_t) (dr * (1 << 11) + dg * (1 << 5) + db);
+}
+
+constexpr QOIF2Op qoif2_op(uint8_t tag) {
+    return
+        tag == 0xff ? QOIF2Op{QOIF2_OP_SKIP, 0, 0} :
+        tag == 0xfe ? QOIF2Op{QOIF2_OP_RGB, 0, 0} :
+        (tag >> 6) == 0 ? QOIF2Op{QOIF2_OP_INDEX, (uint8_t) (tag & 0b111111), 0} :
+        (tag >> 6) == 1 ? QOIF2Op{QOIF2_OP_DIFF, 1, qoif2_delta_565(((tag >> 4) & 0b11) - 2, ((tag >> 2) & 0b11) - 2, (tag & 0b11) - 2)} :
+        (tag >> 6) == 2 ? QOIF2Op{QOIF2_OP_LUMA, 1, qoif2_delta_565((tag & 0b111111) - 32, (tag & 0b111111) - 32, (tag & 0b111111) - 32)} :
+        QOIF2Op{QOIF2_OP_RUN, (uint8_t) ((tag & 0b111111) + 1), 0};
+}
+
+constexpr uint16_t qoif2_luma_rb(uint8_t arg) {
+    return qoif2_delta_565((arg >> 4) - 8, 0, (arg & 0b1111) - 8);
+}
+
+// A 24 bit decoder's RGBA, red in the low byte, as 565 the way the encoder converts it
+constexpr uint16_t qoif2_rgb_565(uint32_t rgba) {
+    return ((rgba & 0xf8) << 8) | ((rgba >> 5) & 0x7e0) | ((rgba >> 19) & 0x1f);
+}
+
+#define QOIF2_TABLE_4(fn, n) fn(n), fn(n + 1), fn(n + 2), fn(n + 3)
+#define QOIF2_TABLE_16(fn, n) QOIF2_TABLE_4(fn, n), QOIF2_TABLE_4(fn, n + 4), QOIF2_TABLE_4(fn, n + 8), QOIF2_TABLE_4(fn, n + 12)
+#define QOIF2_TABLE_64(fn, n) QOIF2_TABLE_16(fn, n), QOIF2_TABLE_16(fn, n + 16), QOIF2_TABLE_16(fn, n + 32), QOIF2_TABLE_16(fn, n + 48)
+#define QOIF2_TABLE_256(fn) QOIF2_TABLE_64(fn, 0), QOIF2_TABLE_64(fn, 64), QOIF2_TABLE_64(fn, 128), QOIF2_TABLE_64(fn, 192)
+
+static constexpr QOIF2Op QOIF2_OPS[256] = {QOIF2_TABLE_256(qoif2_op)};
+static constexpr uint16_t QOIF2_LUMA_RB[256] = {QOIF2_TABLE_256(qoif2_luma_rb)};
+
+static_assert(QOIF2_OPS[0x40 | (2 << 4) | (2 << 2) | 2].delta == 0, "diff op with no change");
+static_assert(QOIF2_OPS[0xc0].arg == 1 && QOIF2_OPS[0xfd].arg == 62, "run lengths");
+static_assert(QOIF2_OPS[0x80 | 33].delta == qoif2_delta_565(1, 1, 1), "luma green applies to all channels");
+
+
+// What one block cost on the display bus
+typedef struct {
+    // writePixels and writeColor calls
+    uint16_t transfers;
+    uint32_t pixels;
+    // runs of 2 or more identical pixels, copied into the pixel buffer or sent with writeColor
+    uint16_t runs_inlined;
+    uint16_t runs_filled;
+} QOIF2BlockStats;
+
+// How playing has kept to the file's timing, since the first block
+typedef struct {
+    // frames shown, shown after they were due, and skipped to catch up
+    uint32_t frames;
+    uint32_t late;
+    uint32_t dropped;
+    // the file's durations of all those frames, shown or not
+    uint32_t authored_ms;
+    // millis() when the first frame started
+    uint32_t start_ms;
+} QOIF2PlayStats;
+
+// Where the time went on the last frame, or the one being drawn - over every call it took
+typedef struct {
+    // in read_and_render_block, and of that waiting on the card and the display
+    uint32_t busy_us;
+    uint32_t read_us;
+    uint32_t dma_us;
+    // block data read from the file, not counting blocks from the frame cache
+    uint32_t bytes;
+    uint32_t pixels;
+    // how long after it was due it finished
+    uint32_t late_ms;
+} QOIF2FrameStats;
+
+#define QOIF2_CAL_PX 512
+#define QOIF2_CAL_REPEAT 32
+
+// Times the display to find how long a run has to be before writeColor beats copying it into the
+// pixel buffer. writeColor costs two transfer setups (the buffer has to be sent before it, and
+// the fill itself), so it only wins once the run is long enough to make up for them:
+//     n * (store + dma_px) > 2 * setup + n * color_px
+// Draws color over the top of the screen, so call it while the screen is that color.
+uint16_t qoif2_calibrate_run_threshold(PixelSink* sink, uint16_t color) {
+    uint16_t px[QOIF2_CAL_PX];
+    unsigned long start;
+    float setup, dma_px, color_px, store;
+
+    sink->startWrite();
+    sink->setAddrWindow(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT);
+
+    start = micros();
+    for (int i = 0; i < QOIF2_CAL_REPEAT; i++)
+        for (int j = 0; j < QOIF2_CAL_PX; j++)
+            px[j] = color;
+    store = (float) (micros() - start) / (QOIF2_CAL_REPEAT * QOIF2_CAL_PX);
+
+    start = micros();
+    for (int i = 0; i < QOIF2_CAL_REPEAT; i++) {
+        sink->writePixels(px, 1);
+        sink->dmaWait();
+    }
+    setup = (float) (micros() - start) / QOIF2_CAL_REPEAT;
+
+    start = micros();
+    for (int i = 0; i < QOIF2_CAL_REPEAT; i++) {
+        sink->writePixels(px, QOIF2_CAL_PX);
+        sink->dmaWait();
+    }
+    dma_px = ((float) (micros() - start) / QOIF2_CAL_REPEAT - setup) / QOIF2_CAL_PX;
+
+    start = micros();
+    for (int i = 0; i < QOIF2_CAL_REPEAT; i++)
+        sink->writeColor(color, QOIF2_CAL_PX);
+    color_px = ((float) (micros() - start) / QOIF2_CAL_REPEAT - setup) / QOIF2_CAL_PX;
+
+    sink->endWrite();
+
+    float saved_px = store + dma_px - color_px;
+    if (saved_px <= 0)
+        return QOIF2_RUN_NEVER;
+    float threshold = 2 * setup / saved_px + 1;
+    if (threshold < 2)
+        return 2;
+    if (threshold >= QOIF2_RUN_NEVER)
+        return QOIF2_RUN_NEVER;
+    return (uint16_t) threshold;
+}
+
+// What the decoder decodes into and sends from. Only one decoder draws at a time, so every
+// decoder shares the same two - the next file can be opened and buffered while the last one's
+// still playing, but it mustn't draw until the display's done with the last one's transfers.
+typedef uint16_t QOIF2PixelBuffer[QOIF2_READ_BUF_SZ];
+
+inline QOIF2PixelBuffer* qoif2_pixel_buffers() {
+    static QOIF2PixelBuffer buffers[2];
+    return buffers;
+}
+
+class QOIF2;
+
+// Where a resident file is read into, if it doesn't fit in the decoder's own file buffer. Only
+// the file that's playing needs to be, so decoders given memory share one: a decoder opened while
+// it's free takes it, and one opened while it isn't - the next file, opened while the last one
+// plays - streams until make_resident().
+typedef struct {
+    uint8_t buf[QOIF2_RESIDENT_BYTES];
+    // the decoder using it, NULL while it's free
+    QOIF2* owner;
+} QOIF2ResidentMemory;
+
+// Everything else a decoder needs for a file, so it can be given memory it keeps from one file
+// to the next instead of allocating it in open()
+typedef struct {
+    alignas(FileBuffer) uint8_t read_buf[sizeof(FileBuffer)];
+    // streaming, or the whole file if it fits
+    uint8_t file_buf[FILEBUFFER_MEM(QOIF2_FILE_BUF_SZ)];
+    // the whole file, shared with other decoders - NULL to always stream
+    QOIF2ResidentMemory* resident;
+} QOIF2Memory;
 
 
 class QOIF2 {
 private:
-    Adafruit_ILI9341* tft;
-    File* fp;
+    PixelSink* sink;
+    ByteSource* src;
     QOIF2FileHeader fh;
     QOIF2BlockHeader1 bh1;
     QOIF2BlockHeader2 bh2;
     QOIF2BlockHeader2Big bh2b;
     unsigned int width, height, x, y;
     int frame_count = 0;
-    int8_t dr, dg, db;
-    uint8_t r, g, b, run;
-    long blocks_start, frame_start;
-    uint32_t trailer_temp;
-    uint16_t cache[64], cur_px, last_px = 0, buffer[2][QOIF2_READ_BUF_SZ], wbufpos = 0, rbufpos = 0;
-    uint8_t wbuf = 0, rbuf = 0, tag, arg1, arg2;
-    FileBuffer *read_buf;
+    // frame of the loop being drawn, and the version 3 index - index_count is 0 without one
+    uint32_t frame_num = 0, index_count = 0, index_offset = 0;
+    long blocks_start;
+    uint16_t cache[64] = {0}, last_px = 0, rbufpos = 0;
+    // palette indexes expand through palette, which is file_palette until a block changes it
+    uint16_t palette[QOIF2_PALETTE_SIZE] = {0}, file_palette[QOIF2_PALETTE_SIZE] = {0};
+    // a 24 bit file's previous pixel and cache are RGBA instead
+    uint32_t last_rgb = 0, rgb_cache[64] = {0};
+    uint8_t format = QOIF2_FMT_565;
+    // decode_block for the format
+    int (QOIF2::*decode_fn)() = &QOIF2::decode_block<QOIF2_FMT_565>;
+    QOIF2PixelBuffer* buffer = qoif2_pixel_buffers();
+    uint8_t rbuf = 0;
+    bool window_pending = false, replaying = false;
+    // Pixels of the block sent or skipped so far. After a skip part way along a row, the window's
+    // only the rest of that row, and row_left is what's left of it - 0 when it's the whole width.
+    uint32_t block_px = 0, row_left = 0;
+    FileBuffer *read_buf = NULL;
+    QOIF2Memory* mem;
+    FrameCache *frame_cache = NULL;
+    // next block to send from the frame cache
+    int replay_block = 0;
+    uint32_t replay_off = 0;
+    // A block left part way through when the budget ran out: the block data left, the run
+    // being collected, and where in the frame cache's copy it had got to
+    bool in_block = false;
+    uint32_t block_left = 0, block_run = 0, replay_at = 0;
+    // when this call started, and the pixels of this block decoded by then
+    uint32_t call_us = 0, call_px = 0;
+    // Frames are due at a fixed time from the first one - play.start_ms + play.authored_ms for
+    // the next - so time lost on one comes out of the next delay instead of adding up.
+    // loop_ms is where this loop started on that timeline, which index times are relative to.
+    bool playing = false, frame_next = true;
+    uint32_t loop_ms = 0;
+    // the last frame with a duration was late - frames without one are never due, so there's
+    // only any catching up to do after one that has
+    bool behind = false;
+    // first keyframe after this frame that's known not to be due yet, index_count if there
+    // aren't any more this loop, 0 if it's not been looked for
+    uint32_t next_key = 0, next_key_ms = 0;
+    // A resident file's keyframes from the index, kept in its buffer after the blocks so finding
+    // one never touches the card - NULL when the file's streamed
+    QOIF2IndexEntry* keys = NULL;
+    uint32_t key_count = 0;
+    // read from the index, which doesn't go through the file buffer
+    uint32_t index_read = 0;
+
+    // Starts sending the buffer being decoded into, and carries on decoding into the other one.
+    // The bus only runs one transfer at a time, so the other buffer's transfer has to be done
+    // before this one can start - and that's the only time the decoder waits on the display.
+    void flush() {
+        this->send(this->buffer[this->rbuf], 0, this->rbufpos);
+        if (this->frame_cache && this->frame_cache->recording)
+            this->frame_cache->add_pixels(this->buffer[this->rbuf], this->rbufpos);
+        this->rbuf = this->rbuf ? 0 : 1;
+        this->rbufpos = 0;
+    }
+
+    // Sends len pixels, from colors or all color if there aren't any - opening the window first,
+    // and again where one that's only the rest of a row runs out
+    void send(uint16_t* colors, uint16_t color, uint32_t len) {
+        while (len) {
+            this->wait_display();
+            if (this->window_pending)
+                this->start_window();
+            uint32_t n = this->row_left ? min(len, this->row_left) : len;
+            if (colors) {
+                this->sink->writePixels(colors, n);
+                colors += n;
+            } else {
+                this->sink->writeColor(color, n);
+            }
+            this->stats.transfers++;
+            this->stats.pixels += n;
+            this->block_px += n;
+            len -= n;
+            if (this->row_left) {
+                this->row_left -= n;
+                this->window_pending = !this->row_left;
+            }
+        }
+    }
+
+    // Leaves len pixels as they are on the screen - the window's opened again after them when
+    // there's something to send
+    void skip(uint32_t len) {
+        this->block_px += len;
+        this->row_left = 0;
+        this->window_pending = true;
+        if (this->frame_cache && this->frame_cache->recording)
+            this->frame_cache->add_skip(len);
+    }
+
+    // Copies a literal of len pixels from the file buffer into the pixel buffer, and takes them
+    // out of left - false if the block or the file ends first. The pixels don't go in the cache,
+    // the last of them is just the previous pixel.
+    template <uint8_t FMT>
+    bool copy_literal(uint32_t len, uint32_t* left) {
+        uint8_t px_bytes = FMT == QOIF2_FMT_PALETTE ? 1 : 2;
+        if (len * px_bytes > *left)
+            return false;
+        *left -= len * px_bytes;
+        while (len) {
+            // the pixel before it might have just filled the buffer
+            if (this->rbufpos == QOIF2_READ_BUF_SZ)
+                this->flush();
+            uint16_t* out = this->buffer[this->rbuf] + this->rbufpos;
+            uint32_t n = min(len, (uint32_t) min(QOIF2_READ_BUF_SZ - this->rbufpos, QOIF2_LITERAL_CHUNK));
+            if (FMT == QOIF2_FMT_PALETTE) {
+                // the indexes go in the second half of where their colors will be, so they can
+                // be expanded in place - each is read before its color's written over it
+                uint8_t* idx = (uint8_t*) out + n;
+                if (this->read_buf->read(idx, n) < 0)
+                    return false;
+                for (uint32_t i = 0; i < n; i++)
+                    out[i] = this->palette[idx[i]];
+            } else if (this->read_buf->read((uint8_t*) out, n * 2) < 0) {
+                return false;
+            }
+            this->last_px = out[n - 1];
+            this->rbufpos += n;
+            len -= n;
+        }
+        if (this->rbufpos == QOIF2_READ_BUF_SZ)
+            this->flush();
+        return true;
+    }
+
+    // Puts a run of identical pixels in the buffer, or sends it with writeColor if it's long
+    // enough that splitting the transfer for it is worth it
+    void place_run(uint16_t px, uint32_t len) {
+        if (len >= this->run_threshold) {
+            this->fill(px, len);
+            return;
+        }
+        this->stats.runs_inlined++;
+        while (len) {
+            uint16_t* out = this->buffer[this->rbuf] + this->rbufpos;
+            uint32_t n = min(len, (uint32_t) (QOIF2_READ_BUF_SZ - this->rbufpos));
+            for (uint32_t i = 0; i < n; i++)
+                out[i] = px;
+            this->rbufpos += n;
+            len -= n;
+            if (this->rbufpos == QOIF2_READ_BUF_SZ)
+                this->flush();
+        }
+    }
+
+    // The block's address window is only set once its first pixels are ready, so the start of
+    // the block decodes while the previous block is still being sent. It starts where the block's
+    // got to, the rest of a row on its own if that's part way along one.
+    void start_window() {
+        uint32_t row = this->block_px / this->width, col = this->block_px % this->width;
+        this->sink->endWrite();
+        this->sink->startWrite();
+        if (col) {
+            this->sink->setAddrWindow(this->x + col, this->y + row, this->width - col, 1);
+            this->row_left = this->width - col;
+        } else {
+            this->sink->setAddrWindow(this->x, this->y + row, this->width, this->height - row);
+            this->row_left = 0;
+        }
+        this->window_pending = false;
+    }
+
+    // Reads ahead from the card for as long as the display is still busy, then waits for it
+    void wait_display() {
+        uint32_t start = micros();
+        while (this->sink->dmaBusy() && this->streaming() && this->read_buf->fill_slice(QOIF2_FILL_SLICE));
+        this->sink->dmaWait();
+        this->frame_stats.dma_us += micros() - start;
+    }
+
+    // Sends whatever is in the buffer, then the run straight to the display
+    void fill(uint16_t px, uint32_t len) {
+        if (this->rbufpos)
+            this->flush();
+        this->send(NULL, px, len);
+        if (this->frame_cache && this->frame_cache->recording)
+            this->frame_cache->add_color(px, len);
+        this->stats.runs_filled++;
+    }
+
+    // Whether this call's used up its budget, with pending pixels decoded but not yet sent
+    bool over_budget(uint32_t pending) {
+        if (this->budget_px && this->stats.pixels + pending - this->call_px >= this->budget_px)
+            return true;
+        return this->budget_us && micros() - this->call_us >= this->budget_us;
+    }
+
+    // Whether the sink would hold the next len pixels back for longer than the budget has left -
+    // better to wait back in the player, where input's looked at, than spinning in the sink
+    bool held(uint32_t len) {
+        if (!this->budget_us || !this->width)
+            return false;
+        uint32_t last = (this->block_px + max(len, (uint32_t) 1) - 1) / this->width;
+        uint32_t hold = this->sink->holdUs(this->y + min(last, (uint32_t) this->height - 1));
+        return hold && micros() - this->call_us + hold >= this->budget_us;
+    }
+
+    // Whether the file still needs reading - not once the whole loop is in the frame cache
+    bool streaming() {
+        return !(this->frame_cache && this->frame_cache->whole_loop);
+    }
+
+    bool paletted() {
+        return this->format == QOIF2_FMT_PALETTE;
+    }
+
+    // Back to the state the encoder starts from, at the start of the loop and every keyframe
+    void reset_state() {
+        if (this->format == QOIF2_FMT_RGB) {
+            // opaque black
+            this->last_rgb = 0xff000000;
+            this->last_px = qoif2_rgb_565(this->last_rgb);
+            memset(this->rgb_cache, 0, sizeof(this->rgb_cache));
+            return;
+        }
+        this->last_px = 0;
+        memset(this->cache, 0, sizeof(this->cache));
+        if (this->paletted())
+            memcpy(this->palette, this->file_palette, sizeof(this->palette));
+    }
+
+    // Keeps the state in the frame cache at the block it's starting, so streaming can carry on
+    // from there if that block doesn't fit - only what the format uses
+    void save_state(FrameCache* fc) {
+        if (this->format == QOIF2_FMT_RGB) {
+            fc->resume_rgb = this->last_rgb;
+            memcpy(fc->resume_rgb_cache, this->rgb_cache, sizeof(this->rgb_cache));
+            return;
+        }
+        fc->resume_px = this->last_px;
+        memcpy(fc->resume_cache, this->cache, sizeof(this->cache));
+        if (this->paletted())
+            memcpy(fc->resume_palette, this->palette, sizeof(this->palette));
+    }
+
+    void load_state(FrameCache* fc) {
+        if (this->format == QOIF2_FMT_RGB) {
+            this->last_rgb = fc->resume_rgb;
+            // a run straight away repeats it, as a 565 pixel
+            this->last_px = qoif2_rgb_565(this->last_rgb);
+            memcpy(this->rgb_cache, fc->resume_rgb_cache, sizeof(this->rgb_cache));
+            return;
+        }
+        this->last_px = fc->resume_px;
+        memcpy(this->cache, fc->resume_cache, sizeof(this->cache));
+        if (this->paletted())
+            memcpy(this->palette, fc->resume_palette, sizeof(this->palette));
+    }
+
+    // One op of a 24 bit file, other than a run, from the tag on - returns where it ends
+    inline const uint8_t* rgb_op(const QOIF2Op& op, uint8_t tag, const uint8_t* p, uint32_t* rgba) {
+        uint8_t r = *rgba, g = *rgba >> 8, b = *rgba >> 16, a = *rgba >> 24;
+        switch (op.op) {
+            case QOIF2_OP_INDEX:
+                *rgba = this->rgb_cache[op.arg];
+                return p;
+            case QOIF2_OP_DIFF:
+                r += ((tag >> 4) & 0b11) - 2;
+                g += ((tag >> 2) & 0b11) - 2;
+                b += (tag & 0b11) - 2;
+                break;
+            case QOIF2_OP_LUMA: {
+                int8_t dg = (tag & 0b111111) - 32;
+                r += dg + (*p >> 4) - 8;
+                g += dg;
+                b += dg + (*p & 0b1111) - 8;
+                p++;
+                break;
+            }
+            case QOIF2_OP_RGB:
+                r = p[0];
+                g = p[1];
+                b = p[2];
+                p += 3;
+                break;
+            default:
+                // RGBA
+                r = p[0];
+                g = p[1];
+                b = p[2];
+                a = p[3];
+                p += 4;
+                break;
+        }
+        *rgba = r | (g << 8) | (b << 16) | ((uint32_t) a << 24);
+        this->rgb_cache[(uint8_t) (r * 3 + g * 5 + b * 7 + a * 11) % 64] = *rgba;
+        return p;
+    }
+
+    // Reads a block's palette, returning the bytes it took - or -1 if it's not valid
+    int read_palette() {
+        uint16_t count = 0;
+        if (this->read_buf->read((uint8_t*)&count, sizeof(count)) < 0 || count > QOIF2_PALETTE_SIZE)
+            return -1;
+        if (count && this->read_buf->read((uint8_t*) this->palette, count * 2) < 0)
+            return -1;
+        return sizeof(count) + count * 2;
+    }
+
+    void start_block() {
+        if (!this->playing) {
+            this->playing = true;
+            this->play.start_ms = millis() - this->play.authored_ms;
+        }
+        if (this->bh1.flags & QOIF2_F_START) {
+            this->frame_count++;
+            this->frame_stats = {0, 0, 0, 0, 0, 0};
+            this->sink->startFrame();
+        }
+        this->frame_next = false;
+        this->window_pending = true;
+        this->block_px = this->row_left = 0;
+        this->stats = {0, 0, 0, 0};
+        this->call_px = 0;
+    }
+
+    int end_block() {
+        this->frame_stats.pixels += this->stats.pixels;
+        if (this->bh1.flags & QOIF2_F_END) {
+            this->frame_num++;
+            this->frame_next = true;
+            this->play.frames++;
+            this->play.authored_ms += this->bh1.duration;
+        }
+        if (this->bh1.flags & QOIF2_F_END && this->bh1.duration) {
+            // Only finish the transfer when the frame is followed by a delay, otherwise the next
+            // frame can start decoding while this one is still being sent. The file buffer is
+            // topped up by idle() during the delay.
+            this->wait_display();
+            this->sink->endWrite();
+            this->delay_ms = (long) (this->play.start_ms + this->play.authored_ms - millis());
+            this->delay_diff = (float) this->delay_ms / (float) this->bh1.duration;
+            this->behind = this->delay_ms < 0;
+            if (this->behind) {
+                this->play.late++;
+                this->frame_stats.late_ms = -this->delay_ms;
+            }
+            return QOIF2_B_DELAY;
+        }
+
+        // Serial.println("End of loop");
+        return QOIF2_B_CONTINUE;
+    }
+
+    // The file buffer has already carried on from the first block, so the next call plays the
+    // animation again without seeking or reopening - from a clean state, as the encoder started
+    // with, and from the frame cache if there's anything in it
+    int end_loop() {
+        this->reset_state();
+        this->frame_num = 0;
+        this->frame_next = true;
+        this->loop_ms = this->play.authored_ms;
+        this->next_key = 0;
+        if (this->frame_cache && this->frame_cache->complete && this->frame_cache->blocks) {
+            this->replaying = true;
+            this->replay_block = 0;
+            this->replay_off = 0;
+        }
+        // if only 1 frame, break & delay, otherwise continue the loop
+        if (this->frame_count < 2)
+            return QOIF2_B_ONE_FRAME;
+        return QOIF2_B_END;
+    }
+
+    // Sends the next block from the frame cache, straight from where it's held
+    int replay() {
+        PROFILE_ZONE("replay");
+        FrameCache* fc = this->frame_cache;
+        FrameCacheBlock* b = (FrameCacheBlock*) (fc->mem + this->replay_off);
+        const uint8_t *p = (const uint8_t*) (b + 1), *end = p + b->len;
+
+        if (this->in_block) {
+            p = fc->mem + this->replay_at;
+        } else {
+            this->bh1.flags = b->flags;
+            this->bh1.duration = b->duration;
+            this->x = b->x;
+            this->y = b->y;
+            this->width = b->width;
+            this->height = b->height;
+            this->start_block();
+        }
+
+        while (p < end) {
+            uint32_t len = *(const uint32_t*) p;
+            if (!(len & FRAMECACHE_SKIP) && this->held(len & ~FRAMECACHE_COLOR)) {
+                this->in_block = true;
+                this->replay_at = p - fc->mem;
+                return QOIF2_B_PARTIAL;
+            }
+            p += sizeof(uint32_t);
+            if (len & FRAMECACHE_SKIP) {
+                this->skip(len & ~FRAMECACHE_SKIP);
+            } else if (len & FRAMECACHE_COLOR) {
+                this->send(NULL, *(const uint16_t*) p, len & ~FRAMECACHE_COLOR);
+                p += sizeof(uint32_t);
+            } else {
+                this->send((uint16_t*) p, 0, len);
+                p += (len * sizeof(uint16_t) + 3) & ~3;
+            }
+            if (p < end && this->over_budget(0)) {
+                this->in_block = true;
+                this->replay_at = p - fc->mem;
+                return QOIF2_B_PARTIAL;
+            }
+        }
+
+        this->in_block = false;
+        this->replay_off = end - fc->mem;
+        this->replay_block++;
+        fc->hits++;
+        return this->end_block();
+    }
+
+    // The frame cache only holds loops played through from the start, and once it's done the
+    // file only loops from where it ends - so skipping about means going back to the whole file
+    void drop_frame_cache() {
+        if (!this->frame_cache)
+            return;
+        this->frame_cache->clear(false);
+        this->read_buf->reset_pos = this->blocks_start;
+    }
+
+    // When the frame that's next is already late, skips ahead to the latest keyframe that's
+    // due - it's drawn whole, so nothing before it's needed. Other frames can't be skipped,
+    // they're drawn over the one before. Needs the version 3 index.
+    void catch_up() {
+        uint32_t now = millis() - this->play.start_ms;
+        if (!this->index_count || !this->behind || (int32_t) (now - this->play.authored_ms) <= 0)
+            return;
+        uint32_t due = now - this->loop_ms;
+        if (this->next_key && (this->next_key >= this->index_count || this->next_key_ms > due))
+            return;
+
+        QOIF2IndexEntry entries[QOIF2_INDEX_CHUNK], key = {0, 0, 0, 0};
+        bool found = false;
+        uint32_t i = this->next_key ? this->next_key : this->frame_num + 1;
+        this->next_key = this->index_count;
+        if (this->keys) {
+            for (uint32_t k = 0; k < this->key_count && this->next_key == this->index_count; k++) {
+                if (this->keys[k].frame >= i)
+                    this->check_key(this->keys[k], due, &key, &found);
+            }
+        } else {
+            this->src->seek(this->index_offset + i * sizeof(QOIF2IndexEntry));
+            while (i < this->index_count && this->next_key == this->index_count) {
+                uint32_t n = min((uint32_t) QOIF2_INDEX_CHUNK, this->index_count - i);
+                if (!this->read_index(entries, n))
+                    break;
+                for (uint32_t j = 0; j < n && this->next_key == this->index_count; j++, i++) {
+                    if (entries[j].flags & QOIF2_F_KEY)
+                        this->check_key(entries[j], due, &key, &found);
+                }
+            }
+            // carry on reading the file from where the buffer had got to
+            this->src->seek(this->read_buf->file_pos);
+        }
+
+        if (!found)
+            return;
+        this->play.dropped += key.frame - this->frame_num;
+        this->play.authored_ms = this->loop_ms + key.time_ms;
+        this->frame_num = key.frame;
+        this->drop_frame_cache();
+        this->read_buf->seek(key.offset);
+    }
+
+    // A keyframe catch_up() comes to - the last one that's due, or the first one that isn't
+    void check_key(const QOIF2IndexEntry& entry, uint32_t due, QOIF2IndexEntry* key, bool* found) {
+        if (entry.time_ms > due) {
+            this->next_key = entry.frame;
+            this->next_key_ms = entry.time_ms;
+        } else {
+            *key = entry;
+            *found = true;
+        }
+    }
+
+    // The next n index entries from the card
+    bool read_index(QOIF2IndexEntry* entries, uint32_t n) {
+        int len = n * sizeof(QOIF2IndexEntry);
+        if (this->src->read((uint8_t*) entries, len) != len)
+            return false;
+        this->index_read += len;
+        return true;
+    }
+
+    // Whether the shared resident memory's there and no other decoder has it
+    bool shared_free() {
+        return this->mem->resident && (!this->mem->resident->owner || this->mem->resident->owner == this);
+    }
+
+    // What a file with len bytes of blocks takes resident, with its keyframes after them - 0 if
+    // it can't be, because it's too big or another decoder has the memory. Leaves src anywhere.
+    uint32_t resident_size(uint32_t len) {
+        uint32_t room = this->resident_max;
+        if (this->mem)
+            room = min(room, (uint32_t) (this->shared_free() ? max(sizeof(this->mem->file_buf), (size_t) QOIF2_RESIDENT_BYTES) : sizeof(this->mem->file_buf)));
+        if (len > room)
+            return 0;
+        uint32_t size = len + (this->index_count ? this->read_keys(NULL) * sizeof(QOIF2IndexEntry) : 0);
+        return size <= room ? size : 0;
+    }
+
+    // Memory for a resident file of size bytes - the decoder's own if it fits, so the shared
+    // memory's left for a file that needs it
+    uint8_t* resident_buf(uint32_t size) {
+        if (size <= sizeof(this->mem->file_buf))
+            return this->mem->file_buf;
+        this->mem->resident->owner = this;
+        return this->mem->resident->buf;
+    }
+
+    // Once a resident file's blocks are in place, its keyframes go after them
+    void load_keys(uint32_t len) {
+        if (!this->index_count)
+            return;
+        this->keys = (QOIF2IndexEntry*) (this->read_buf->buf + len);
+        this->key_count = this->read_keys(this->keys);
+        this->src->seek(this->read_buf->file_pos);
+    }
+
+    // Goes through the whole index for its keyframes, copying them to keys if there's somewhere
+    // to, and returns how many there are
+    uint32_t read_keys(QOIF2IndexEntry* keys) {
+        QOIF2IndexEntry entries[QOIF2_INDEX_CHUNK];
+        uint32_t count = 0;
+        this->src->seek(this->index_offset);
+        for (uint32_t i = 0; i < this->index_count; i += QOIF2_INDEX_CHUNK) {
+            uint32_t n = min((uint32_t) QOIF2_INDEX_CHUNK, this->index_count - i);
+            if (!this->read_index(entries, n))
+                break;
+            for (uint32_t j = 0; j < n; j++) {
+                if (!(entries[j].flags & QOIF2_F_KEY))
+                    continue;
+                if (keys)
+                    keys[count] = entries[j];
+                count++;
+            }
+        }
+        return count;
+    }
 
 public:
     long delay_ms;
     float delay_diff;
+    // see QOIF2_RUN_THRESHOLD
+    uint16_t run_threshold = QOIF2_RUN_THRESHOLD;
+    // How long, and how many pixels, read_and_render_block can take before handing back
+    // QOIF2_B_PARTIAL, so the player can see to other things in the middle of a big block. It
+    // always gets something done first. 0 for no limit.
+    uint32_t budget_us = 0, budget_px = 0;
+    // Largest file, less its header and index, that's read into memory whole when it's opened
+    // rather than streamed - 0 to always stream. With memory given to it, it's limited to
+    // QOIF2_RESIDENT_BYTES, and to when no other decoder has that memory.
+    uint32_t resident_max = QOIF2_RESIDENT_BYTES;
+    // for the last block read
+    QOIF2BlockStats stats;
+    QOIF2PlayStats play = {0, 0, 0, 0, 0};
+    QOIF2FrameStats frame_stats = {0, 0, 0, 0, 0, 0};
 
-    QOIF2(Adafruit_ILI9341* tft, File* fp) {
-        this->tft = tft;
-        this->fp = fp;
+    // Without mem, the file buffer's allocated when it's opened
+    QOIF2(PixelSink* sink, ByteSource* src, QOIF2Memory* mem = NULL) {
+        this->sink = sink;
+        this->src = src;
+        this->mem = mem;
     }
 
     ~QOIF2() {
-        if (this->read_buf)
+        // the pixel buffers are shared with whichever decoder's next, which mustn't start
+        // filling one the display's still reading from
+        this->sink->dmaWait();
+        if (this->mem && this->mem->resident && this->mem->resident->owner == this)
+            this->mem->resident->owner = NULL;
+        if (this->read_buf && this->mem)
+            this->read_buf->~FileBuffer();
+        else if (this->read_buf)
             delete this->read_buf;
     }
 
-    int open() {
+    // Checks the header and sets up the file buffer - filled straight away, or if fill is false,
+    // a slice at a time by idle(), so the file can be opened ahead of time without holding up
+    // whatever's playing
+    int open(bool fill = true) {
         Serial.println("Opening qoif2");
-        this->fp->read((uint8_t*)&this->fh, sizeof(this->fh));
+        this->src->read((uint8_t*)&this->fh, sizeof(this->fh));
         if (this->fh.magic != QOIF2_MAGIC) {
             return QOIF2_E_MAGIC;
         }
@@ -101,47 +918,260 @@ public:
             // TODO: figure out scaling/centering/or just rendering what fits
             return QOIF2_E_DIMENSIONS;
         }
-        if (this->fh.channels != 2) {
-            // TODO: support at least rgb
+        if (this->fh.channels < 1 || this->fh.channels > 3 || (this->fh.channels == 1 && this->fh.version < 4)) {
+            // RGBA would need blending with what's on the screen
             return QOIF2_E_CHANNELS;
         }
-        if (this->fh.version != QOIF2_VERSION) {
+        if (this->fh.version < QOIF2_VERSION_MIN || this->fh.version > QOIF2_VERSION) {
             return QOIF2_E_VERSION;
         }
+        if (this->fh.channels == 1) {
+            this->format = QOIF2_FMT_PALETTE;
+            this->decode_fn = &QOIF2::decode_block<QOIF2_FMT_PALETTE>;
+            uint16_t count = 0;
+            if (this->src->read((uint8_t*)&count, sizeof(count)) != sizeof(count) || count > QOIF2_PALETTE_SIZE
+                    || this->src->read((uint8_t*) this->file_palette, count * 2) != count * 2)
+                return QOIF2_E_CHANNELS;
+        } else if (this->fh.channels == 3) {
+            this->format = QOIF2_FMT_RGB;
+            this->decode_fn = &QOIF2::decode_block<QOIF2_FMT_RGB>;
+        } else {
+            this->format = QOIF2_FMT_565;
+            this->decode_fn = &QOIF2::decode_block<QOIF2_FMT_565>;
+        }
+        this->reset_state();
 
-        blocks_start = this->fp->position();
-        this->read_buf = new FileBuffer(this->fp, QOIF2_READ_BUF_SZ);
+        blocks_start = this->src->position();
+        if (this->fh.version >= 3) {
+            QOIF2Footer footer;
+            this->src->seek(this->src->size() - sizeof(footer));
+            this->src->read((uint8_t*)&footer, sizeof(footer));
+            if (footer.magic != QOIF2_INDEX_MAGIC || footer.index_offset < blocks_start
+                    || footer.index_offset + footer.count * sizeof(QOIF2IndexEntry) + sizeof(footer) != this->src->size()) {
+                return QOIF2_E_INDEX;
+            }
+            this->index_count = footer.count;
+            this->index_offset = footer.index_offset;
+            this->src->seek(blocks_start);
+        }
+        // the index isn't part of the loop
+        long end_pos = this->index_count ? this->index_offset : this->src->size();
+        uint32_t len = end_pos - blocks_start, size = this->resident_size(len);
+        bool resident = size != 0;
+        this->src->seek(blocks_start);
+        if (!resident)
+            size = QOIF2_FILE_BUF_SZ;
+        if (this->mem) {
+            uint8_t* buf = resident ? this->resident_buf(size) : this->mem->file_buf;
+            this->read_buf = new (this->mem->read_buf) FileBuffer(this->src, buf, size, end_pos, fill, resident);
+        } else {
+            this->read_buf = new FileBuffer(this->src, size, end_pos, fill, resident);
+        }
+        if (resident)
+            this->load_keys(len);
 
         return 0;
     }
 
-    int read_and_render_block() {
-        // Serial.println("Reading blocks");
-        this->wbuf = 0;
-        this->rbuf = 0;
-        this->wbufpos = 0;
+    uint8_t get_block_flags() {
+        return this->bh1.flags;
+    }
+
+    uint16_t get_block_duration() {
+        return this->bh1.duration;
+    }
+
+    // Frames a second shown since the first block, and what the file asks for over the same time
+    float get_realized_fps() {
+        uint32_t elapsed = millis() - this->play.start_ms;
+        return this->playing && elapsed ? this->play.frames * 1000.0 / elapsed : 0;
+    }
+
+    float get_authored_fps() {
+        return this->play.authored_ms ? (this->play.frames + this->play.dropped) * 1000.0 / this->play.authored_ms : 0;
+    }
+
+    int get_frame_count() {
+        return this->frame_count;
+    }
+
+    // Frame of the loop that the next block belongs to
+    uint32_t get_frame_num() {
+        return this->frame_num;
+    }
+
+    // Frames in the version 3 index, 0 if the file can't seek
+    uint32_t get_index_count() {
+        return this->index_count;
+    }
+
+    // Makes frame the next one drawn. Starts from the last keyframe before it, and draws the
+    // frames from there as fast as they decode - at most one keyframe interval of them.
+    int seek_frame(uint32_t frame) {
+        if (frame >= this->index_count)
+            return QOIF2_E_SEEK;
+
+        QOIF2IndexEntry entry;
+        uint32_t i = frame;
+        if (this->keys) {
+            uint32_t k = this->key_count;
+            while (k && this->keys[k - 1].frame > frame)
+                k--;
+            if (!k)
+                return QOIF2_E_SEEK;
+            entry = this->keys[k - 1];
+        } else {
+            while (true) {
+                this->src->seek(this->index_offset + i * sizeof(entry));
+                if (!this->read_index(&entry, 1))
+                    return QOIF2_E_INDEX;
+                if (entry.flags & QOIF2_F_KEY)
+                    break;
+                if (i-- == 0)
+                    return QOIF2_E_SEEK;
+            }
+        }
+
+        this->wait_display();
+        this->read_buf->seek(entry.offset);
+        this->replaying = false;
+        // anything left of a block that was part way through isn't wanted
+        this->in_block = false;
         this->rbufpos = 0;
+        this->drop_frame_cache();
+        this->reset_state();
+        this->frame_num = entry.frame;
+        this->frame_next = true;
+        this->behind = false;
+        this->next_key = 0;
+        // the timeline starts again from the keyframe, then again from frame
+        this->play.authored_ms = this->loop_ms + entry.time_ms;
+        this->playing = false;
+
+        while (this->frame_num < frame) {
+            int res = this->read_and_render_block();
+            if (res != QOIF2_B_DELAY && res != QOIF2_B_CONTINUE && res != QOIF2_B_PARTIAL)
+                return res;
+        }
+        this->playing = false;
+        return 0;
+    }
+
+    // Records what's sent to the display into cache, and plays later loops from it - as much of
+    // them as fits, the rest is still read and decoded. Set before the first block - it's
+    // cleared, so a decoder opened ahead of time doesn't take it from the one playing.
+    void set_frame_cache(FrameCache* cache) {
+        this->frame_cache = cache;
+        if (cache)
+            cache->clear();
+    }
+
+    // Times decoding had to wait on the card, and the total time spent waiting
+    uint32_t get_stalls() {
+        return this->read_buf ? this->read_buf->stalls : 0;
+    }
 
+    uint32_t get_stall_us() {
+        return this->read_buf ? this->read_buf->stall_us : 0;
+    }
+
+    // Whether the whole file's in memory, see resident_max
+    bool is_resident() {
+        return this->read_buf && this->read_buf->resident;
+    }
+
+    // Moves a file that's streaming into the shared resident memory, if it's free now and the
+    // file fits - for the next file, opened while the last one had it, once that one's closed.
+    // Keeps what's already buffered, so only the rest is read. Only before the first block.
+    bool make_resident() {
+        if (!this->read_buf || this->read_buf->resident || !this->mem || this->read_buf->reset_pos != this->blocks_start
+                || this->read_buf->tell() != this->blocks_start)
+            return this->is_resident();
+        uint32_t len = this->read_buf->end_pos - this->blocks_start, size = this->resident_size(len);
+        // it'd already be resident if it fitted in its own buffer
+        if (size > sizeof(this->mem->file_buf)) {
+            this->read_buf->make_resident(this->resident_buf(size), size);
+            this->load_keys(len);
+        }
+        this->src->seek(this->read_buf->file_pos);
+        return this->is_resident();
+    }
+
+    uint32_t get_read_bytes() {
+        return this->read_buf ? this->read_buf->bytes_read + this->index_read : 0;
+    }
+
+    // Read from the card a minute, on average, since the first frame
+    uint32_t get_read_bytes_per_min() {
+        uint32_t elapsed = millis() - this->play.start_ms;
+        return this->read_buf && this->playing && elapsed ? (uint64_t) this->get_read_bytes() * 60000 / elapsed : 0;
+    }
+
+    // Reads ahead by one slice, for calling whenever the player is waiting on something - so
+    // decoding finds the data already buffered. Returns 0 once the buffer is full.
+    int idle() {
+        return this->read_buf && this->streaming() ? this->read_buf->fill_slice(QOIF2_FILL_SLICE) : 0;
+    }
+
+    // Draws the next block - or as much of it as the budget allows, returning QOIF2_B_PARTIAL
+    // until the rest's done
+    int read_and_render_block() {
+        PROFILE_ZONE("block");
+        uint32_t stall_us = this->get_stall_us();
+        this->call_us = micros();
+        int res = this->next_block();
+        this->frame_stats.busy_us += micros() - this->call_us;
+        this->frame_stats.read_us += this->get_stall_us() - stall_us;
+        return res;
+    }
+
+private:
+    int next_block() {
+        FrameCache* fc = this->frame_cache;
+        this->call_px = this->stats.pixels + this->rbufpos + this->block_run;
+        if (this->in_block) {
+            if (this->replaying)
+                return this->replay();
+            // still held back - nothing's been sent since
+            if (this->held(this->block_hold_px()))
+                return QOIF2_B_PARTIAL;
+            return this->bh1.flags & QOIF2_F_FILL ? this->fill_block() : (this->*decode_fn)();
+        }
+
+        if (this->replaying) {
+            if (this->replay_block < fc->blocks)
+                return this->replay();
+            this->replaying = false;
+            if (fc->whole_loop)
+                return this->end_loop();
+            // Carry on decoding the file from the first block that's not cached
+            this->load_state(fc);
+        }
+        // not while the loop's going into the frame cache, the next ones will be on time
+        if (this->frame_next && !(fc && fc->recording))
+            this->catch_up();
+
+        uint32_t block_pos = fc && fc->recording ? this->read_buf->tell() : 0;
+        // Serial.println("Reading blocks");
         // Serial.println("Read bh1");
         this->read_buf->read((uint8_t*)&this->bh1, sizeof(this->bh1));
         if (this->bh1.flags == 0 && this->bh1.duration == 0 && this->bh1.datalen == 0) {
             // bh1 is 7b, trailer is 8b ending in 0x01 - datalen should never be 0 so we should be in the trailer
             if (this->read_buf->readByte() == 1) {
-                // if only 1 frame, break & delay, otherwise continue the loop
-                if (this->frame_count < 2)
-                    return QOIF2_B_ONE_FRAME;
-                return QOIF2_B_END;
+                if (fc && fc->recording)
+                    fc->end_loop();
+                if (fc && fc->complete && !fc->whole_loop && fc->blocks && this->read_buf->reset_pos != (long) fc->resume_pos) {
+                    // The cached blocks won't be read again, so from now on the file only needs
+                    // looping from the first one that isn't
+                    this->read_buf->restart(fc->resume_pos);
+                }
+                return this->end_loop();
             } else {
                 // error condition
                 return QOIF2_E_TRAILER;
             }
         }
 
-        if (this->bh1.flags & QOIF2_F_START) {
-            this->frame_start = millis();
-            this->frame_count++;
-        }
-
         if (this->bh1.flags & QOIF2_F_BIG) {
             // Serial.println("Read bh2b");
             this->read_buf->read((uint8_t*)&this->bh2b, sizeof(this->bh2b));
@@ -158,120 +1188,221 @@ public:
             this->y = this->bh2.y;
         }
 
-        this->tft->dmaWait();
-        this->tft->endWrite();
-        this->tft->startWrite();
-        this->tft->setAddrWindow(this->x, this->y, this->width, this->height);
+        this->start_block();
+        if (this->bh1.flags & QOIF2_F_KEY)
+            this->reset_state();
+        if (fc) {
+            fc->misses++;
+            if (fc->recording) {
+                this->save_state(fc);
+                fc->start_block(block_pos, this->bh1.flags, this->bh1.duration, this->x, this->y, this->width, this->height);
+            }
+        }
+        this->block_left = this->bh1.datalen;
+        if (this->bh1.flags & QOIF2_F_PALETTE) {
+            // the frame cache's state is from before it, the block's read again from the start
+            int len = this->read_palette();
+            if (len < 0 || (uint32_t) len > this->block_left)
+                return QOIF2_E_DATA;
+            this->block_left -= len;
+        }
+        this->block_run = 0;
+        this->frame_stats.bytes += this->bh1.datalen;
+        if (this->held(this->block_hold_px())) {
+            this->in_block = true;
+            return QOIF2_B_PARTIAL;
+        }
+        if (this->bh1.flags & QOIF2_F_FILL)
+            return this->fill_block();
+        return (this->*decode_fn)();
+    }
+
+    // Pixels the block might send before it next checks the budget - a fill's all sent at once
+    uint32_t block_hold_px() {
+        if (this->bh1.flags & QOIF2_F_FILL)
+            return this->width * this->height;
+        return this->rbufpos + this->block_run + QOIF2_BUDGET_SPAN_PX;
+    }
+
+    // Draws a block that's all one color - there's nothing to decode. It's one run as far as
+    // sending it goes, so it's one writeColor if the display's quicker that way.
+    int fill_block() {
+        uint16_t color = 0;
+        this->in_block = false;
+        if (this->block_left != sizeof(color) || this->read_buf->read((uint8_t*)&color, sizeof(color)) < 0)
+            return QOIF2_E_DATA;
+        this->place_run(color, this->width * this->height);
+        if (this->rbufpos)
+            this->flush();
+        if (this->frame_cache && this->frame_cache->recording)
+            this->frame_cache->end_block();
+        return this->end_block();
+    }
+
+    // Decodes the block data, from wherever the last call got to
+    template <uint8_t FMT>
+    int decode_block() {
+        // each format's its own zone, the static in the macro being per instantiation
+        PROFILE_ZONE(FMT == QOIF2_FMT_PALETTE ? "decode palette" : FMT == QOIF2_FMT_RGB ? "decode rgb" : "decode");
+        FrameCache* fc = this->frame_cache;
+        bool budget = this->budget_us || this->budget_px;
 
         // Serial.println("Read img data");
-        int read_b = 0;
-        while (read_b < this->bh1.datalen) {
-            this->run = 1;
-            read_b += this->read_buf->read(&this->tag, 1);
-            switch (this->tag) {
-                case 0xff:
-                    // RGBA - not supported
-                    this->read_buf->skip(4);
-                    continue;
-                    break;
-                case 0xfe:
-                    // RGB - already verified 16b
-                    // Serial.println("tag: rgb");
-                    read_b += this->read_buf->read((uint8_t*)&this->cur_px, sizeof(this->cur_px));
-                    break;
-                default:
-                    this->arg1 = this->tag & 0b00111111;
-                    this->tag = this->tag >> 6;
-                    switch (this->tag) {
-                        case 0:
-                            // index
-                            // Serial.println("tag: index");
-                            this->cur_px = this->cache[this->arg1];
+        // The pixel state lives in locals while the block decodes so it stays in registers.
+        // Identical pixels aren't placed straight away but collected in run_len - whether by run
+        // ops or not, since the encoder splits long runs with an index op every 63 pixels - so
+        // each run can go to the display whichever way is cheaper once its length is known.
+        // Ops are decoded straight out of the file buffer, a contiguous span at a time.
+        uint32_t left = this->block_left, run_len = this->block_run;
+        uint16_t px = this->last_px, *out = this->buffer[this->rbuf];
+        uint16_t pos = this->rbufpos;
+        uint32_t rgb = this->last_rgb;
+        const int max_op = FMT == QOIF2_FMT_RGB ? QOIF2_MAX_OP_RGB : QOIF2_MAX_OP;
+        while (left) {
+            int avail;
+            const uint8_t* p = this->read_buf->peek(&avail, max_op);
+            if (avail < max_op) {
+                // a valid file always has at least the trailer after the block data
+                this->in_block = false;
+                return QOIF2_E_DATA;
+            }
+            // every op that starts before limit is entirely inside the span
+            uint32_t span = min(left, (uint32_t) (avail - max_op + 1));
+            if (budget)
+                span = min(span, (uint32_t) QOIF2_BUDGET_SPAN);
+            const uint8_t *start = p, *limit = p + span;
+            while (p < limit) {
+                uint8_t tag = *p++;
+                const QOIF2Op op = QOIF2_OPS[tag];
+                uint16_t prev = px;
+                if (FMT == QOIF2_FMT_RGB && op.op != QOIF2_OP_RUN) {
+                    // the ops work on the whole color, only what's sent is 565 - runs are
+                    // collected the same as in the other formats
+                    p = this->rgb_op(op, tag, p, &rgb);
+                    px = qoif2_rgb_565(rgb);
+                } else {
+                    switch (op.op) {
+                        case QOIF2_OP_INDEX:
+                            // the encoder only indexes a pixel at its own hash, so the cache is already right
+                            px = this->cache[op.arg];
                             break;
-                        case 1:
-                            // diff
-                            // Serial.println("tag: diff");
-                            this->dr = (this->arg1 >> 4) - 2;
-                            this->dg = ((this->arg1 >> 2) & 0b11) - 2;
-                            this->db = (this->arg1 & 0b11) - 2;
-                            this->r = this->last_px >> 11;
-                            this->g = this->last_px >> 5 & 0b111111;
-                            this->b = this->last_px & 0b11111;
-                            this->r += this->dr;
-                            this->g += this->dg;
-                            this->b += this->db;
-                            this->cur_px = (this->r << 11) | (this->g << 5) | this->b;
+                        case QOIF2_OP_DIFF:
+                            px += op.delta;
+                            this->cache[(uint16_t) (px * 6311) % 64] = px;
                             break;
-                        case 2:
-                            // luma
-                            // Serial.println("tag: luma");
-                            read_b += this->read_buf->read((uint8_t*)&this->arg2, sizeof(this->arg2));
-                            this->cur_px = this->last_px;
-                            this->dg = this->arg1 - 32;
-                            this->dr = ((this->arg2 >> 4) - 8) + this->dg;
-                            this->db = ((this->arg2 & 0b1111) - 8) + this->dg;
-                            this->r = this->last_px >> 11;
-                            this->g = this->last_px >> 5 & 0b111111;
-                            this->b = this->last_px & 0b11111;
-                            this->r += this->dr;
-                            this->g += this->dg;
-                            this->b += this->db;
-                            this->cur_px = (this->r << 11) | (this->g << 5) | this->b;
+                        case QOIF2_OP_LUMA:
+                            px += (uint16_t) (op.delta + QOIF2_LUMA_RB[*p++]);
+                            this->cache[(uint16_t) (px * 6311) % 64] = px;
                             break;
-                        case 3:
-                            // run
-                            // Serial.println("tag: run");
-                            this->cur_px = this->last_px;
-                            this->run = this->arg1 + 1;
+                        case QOIF2_OP_RGB:
+                            if (FMT == QOIF2_FMT_PALETTE) {
+                                px = this->palette[*p++];
+                            } else {
+                                // already verified 16b, stored little endian
+                                px = p[0] | (p[1] << 8);
+                                p += 2;
+                            }
+                            this->cache[(uint16_t) (px * 6311) % 64] = px;
                             break;
+                        case QOIF2_OP_RUN:
+                            run_len += op.arg;
+                            continue;
+                        case QOIF2_OP_SKIP: {
+                            uint16_t n = p[0] | (p[1] << 8);
+                            p += 2;
+                            // the run being collected is placed first either way
+                            this->rbufpos = pos;
+                            if (run_len > 1)
+                                this->place_run(px, run_len);
+                            else if (run_len)
+                                out[this->rbufpos++] = px;
+                            run_len = 0;
+                            if (n & QOIF2_LITERAL) {
+                                // copied after it, past the end of this span - so that's as far as
+                                // the span goes
+                                uint32_t used = p - start;
+                                this->read_buf->consume(used);
+                                left = used < left ? left - used : 0;
+                                if (!this->copy_literal<FMT>(n & ~QOIF2_LITERAL, &left)) {
+                                    this->in_block = false;
+                                    return QOIF2_E_DATA;
+                                }
+                                px = this->last_px;
+                                start = p = limit;
+                            } else {
+                                // what's been decoded goes out, then the decoder carries on from the
+                                // pixel before the skip
+                                if (this->rbufpos)
+                                    this->flush();
+                                this->skip(n);
+                            }
+                            out = this->buffer[this->rbuf];
+                            pos = this->rbufpos;
+                            continue;
+                        }
                     }
-            }
+                }
 
-            if (this->run > 1 || this->rbufpos + this->run > QOIF2_READ_BUF_SZ) {
-                // Dump the buffer to the screen if there's a run of pixels, or it's full
-                // Serial.println("Write to screen - buffer full");
-                this->tft->dmaWait();
-                this->wbuf = this->rbuf;
-                this->wbufpos = this->rbufpos;
-                this->tft->writePixels(this->buffer[this->wbuf], this->wbufpos, false);
-                this->rbuf = this->rbuf ? 0 : 1;
-                this->rbufpos = 0;
+                if (px == prev && run_len) {
+                    run_len++;
+                    continue;
+                }
+
+                // A different pixel ends the run
+                if (run_len > 1) {
+                    this->rbufpos = pos;
+                    this->place_run(prev, run_len);
+                    out = this->buffer[this->rbuf];
+                    pos = this->rbufpos;
+                } else if (run_len) {
+                    out[pos++] = prev;
+                    if (pos == QOIF2_READ_BUF_SZ) {
+                        // Dump the buffer to the screen if it's full
+                        this->rbufpos = pos;
+                        this->flush();
+                        out = this->buffer[this->rbuf];
+                        pos = 0;
+                    }
+                }
+                run_len = 1;
             }
-            if (this->run > 1) {
-                // write the run of pixels
-                this->tft->dmaWait();
-                tft->writeColor(this->cur_px, this->run);
-            } else {
-                // otherwise, put the pixel into the buffer
-                this->buffer[this->rbuf][this->rbufpos++] = this->cur_px;
+            uint32_t used = p - start;
+            this->read_buf->consume(used);
+            left = used < left ? left - used : 0;
+            // the block's last pixels are sent after this, and the display might hold them back
+            if (budget && (left ? this->over_budget(pos + run_len) || this->held(pos + run_len + QOIF2_BUDGET_SPAN_PX) : this->held(pos + run_len))) {
+                this->in_block = true;
+                this->block_left = left;
+                this->block_run = run_len;
+                this->last_px = px;
+                this->last_rgb = rgb;
+                this->rbufpos = pos;
+                return QOIF2_B_PARTIAL;
             }
-            this->last_px = this->cur_px;
-            this->cache[(this->cur_px * 6311) % 64] = this->cur_px;
+        }
+        this->in_block = false;
+        this->last_px = px;
+        this->last_rgb = rgb;
+        this->rbufpos = pos;
+        if (run_len > 1) {
+            this->place_run(px, run_len);
+        } else if (run_len) {
+            this->buffer[this->rbuf][this->rbufpos++] = px;
+            if (this->rbufpos == QOIF2_READ_BUF_SZ)
+                this->flush();
         }
 
         // Serial.println("End of block data");
 
         if (this->rbufpos) {
             // Serial.println("Write to screen - data still in buffer");
-            this->tft->dmaWait();
-            this->wbuf = this->rbuf;
-            this->wbufpos = this->rbufpos;
-            this->tft->writePixels(this->buffer[this->wbuf], this->wbufpos, false);
+            this->flush();
         }
 
-        if (this->bh1.flags & QOIF2_F_END) {
-            this->tft->dmaWait();
-            this->tft->endWrite();
-            if (this->bh1.duration) {
-                this->read_buf->fill();
-                this->delay_ms = this->bh1.duration - (millis() - this->frame_start);
-                this->delay_diff = (float) this->delay_ms / (float) this->bh1.duration;
-                return QOIF2_B_DELAY;
-            }
-        }
+        if (fc && fc->recording)
+            fc->end_block();
 
-        // Serial.println("End of loop");
-        return QOIF2_B_CONTINUE;
+        return this->end_block();
     }
 };
 
@@ -0,0 +1,222 @@
+#ifndef _SYNC_SOURCE_IMPL_H_
+#define _SYNC_SOURCE_IMPL_H_
+
+#include <Arduino.h>
+
+#include "constants.h"
+#include "PixelSink_impl.h"
+
+// The panel scans its memory out to the glass top to bottom, SCREEN_HEIGHT lines a refresh. A
+// frame written while that's going on tears: the top of the glass shows some of the new frame
+// and the bottom the old one, or the other way round. SyncedSink keeps every line of a frame
+// behind the scan - a line is only written once the scan's past it, so it first shows on the
+// next refresh - and has the whole frame written before the next refresh gets to it.
+
+// Where the panel's refreshes come from - its tearing effect output on the badge, a timer on the
+// host
+class SyncSource {
+public:
+    virtual ~SyncSource() {}
+
+    // micros() at the latest edge, when the panel started scanning out line 0
+    virtual uint32_t last_edge_us() = 0;
+    // Between edges, 0 until it's known
+    virtual uint32_t period_us() = 0;
+};
+
+
+#if defined(ARDUINO)
+#include "Adafruit_ILI9341.h"
+
+// TEON, with V-blank only - TE goes high as the panel finishes a refresh
+#define TE_CMD_TEON 0x35
+// Refreshes averaged over for the period
+#define TE_PERIOD_SHIFT 3
+
+class TESyncSource;
+TESyncSource* te_sync_isr = NULL;
+
+class TESyncSource : public SyncSource {
+private:
+    volatile uint32_t edge_us = 0, period = 0;
+    volatile bool started = false;
+
+public:
+    void begin(Adafruit_ILI9341* tft) {
+        uint8_t mode = 0;
+        tft->sendCommand(TE_CMD_TEON, &mode, 1);
+        te_sync_isr = this;
+        pinMode(TFT_TE, INPUT);
+        attachInterrupt(digitalPinToInterrupt(TFT_TE), te_sync_edge, RISING);
+    }
+
+    void edge() {
+        uint32_t now = micros();
+        uint32_t since = now - this->edge_us;
+        if (!this->started)
+            this->started = true;
+        else if (!this->period)
+            this->period = since;
+        else if (since < this->period + this->period / 4)
+            // longer means an edge was missed, with interrupts off
+            this->period += (int32_t) (since - this->period) >> TE_PERIOD_SHIFT;
+        this->edge_us = now;
+    }
+
+    uint32_t last_edge_us() {
+        return this->edge_us;
+    }
+
+    uint32_t period_us() {
+        return this->period;
+    }
+
+    static void te_sync_edge() {
+        if (te_sync_isr != NULL)
+            te_sync_isr->edge();
+    }
+};
+#endif
+
+// Refreshes every period_us from phase_us, by the clock - the host's stand-in for the panel
+class TimerSyncSource : public SyncSource {
+private:
+    uint32_t period, phase;
+
+public:
+    TimerSyncSource(uint32_t period_us, uint32_t phase_us = 0) {
+        this->period = period_us;
+        this->phase = phase_us;
+    }
+
+    uint32_t last_edge_us() {
+        uint32_t now = micros();
+        return now - (now - this->phase) % this->period;
+    }
+
+    uint32_t period_us() {
+        return this->period;
+    }
+};
+
+
+// Passes everything on to another sink, holding back each frame's transfers until the edge after
+// it starts, and each transfer until the scan's past the lines it writes. A frame that's still
+// being written when the next refresh reaches its lines is counted as late - it'll have torn.
+class SyncedSink : public PixelSink {
+private:
+    PixelSink* sink;
+    SyncSource* sync;
+    uint16_t wy = 0, ww = 0;
+    uint32_t cursor = 0;
+    // edge the frame's being written after
+    uint32_t frame_edge = 0;
+    bool frame_late = false, in_frame = false;
+
+    void wait_until(uint32_t until) {
+        uint32_t now = micros();
+        if ((int32_t) (until - now) <= 0)
+            return;
+        while ((int32_t) (until - micros()) > 0);
+        this->wait_us += until - now;
+    }
+
+    // When the scan's past line, after the frame's edge
+    uint32_t line_ready(uint32_t line, uint32_t period) {
+        if (line >= SCREEN_HEIGHT)
+            line = SCREEN_HEIGHT - 1;
+        return this->frame_edge + (uint64_t) (line + 1) * period / SCREEN_HEIGHT;
+    }
+
+    // Before len pixels go to the window
+    void hold(uint32_t len) {
+        uint32_t period = this->sync->period_us();
+        if (!this->enabled || !this->in_frame || !period || !this->ww)
+            return;
+
+        uint32_t top = this->wy + this->cursor / this->ww;
+        uint32_t bottom = this->wy + (this->cursor + len - 1) / this->ww;
+        this->cursor += len;
+        // the scan's past the bottom line, then the next refresh mustn't have got to the top one
+        // by the time it's written
+        this->wait_until(this->line_ready(bottom, period));
+        if (!this->frame_late && (int32_t) (micros() - (this->frame_edge + period + (uint64_t) top * period / SCREEN_HEIGHT)) > 0) {
+            this->frame_late = true;
+            this->late++;
+        }
+    }
+
+public:
+    // Off, it's just the sink underneath
+    bool enabled = false;
+    // waiting on the panel since reset_stats(), frames synced and ones that ran into the next
+    // refresh
+    uint32_t wait_us = 0, frames = 0, late = 0;
+
+    SyncedSink(PixelSink* sink, SyncSource* sync) {
+        this->sink = sink;
+        this->sync = sync;
+    }
+
+    // The frame's written after the next edge, however long its first pixels take - so a decoder
+    // that hands back while it's held can leave it until holdUs() says it's ready
+    void startFrame() {
+        uint32_t period = this->sync->period_us();
+        this->in_frame = this->enabled && period;
+        if (this->in_frame) {
+            this->frame_edge = this->sync->last_edge_us() + period;
+            this->frame_late = false;
+            this->frames++;
+        }
+        this->sink->startFrame();
+    }
+
+    uint32_t holdUs(uint16_t line) {
+        uint32_t period = this->sync->period_us();
+        if (!this->enabled || !this->in_frame || !period)
+            return 0;
+        int32_t left = this->line_ready(line, period) - micros();
+        return left > 0 ? left : 0;
+    }
+
+    void startWrite() {
+        this->sink->startWrite();
+    }
+
+    void endWrite() {
+        this->sink->endWrite();
+    }
+
+    void dmaWait() {
+        this->sink->dmaWait();
+    }
+
+    bool dmaBusy() {
+        return this->sink->dmaBusy();
+    }
+
+    void setAddrWindow(uint16_t x, uint16_t y, uint16_t w, uint16_t h) {
+        this->wy = y;
+        this->ww = w;
+        this->cursor = 0;
+        this->sink->setAddrWindow(x, y, w, h);
+    }
+
+    void writePixels(uint16_t* colors, uint32_t len) {
+        this->hold(len);
+        this->sink->writePixels(colors, len);
+    }
+
+    void writeColor(uint16_t color, uint32_t len) {
+        this->hold(len);
+        this->sink->writeColor(color, len);
+    }
+
+    void reset_stats() {
+        this->wait_us = 0;
+        this->frames = 0;
+        this->late = 0;
+    }
+};
+
+#endif
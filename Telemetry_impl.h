@@ -0,0 +1,199 @@
+#ifndef _TELEMETRY_IMPL_H_
+#define _TELEMETRY_IMPL_H_
+
+#include <Arduino.h>
+#include <SD.h>
+
+#include "QOIF2_impl.h"
+
+// Where each frame of a file went, kept as histograms so it's the same few hundred bytes however
+// long the file plays. Summed up on Serial when the file changes, and optionally added to a CSV
+// on the card when there's time - so files that can't keep up on the badge can be picked out
+// afterwards.
+
+// Bucket 0 counts 0, bucket i counts 2^(i-1) up to 2^i, and the last one everything above
+#define TELEMETRY_BUCKETS 20
+#define TELEMETRY_METRICS 6
+// The CSV's started again once it's this big, so it never takes more than this and a file's rows
+#define TELEMETRY_CSV_MAX 16384
+
+class Histogram {
+public:
+    uint32_t counts[TELEMETRY_BUCKETS];
+    uint32_t n, largest;
+    uint64_t sum;
+
+    Histogram() {
+        this->clear();
+    }
+
+    void clear() {
+        memset(this->counts, 0, sizeof(this->counts));
+        this->n = 0;
+        this->largest = 0;
+        this->sum = 0;
+    }
+
+    static uint8_t bucket(uint32_t value) {
+        uint8_t b = 0;
+        while (value && b < TELEMETRY_BUCKETS - 1) {
+            value >>= 1;
+            b++;
+        }
+        return b;
+    }
+
+    void add(uint32_t value) {
+        this->counts[bucket(value)]++;
+        this->n++;
+        this->sum += value;
+        if (value > this->largest)
+            this->largest = value;
+    }
+
+    uint32_t mean() {
+        return this->n ? this->sum / this->n : 0;
+    }
+
+    // The top of the bucket pct percent of values are in - so at most twice what it really is,
+    // and never more than the largest
+    uint32_t percentile(uint8_t pct) {
+        uint32_t want = ((uint64_t) this->n * pct + 99) / 100, seen = 0;
+        for (uint8_t b = 0; b < TELEMETRY_BUCKETS; b++) {
+            seen += this->counts[b];
+            if (seen >= want && seen)
+                return min(b ? (uint32_t) (((uint64_t) 1 << b) - 1) : (uint32_t) 0, this->largest);
+        }
+        return this->largest;
+    }
+};
+
+class Telemetry {
+public:
+    char filename[128] = "";
+    Histogram decode_us, read_us, dma_us, bytes, pixels, late_ms;
+    // the last file's, kept by finish() until csv_idle() writes them
+    char done_filename[128] = "";
+    Histogram done[TELEMETRY_METRICS];
+    bool csv_pending = false;
+
+    // Starts again for another file
+    void begin(const char* filename) {
+        strncpy(this->filename, filename, sizeof(this->filename) - 1);
+        for (uint8_t i = 0; i < TELEMETRY_METRICS; i++)
+            this->metric(i)->clear();
+    }
+
+    // A frame that's just been drawn, and anything else it spent waiting on the display
+    void add(const QOIF2FrameStats* frame, uint32_t sync_us = 0) {
+        uint32_t dma = frame->dma_us + sync_us, waiting = frame->read_us + dma;
+        this->decode_us.add(frame->busy_us > waiting ? frame->busy_us - waiting : 0);
+        this->read_us.add(frame->read_us);
+        this->dma_us.add(dma);
+        this->bytes.add(frame->bytes);
+        this->pixels.add(frame->pixels);
+        this->late_ms.add(frame->late_ms);
+    }
+
+    Histogram* metric(uint8_t i) {
+        Histogram* metrics[TELEMETRY_METRICS] = {&this->decode_us, &this->read_us, &this->dma_us, &this->bytes, &this->pixels, &this->late_ms};
+        return metrics[i];
+    }
+
+    static const char* metric_name(uint8_t i) {
+        static const char* names[TELEMETRY_METRICS] = {"decode_us", "read_us", "dma_us", "bytes", "pixels", "late_ms"};
+        return names[i];
+    }
+
+    void print() {
+        char line[96];
+        Serial.print("Telemetry: ");
+        Serial.print(this->filename);
+        Serial.print(", ");
+        Serial.print((unsigned long) this->decode_us.n);
+        Serial.println(" frames");
+        Serial.println("            mean      p50      p90      p99      max");
+        for (uint8_t i = 0; i < TELEMETRY_METRICS; i++) {
+            Histogram* h = this->metric(i);
+            snprintf(line, sizeof(line), "%-10s %8lu %8lu %8lu %8lu %8lu", metric_name(i), (unsigned long) h->mean(),
+                (unsigned long) h->percentile(50), (unsigned long) h->percentile(90), (unsigned long) h->percentile(99), (unsigned long) h->largest);
+            Serial.println(line);
+        }
+    }
+
+    // Keeps this file's histograms for csv_idle(), so begin() can start on the next one straight
+    // away and the card's only written to when it isn't needed for playing
+    void finish() {
+        memcpy(this->done_filename, this->filename, sizeof(this->filename));
+        for (uint8_t i = 0; i < TELEMETRY_METRICS; i++)
+            this->done[i] = *this->metric(i);
+        this->csv_pending = true;
+    }
+
+    // Call whenever there's time to write to the card
+    void csv_idle(const char* path) {
+        if (!this->csv_pending)
+            return;
+        this->csv_pending = false;
+        Histogram* metrics[TELEMETRY_METRICS];
+        for (uint8_t i = 0; i < TELEMETRY_METRICS; i++)
+            metrics[i] = &this->done[i];
+        this->write_csv(path, this->done_filename, metrics);
+    }
+
+    // Adds this file's rows now
+    bool write_csv(const char* path) {
+        Histogram* metrics[TELEMETRY_METRICS];
+        for (uint8_t i = 0; i < TELEMETRY_METRICS; i++)
+            metrics[i] = this->metric(i);
+        return this->write_csv(path, this->filename, metrics);
+    }
+
+private:
+    // A row a metric: file, metric, frames, mean, max, then the bucket counts. Adds a header
+    // first if the file's new, or started again.
+    bool write_csv(const char* path, const char* filename, Histogram** metrics) {
+        char line[64];
+        File file = SD.open(path, FILE_WRITE);
+        if (!file)
+            return false;
+        if (file.size() >= TELEMETRY_CSV_MAX) {
+            // it's the latest files that are worth keeping
+            file.close();
+            SD.remove(path);
+            file = SD.open(path, FILE_WRITE);
+            if (!file)
+                return false;
+        }
+        if (!file.size()) {
+            this->write_str(&file, "file,metric,frames,mean,max");
+            // each bucket by the largest it counts
+            for (uint8_t b = 0; b < TELEMETRY_BUCKETS - 1; b++) {
+                snprintf(line, sizeof(line), ",le_%lu", b ? (unsigned long) (((uint64_t) 1 << b) - 1) : 0UL);
+                this->write_str(&file, line);
+            }
+            this->write_str(&file, ",more");
+            this->write_str(&file, "\n");
+        }
+        for (uint8_t i = 0; i < TELEMETRY_METRICS; i++) {
+            Histogram* h = metrics[i];
+            this->write_str(&file, filename);
+            snprintf(line, sizeof(line), ",%s,%lu,%lu,%lu", metric_name(i), (unsigned long) h->n,
+                (unsigned long) h->mean(), (unsigned long) h->largest);
+            this->write_str(&file, line);
+            for (uint8_t b = 0; b < TELEMETRY_BUCKETS; b++) {
+                snprintf(line, sizeof(line), ",%lu", (unsigned long) h->counts[b]);
+                this->write_str(&file, line);
+            }
+            this->write_str(&file, "\n");
+        }
+        file.close();
+        return true;
+    }
+
+    void write_str(File* file, const char* str) {
+        file->write((const uint8_t*) str, strlen(str));
+    }
+};
+
+#endif
@@ -0,0 +1,246 @@
+#ifndef _TOUCH_SAMPLER_IMPL_H_
+#define _TOUCH_SAMPLER_IMPL_H_
+
+#include <Arduino.h>
+
+#include "constants.h"
+
+#if defined(ARDUINO)
+#include "TouchScreen.h"
+#endif
+
+// The touchscreen is read at a fixed rate in the background - from a timer interrupt on the
+// SAMD51, otherwise from poll() whenever a sample's due - instead of every time anything wants
+// to know about it, since each read is several blocking analog reads. Samples are filtered and
+// debounced into events, and the latest filtered touch.
+#define TOUCH_SAMPLE_HZ 100
+// Samples the filter looks at, odd. Most of them have to be pressed for the screen to count as
+// touched, and the position is their median, so the odd dropout or stray reading is ignored.
+#define TOUCH_MEDIAN 5
+// How long the touch has to stay lifted to count as released
+#define TOUCH_RELEASE_MS 50
+// Events waiting to be handled, a power of two
+#define TOUCH_EVENTS 8
+// Samples from TC3's interrupt - it mustn't be driving a PWM pin
+#if defined(__SAMD51__)
+#define TOUCH_TIMER_ISR 1
+#else
+#define TOUCH_TIMER_ISR 0
+#endif
+
+#define TOUCH_DOWN 1
+#define TOUCH_UP 2
+
+typedef struct {
+    uint8_t type;
+    // in screen coordinates. For TOUCH_UP, where it was last, and where it went down and how long
+    // it was held.
+    int16_t x, y, down_x, down_y;
+    uint32_t held_ms;
+    // millis() when it was queued
+    uint32_t ms;
+} TouchEvent;
+
+typedef struct {
+    bool down;
+    int16_t x, y;
+} TouchState;
+
+class TouchSampler;
+TouchSampler* touch_sampler_isr = NULL;
+
+class TouchSampler {
+private:
+#if defined(ARDUINO)
+    TouchScreen* ts;
+#endif
+    // the last TOUCH_MEDIAN samples
+    int16_t xs[TOUCH_MEDIAN], ys[TOUCH_MEDIAN];
+    bool pressed[TOUCH_MEDIAN] = {false};
+    uint8_t pos = 0;
+
+    volatile bool down = false;
+    volatile int16_t x = 0, y = 0;
+    int16_t down_x = 0, down_y = 0;
+    uint32_t down_ms = 0, lifted_ms = 0;
+    bool lifted = false;
+    // where it went down isn't settled until the filter's been through a whole touch, since
+    // readings are at their worst as it lands
+    uint8_t settling = 0;
+
+    TouchEvent events[TOUCH_EVENTS];
+    volatile uint8_t events_head = 0, events_tail = 0;
+
+    uint32_t next_us = 0, stats_since_us = 0;
+
+    static int16_t median(int16_t* values, uint8_t n) {
+        for (uint8_t i = 1; i < n; i++) {
+            int16_t v = values[i];
+            uint8_t j = i;
+            for (; j > 0 && values[j - 1] > v; j--)
+                values[j] = values[j - 1];
+            values[j] = v;
+        }
+        return values[n / 2];
+    }
+
+    // Dropped if nothing's keeping up with them
+    void push(uint8_t type, uint32_t held_ms, uint32_t ms) {
+        uint8_t next = (this->events_head + 1) & (TOUCH_EVENTS - 1);
+        if (next == this->events_tail)
+            return;
+        this->events[this->events_head] = {type, this->x, this->y, this->down_x, this->down_y, held_ms, ms};
+        this->events_head = next;
+    }
+
+public:
+    // time spent sampling, and samples taken, since reset_stats()
+    volatile uint32_t busy_us = 0, samples = 0;
+
+#if defined(ARDUINO)
+    TouchSampler(TouchScreen* ts) {
+        this->ts = ts;
+    }
+#else
+    TouchSampler() {}
+#endif
+
+    // Starts sampling in the background, if there's a timer for it
+    void begin() {
+        this->reset_stats();
+#if defined(ARDUINO) && TOUCH_TIMER_ISR
+        touch_sampler_isr = this;
+        MCLK->APBBMASK.reg |= MCLK_APBBMASK_TC3;
+        // GCLK1 is 48MHz
+        GCLK->PCHCTRL[TC3_GCLK_ID].reg = GCLK_PCHCTRL_GEN_GCLK1 | GCLK_PCHCTRL_CHEN;
+        while (!(GCLK->PCHCTRL[TC3_GCLK_ID].reg & GCLK_PCHCTRL_CHEN));
+        TC3->COUNT16.CTRLA.bit.ENABLE = 0;
+        while (TC3->COUNT16.SYNCBUSY.bit.ENABLE);
+        TC3->COUNT16.CTRLA.reg = TC_CTRLA_MODE_COUNT16 | TC_CTRLA_PRESCALER_DIV64 | TC_CTRLA_PRESCSYNC_PRESC;
+        TC3->COUNT16.WAVE.reg = TC_WAVE_WAVEGEN_MFRQ;
+        TC3->COUNT16.CC[0].reg = 48000000 / 64 / TOUCH_SAMPLE_HZ - 1;
+        while (TC3->COUNT16.SYNCBUSY.bit.CC0);
+        TC3->COUNT16.INTENSET.reg = TC_INTENSET_MC0;
+        // below the display's DMA, so a sample never holds up a transfer
+        NVIC_SetPriority(TC3_IRQn, 3);
+        NVIC_EnableIRQ(TC3_IRQn);
+        TC3->COUNT16.CTRLA.bit.ENABLE = 1;
+        while (TC3->COUNT16.SYNCBUSY.bit.ENABLE);
+#endif
+    }
+
+    // Takes a sample if one's due and there's no timer doing it. Cheap enough to call anywhere.
+    void poll() {
+#if defined(ARDUINO) && !TOUCH_TIMER_ISR
+        uint32_t now = micros();
+        if ((int32_t) (now - this->next_us) < 0)
+            return;
+        this->next_us = now + 1000000 / TOUCH_SAMPLE_HZ;
+        this->sample();
+#endif
+    }
+
+#if defined(ARDUINO)
+    void sample() {
+        uint32_t start = micros();
+        TSPoint p = this->ts->getPoint();
+        this->add(map(p.x, X_MIN, X_MAX, 0, SCREEN_WIDTH), map(p.y, Y_MIN, Y_MAX, 0, SCREEN_HEIGHT),
+            p.z > this->ts->pressureThreshhold, millis());
+        this->busy_us += micros() - start;
+    }
+#endif
+
+    // One reading, in screen coordinates
+    void add(int16_t sx, int16_t sy, bool is_pressed, uint32_t ms) {
+        int16_t fx[TOUCH_MEDIAN], fy[TOUCH_MEDIAN];
+        uint8_t n = 0;
+
+        this->samples++;
+        this->xs[this->pos] = sx;
+        this->ys[this->pos] = sy;
+        this->pressed[this->pos] = is_pressed;
+        this->pos = (this->pos + 1) % TOUCH_MEDIAN;
+        for (uint8_t i = 0; i < TOUCH_MEDIAN; i++) {
+            if (this->pressed[i]) {
+                fx[n] = this->xs[i];
+                fy[n] = this->ys[i];
+                n++;
+            }
+        }
+
+        if (n > TOUCH_MEDIAN / 2) {
+            // and as it lifts, so once it's down the position only follows a filter that's
+            // nearly all touch
+            if (!this->down || n >= TOUCH_MEDIAN - 1) {
+                this->x = median(fx, n);
+                this->y = median(fy, n);
+            }
+            this->lifted = false;
+            if (!this->down) {
+                this->down = true;
+                this->down_ms = ms;
+                this->settling = TOUCH_MEDIAN;
+            }
+            if (this->settling) {
+                this->down_x = this->x;
+                this->down_y = this->y;
+                if (this->settling-- == TOUCH_MEDIAN)
+                    this->push(TOUCH_DOWN, 0, ms);
+            }
+        } else if (this->down) {
+            if (!this->lifted) {
+                this->lifted = true;
+                this->lifted_ms = ms;
+            } else if (ms - this->lifted_ms >= TOUCH_RELEASE_MS) {
+                this->lifted = false;
+                this->down = false;
+                this->push(TOUCH_UP, this->lifted_ms - this->down_ms, ms);
+            }
+        }
+    }
+
+    // Takes the oldest event waiting, false if there aren't any
+    bool next_event(TouchEvent* event) {
+        if (this->events_tail == this->events_head)
+            return false;
+        *event = this->events[this->events_tail];
+        this->events_tail = (this->events_tail + 1) & (TOUCH_EVENTS - 1);
+        return true;
+    }
+
+    // Drops any events waiting, eg. the ones that closed a menu
+    void clear() {
+        this->events_tail = this->events_head;
+    }
+
+    TouchState get_state() {
+        noInterrupts();
+        TouchState state = {this->down, this->x, this->y};
+        interrupts();
+        return state;
+    }
+
+    // Microseconds a second spent sampling
+    float busy_us_per_s() {
+        uint32_t elapsed = micros() - this->stats_since_us;
+        return elapsed ? (float) this->busy_us * 1000000 / elapsed : 0;
+    }
+
+    void reset_stats() {
+        noInterrupts();
+        this->busy_us = 0;
+        this->samples = 0;
+        interrupts();
+        this->stats_since_us = micros();
+    }
+};
+
+#if defined(ARDUINO) && TOUCH_TIMER_ISR
+void TC3_Handler() {
+    TC3->COUNT16.INTFLAG.reg = TC_INTFLAG_MC0;
+    if (touch_sampler_isr != NULL)
+        touch_sampler_isr->sample();
+}
+#endif
+
+#endif
@@ -11,8 +11,15 @@
 #include "constants.h"
 #include "bootscreen_impl.h"
 #include "colors.h"
+#include "ByteSource_impl.h"
+#include "PixelSink_impl.h"
+#include "SyncSource_impl.h"
+#include "Telemetry_impl.h"
+#include "Profiler_impl.h"
 #include "QOIF2_impl.h"
 #include "FileBuffer_impl.h"
+#include "FrameCache_impl.h"
+#include "Arena_impl.h"
 #include "status_led_impl.h"
 #include "main_touch_impl.h"
 #include "backlight_impl.h"
@@ -21,13 +28,40 @@
 
 Adafruit_ILI9341 tft(tft8bitbus, TFT_D0, TFT_WR, TFT_DC, TFT_CS, TFT_RESET, TFT_RD);
 TouchScreen touchscreen(TOUCH_XL, TOUCH_YD, TOUCH_XR, TOUCH_YU, 300);
+TouchSampler touch(&touchscreen);
+ILI9341Sink display(&tft);
+TESyncSource te_sync;
+// what animations are drawn through
+SyncedSink synced(&display, &te_sync);
 
 FileList files = FileList(FILE_DIRECTORY);
 Prefs prefs;
+uint16_t run_threshold = QOIF2_RUN_THRESHOLD;
+FrameCache frame_cache(FRAME_CACHE_BYTES, arena.frame_cache);
+Telemetry telemetry;
+
+// An animation file and its decoder. There are two: the one playing, and the next one - opened
+// and buffered during the last frames of this one, so switching to it is just a swap.
+struct AnimSlot {
+    File fp;
+    SDFileSource src;
+    QOIF2* img = NULL;
+    char filename[FILELIST_PATH_LEN] = "";
+    // what open() returned
+    int res = 0;
+
+    AnimSlot() : src(&fp) {}
+};
+
+AnimSlot slots[2];
+AnimSlot *cur_slot = &slots[0], *next_slot = &slots[1];
+// when the last file stopped, to time the switch to the next one
+unsigned long switch_start_us = 0;
 
 
 void setup() {
 	Serial.begin(SERIAL_SPEED);
+	profiler_begin();
 
 	pinMode(TFT_BACKLIGHT, OUTPUT);
   	digitalWrite(TFT_BACKLIGHT, HIGH);
@@ -36,14 +70,21 @@ void setup() {
 
   	tft.begin();
   	tft.setRotation(4);
+  	te_sync.begin(&tft);
+  	synced.enabled = DISPLAY_TE_SYNC;
+  	touch.begin();
 
   	// TODO: re-enable me for prod
   	// bootscreen(&tft);
   	// still need a delay for serial
   	delay(500);
+  	arena_report();
 
   	start_sd:
     tft.fillScreen(COLOR_BLUE);
+    run_threshold = qoif2_calibrate_run_threshold(&display, COLOR_BLUE);
+    Serial.print("Run threshold: ");
+    Serial.println(run_threshold);
 
     Serial.print("Initializing SD card...");
     if (!SD.begin(SD_CS)) {
@@ -65,21 +106,80 @@ void setup() {
 
 
 bool paused = false, locked = false;
+// The longest a press waited to be acted on, and the longest between looking for one
+uint32_t input_lag_max_ms = 0;
+unsigned long input_gap_max_us = 0, input_checked_us = 0;
+
+
+void close_slot(AnimSlot* slot) {
+    if (slot->img != NULL) {
+        arena_close(slot->img);
+        slot->img = NULL;
+    }
+    if (slot->fp) slot->fp.close();
+    slot->filename[0] = 0;
+}
+
+
+// Leaves img NULL if the file can't be opened
+void open_slot(AnimSlot* slot, const char* filename, bool fill) {
+    close_slot(slot);
+    strcpy(slot->filename, filename);
+    slot->fp = SD.open(filename);
+    if (!slot->fp) return;
+    slot->img = arena_open(slot - slots, &synced, &slot->src);
+    slot->img->run_threshold = run_threshold;
+    slot->img->budget_us = DECODE_BUDGET_US;
+    slot->res = slot->img->open(fill);
+}
+
+
+// Once the current file's nearly done, opens the next one, then buffers it a slice at a time
+void prefetch(long next_time) {
+    if (paused || millis() + PREFETCH_LEAD_MS < next_time) return;
+
+    if (next_slot->filename[0] == 0) {
+        const FileListEntry* entry = files.peek_file(1);
+        if (entry == NULL) return;
+        if (entry->type & QOIF2_FILE) {
+            open_slot(next_slot, files.get_path(entry), false);
+        } else {
+            // only QOIF2 files can be opened ahead, but don't keep looking
+            strcpy(next_slot->filename, files.get_path(entry));
+        }
+        return;
+    }
+
+    if (next_slot->img != NULL && next_slot->res == 0)
+        next_slot->img->idle();
+}
+
+
+bool handle_main_touch(AnimSlot* slot) {
+    unsigned long now = micros();
+    uint32_t queued_ms;
 
+    if (input_checked_us && now - input_checked_us > input_gap_max_us)
+        input_gap_max_us = now - input_checked_us;
+    input_checked_us = now;
+    uint8_t button = get_main_screen_touch(&touch, &queued_ms);
+    if (button && millis() - queued_ms > input_lag_max_ms)
+        input_lag_max_ms = millis() - queued_ms;
 
-bool handle_main_touch(File* fp) {
-    switch (get_main_screen_touch(&touchscreen)) {
+    switch (button) {
         case MAIN_BTN_LOCK:
             locked = !locked;
             break;
         case MAIN_BTN_LEFT:
             if (locked) break;
-            if (fp != NULL) fp->close();
+            switch_start_us = micros();
+            if (slot != NULL) close_slot(slot);
             files.prev_file(&prefs);
             return true;
         case MAIN_BTN_RIGHT:
             if (locked) break;
-            if (fp != NULL) fp->close();
+            switch_start_us = micros();
+            if (slot != NULL) close_slot(slot);
             files.next_file(&prefs);
             return true;
         case MAIN_BTN_PAUSE:
@@ -88,7 +188,13 @@ bool handle_main_touch(File* fp) {
             break;
         case MAIN_BTN_MENU:
             if (locked) break;
-            main_menu(&prefs, &tft, &touchscreen);
+            // the decoder may have left a transfer running between frames
+            display.dmaWait();
+            display.endWrite();
+            main_menu(&prefs, &tft, &touch);
+            // the tap that closed it isn't for the main screen, and the time in it isn't lag
+            touch.clear();
+            input_checked_us = 0;
             return true;
     }
     return false;
@@ -97,110 +203,211 @@ bool handle_main_touch(File* fp) {
 
 void loop() {
     // TODO: zero screen in between images
-    File fp;
-    int call_res;
+    QOIF2* img;
     long next_time, delay_until;
-    bool one_frame = false, anim_completed = false, in_delay = false, died = false;
+    bool one_frame = false, anim_completed = false, in_delay = false, died = false, prefetched = false;
 
     next_time = millis() + (prefs.display_time_s * 1000);
 
-    Serial.println("Open file");
-    fp = SD.open(files.get_cur_file());
-    if (!fp) {
+    if (next_slot->img != NULL && strcmp(next_slot->filename, files.get_cur_file()) == 0) {
+        // opened while the last one was playing
+        AnimSlot* slot = cur_slot;
+        cur_slot = next_slot;
+        next_slot = slot;
+        prefetched = true;
+    } else if (files.is_qoif2) {
+        Serial.println("Open file");
+        open_slot(cur_slot, files.get_cur_file(), true);
+    }
+    // the next one's worked out again from this one
+    close_slot(next_slot);
+    // and with the last one closed, this one can have the memory for reading it in whole
+    if (cur_slot->img != NULL && cur_slot->res == 0)
+        cur_slot->img->make_resident();
+
+    img = cur_slot->img;
+    if (!files.is_qoif2) {
+        die("Bad file type", files.get_cur_file());
+        died = true;
+    } else if (img == NULL) {
         die("Can't open file", files.get_cur_file());
         died = true;
     } else {
-        if (files.is_qoif2) {
-            QOIF2 img(&tft, &fp);
-            int res = img.open();
-            if (res != 0) {
-                switch (res) {
-                    case QOIF2_E_MAGIC:
-                        die("Opening QOIF2, bad magic", files.get_cur_file());
-                        break;
-                    case QOIF2_E_DIMENSIONS:
-                        die("Opening QOIF2, bad dimensions", files.get_cur_file());
-                        break;
-                    case QOIF2_E_CHANNELS:
-                        die("Opening QOIF2, bad channels", files.get_cur_file());
-                        break;
-                    case QOIF2_E_VERSION:
-                        die("Opening QOIF2, bad version", files.get_cur_file());
-                        break;
-                    default:
-                        die("Opening QOIF2, unknown error", files.get_cur_file());
-                        break;
-                }
-                died = true;
-            } else {
-                while (true) {
-                    in_delay = false;
-                    if (!one_frame) {
-                        res = img.read_and_render_block();
-                        switch (res) {
-                            case QOIF2_E_TRAILER:
-                                die("QOIF2: in trailer?", files.get_cur_file());
-                                died = true;
-                                goto FILE_DONE;
-                                break;
-                            case QOIF2_B_ONE_FRAME:
-                                one_frame = true;
-                                break;
-                            case QOIF2_B_END:
-                                anim_completed = true;
-                                break;
-                            case QOIF2_B_DELAY:
-                                in_delay = true;
-                                break;
-                            case QOIF2_B_CONTINUE:
-                                break;
-                            default:
-                                die("QOIF2: unknown error in block", files.get_cur_file());
-                                died = true;
-                                goto FILE_DONE;
-                                break;
-                        }
+        int res = cur_slot->res;
+        img->set_frame_cache(&frame_cache);
+        if (res != 0) {
+            switch (res) {
+                case QOIF2_E_MAGIC:
+                    die("Opening QOIF2, bad magic", files.get_cur_file());
+                    break;
+                case QOIF2_E_DIMENSIONS:
+                    die("Opening QOIF2, bad dimensions", files.get_cur_file());
+                    break;
+                case QOIF2_E_CHANNELS:
+                    die("Opening QOIF2, bad channels", files.get_cur_file());
+                    break;
+                case QOIF2_E_VERSION:
+                    die("Opening QOIF2, bad version", files.get_cur_file());
+                    break;
+                case QOIF2_E_INDEX:
+                    die("Opening QOIF2, bad index", files.get_cur_file());
+                    break;
+                default:
+                    die("Opening QOIF2, unknown error", files.get_cur_file());
+                    break;
+            }
+            died = true;
+        } else {
+            // what synced spent waiting on frames already counted
+            uint32_t sync_counted_us = synced.wait_us;
+            telemetry.begin(files.get_cur_file());
+            while (true) {
+                in_delay = false;
+                if (!one_frame) {
+                    res = img->read_and_render_block();
+                    if ((res == QOIF2_B_DELAY || res == QOIF2_B_CONTINUE) && img->get_block_flags() & QOIF2_F_END) {
+                        telemetry.add(&img->frame_stats, synced.wait_us - sync_counted_us);
+                        sync_counted_us = synced.wait_us;
                     }
-
-                    if (!paused && anim_completed && millis() >= next_time) {
-                        break;
+                    if (switch_start_us) {
+                        Serial.print(prefetched ? "Switched to prefetched file in " : "Switched to file in ");
+                        Serial.print(micros() - switch_start_us);
+                        Serial.println("us");
+                        switch_start_us = 0;
                     }
-
-                    delay_until = millis();
-                    if (in_delay) {
-                        if (img.delay_ms > 0)
-                            delay_until += img.delay_ms;
-
-                        if (img.delay_diff >= 0.95)
-                            set_status_led(STATUS_LED_GOOD);
-                        else if (img.delay_diff >- 0.85)
-                            set_status_led(STATUS_LED_OK);
-                        else if (img.delay_diff >= 0.75)
-                            set_status_led(STATUS_LED_POOR);
-                        else
-                            set_status_led(STATUS_LED_BAD);
+                    switch (res) {
+                        case QOIF2_E_TRAILER:
+                            die("QOIF2: in trailer?", files.get_cur_file());
+                            died = true;
+                            goto FILE_DONE;
+                            break;
+                        case QOIF2_E_DATA:
+                            die("QOIF2: block runs past end of file", files.get_cur_file());
+                            died = true;
+                            goto FILE_DONE;
+                            break;
+                        case QOIF2_B_ONE_FRAME:
+                            one_frame = true;
+                            break;
+                        case QOIF2_B_END:
+                            anim_completed = true;
+                            break;
+                        case QOIF2_B_DELAY:
+                            in_delay = true;
+                            break;
+                        case QOIF2_B_CONTINUE:
+                        case QOIF2_B_PARTIAL:
+                            break;
+                        default:
+                            die("QOIF2: unknown error in block", files.get_cur_file());
+                            died = true;
+                            goto FILE_DONE;
+                            break;
                     }
+                }
 
-                    do {
-                        if (handle_main_touch(&fp)) return;
-                        update_backlight(&prefs);
-                    } while (millis() < delay_until);
+                if (!paused && anim_completed && res != QOIF2_B_PARTIAL && millis() >= next_time) {
+                    // the last frame's been shown - the switch starts here, stats and all
+                    switch_start_us = micros();
+                    break;
                 }
+
+                delay_until = millis();
+                if (in_delay) {
+                    if (img->delay_ms > 0)
+                        delay_until += img->delay_ms;
+
+                    if (img->delay_diff >= 0.95)
+                        set_status_led(STATUS_LED_GOOD);
+                    else if (img->delay_diff >- 0.85)
+                        set_status_led(STATUS_LED_OK);
+                    else if (img->delay_diff >= 0.75)
+                        set_status_led(STATUS_LED_POOR);
+                    else
+                        set_status_led(STATUS_LED_BAD);
+                }
+
+                do {
+                    if (handle_main_touch(cur_slot)) return;
+                    update_backlight(&prefs);
+                    prefs_idle(&prefs);
+#ifdef TELEMETRY_CSV
+                    // the last file's, while this one's between frames
+                    if (in_delay)
+                        telemetry.csv_idle(TELEMETRY_CSV);
+#endif
+                    profiler_serial();
+                    // this file's read-ahead comes first
+                    if (!img->idle())
+                        prefetch(next_time);
+                } while (millis() < delay_until);
             }
-        } else {
-            die("Bad file type", files.get_cur_file());
-            died = true;
+            telemetry.print();
+#ifdef TELEMETRY_CSV
+            telemetry.finish();
+#endif
+            Serial.print("SD stalls: ");
+            Serial.print(img->get_stalls());
+            Serial.print(", ");
+            Serial.print(img->get_stall_us());
+            Serial.println("us");
+            Serial.print("SD reads: ");
+            Serial.print(img->get_read_bytes_per_min());
+            Serial.println(img->is_resident() ? " bytes/min, file in RAM" : " bytes/min, streamed");
+            Serial.print("Frame cache: ");
+            Serial.print(frame_cache.hit_rate());
+            Serial.print("% of blocks, ");
+            Serial.print(frame_cache.used);
+            Serial.println(" bytes");
+            Serial.print("Touch: ");
+            Serial.print(touch.busy_us_per_s());
+            Serial.print("us/s, ");
+            Serial.print(touch.samples);
+            Serial.println(" samples");
+            touch.reset_stats();
+            Serial.print("Sync: ");
+            Serial.print(synced.wait_us);
+            Serial.print("us waiting over ");
+            Serial.print(synced.frames);
+            Serial.print(" frames, ");
+            Serial.print(synced.late);
+            Serial.println(" late");
+            synced.reset_stats();
+            Serial.print("Frames: ");
+            Serial.print(img->get_realized_fps());
+            Serial.print(" fps of ");
+            Serial.print(img->get_authored_fps());
+            Serial.print(", ");
+            Serial.print(img->play.late);
+            Serial.print(" late, ");
+            Serial.print(img->play.dropped);
+            Serial.println(" dropped");
+            Serial.print("Input: acted on within ");
+            Serial.print(input_lag_max_ms);
+            Serial.print("ms, checked at least every ");
+            Serial.print(input_gap_max_us);
+            Serial.println("us");
+            input_lag_max_ms = 0;
+            input_gap_max_us = 0;
         }
     }
 
     FILE_DONE:
 
-    if (fp) fp.close();
+    if (!switch_start_us)
+        switch_start_us = micros();
+    close_slot(cur_slot);
     if (died) {
+        close_slot(next_slot);
         next_time = millis() + 4000;
         do {
             if (handle_main_touch(NULL)) return;
+            prefs_idle(&prefs);
+#ifdef TELEMETRY_CSV
+            telemetry.csv_idle(TELEMETRY_CSV);
+#endif
         } while (millis() < next_time);
+        switch_start_us = micros();
     }
     files.next_file(&prefs);
     update_backlight(&prefs);
@@ -0,0 +1,24 @@
+#ifndef _LEGACY_PREFS_IMPL_H_
+#define _LEGACY_PREFS_IMPL_H_
+
+// Saving prefs as it was before the journal - the whole struct written out every time - kept as
+// the "before" side of prefs_bench
+
+#include <SD.h>
+#include "prefs.h"
+
+inline void legacy_write_prefs(Prefs* prefs) {
+    File file;
+    file = SD.open(PREFS_FILENAME, FILE_WRITE);
+    if (!file) {
+        Serial.print("Can't write to ");
+        Serial.println(PREFS_FILENAME);
+        return;
+    }
+
+    prefs->version = PREFS_VERSION;
+    file.write((uint8_t*)prefs, sizeof(Prefs));
+    file.close();
+}
+
+#endif
@@ -0,0 +1,310 @@
+#ifndef _LEGACY_QOIF2_IMPL_H_
+#define _LEGACY_QOIF2_IMPL_H_
+
+// The QOIF2 decoder and FileBuffer as they were before the decoder was optimized, kept as
+// the "before" side of benchmarks and as a reference for checking output hasn't changed
+
+#include <Arduino.h>
+
+#include "QOIF2_impl.h"
+
+#define LEGACY_QOIF2_BUF_SZ 10000
+
+
+class LegacyFileBuffer {
+public:
+    uint8_t *buf;
+    int max_size = 0, head = 0, tail = 0, size = 0;
+    ByteSource *src;
+    long reset_pos = 0;
+
+    LegacyFileBuffer(ByteSource *src, int size) {
+        this->max_size = size;
+        this->buf = (uint8_t*) malloc(size);
+        this->src = src;
+        this->reset_pos = this->src->position();
+        this->fill();
+    }
+
+    ~LegacyFileBuffer() {
+        free(this->buf);
+    }
+
+    void fill() {
+        int max_read, read_b;
+        while (this->size < this->max_size) {
+            if (this->tail <= this->head) {
+                // read to end of buffer
+                max_read = min(this->max_size - this->size, this->max_size - this->head);
+                read_b = this->src->read(this->buf + this->head, max_read);
+            } else {
+                // read from head -> tail
+                max_read = this->tail - this->head;
+                read_b = this->src->read(this->buf + this->head, max_read);
+            }
+            this->size += read_b;
+            this->head = (this->head + read_b) % this->max_size;
+            if (read_b < max_read) {
+                // If we hit EOF, reset to starting pos & bail - we may not need data going forward
+                this->src->seek(this->reset_pos);
+                return;
+            }
+        }
+    }
+
+    int read(uint8_t* dest, int sz) {
+        if (this->size < sz) {
+            this->fill();
+            if (this->size < sz) {
+                return -1;
+            }
+        }
+        for (int offset = 0; offset < sz; offset++, this->size--, this->tail = (this->tail + 1) % this->max_size) {
+            dest[offset] = this->buf[this->tail];
+        }
+        return sz;
+    }
+
+    uint8_t readByte() {
+        uint8_t b = 0;
+        this->read(&b, 1);
+        return b;
+    }
+
+    int skip(int sz) {
+        if (this->size < sz) {
+            this->fill();
+            if (this->size < sz) {
+                return -1;
+            }
+        }
+        this->tail = (this->tail + sz) % this->max_size;
+        return sz;
+    }
+};
+
+
+class LegacyQOIF2 {
+private:
+    PixelSink* sink;
+    ByteSource* src;
+    QOIF2FileHeader fh;
+    QOIF2BlockHeader1 bh1;
+    QOIF2BlockHeader2 bh2;
+    QOIF2BlockHeader2Big bh2b;
+    unsigned int width, height, x, y;
+    int frame_count = 0;
+    int8_t dr, dg, db;
+    uint8_t r, g, b, run;
+    long blocks_start, frame_start;
+    uint32_t trailer_temp;
+    uint16_t cache[64], cur_px, last_px = 0, buffer[2][LEGACY_QOIF2_BUF_SZ], wbufpos = 0, rbufpos = 0;
+    uint8_t wbuf = 0, rbuf = 0, tag, arg1, arg2;
+    LegacyFileBuffer *read_buf = NULL;
+
+public:
+    long delay_ms;
+    float delay_diff;
+
+    LegacyQOIF2(PixelSink* sink, ByteSource* src) {
+        this->sink = sink;
+        this->src = src;
+    }
+
+    ~LegacyQOIF2() {
+        if (this->read_buf)
+            delete this->read_buf;
+    }
+
+    int open() {
+        this->src->read((uint8_t*)&this->fh, sizeof(this->fh));
+        if (this->fh.magic != QOIF2_MAGIC) {
+            return QOIF2_E_MAGIC;
+        }
+        if (this->fh.width != SCREEN_WIDTH || this->fh.height != SCREEN_HEIGHT) {
+            // TODO: figure out scaling/centering/or just rendering what fits
+            return QOIF2_E_DIMENSIONS;
+        }
+        if (this->fh.channels != 2) {
+            // TODO: support at least rgb
+            return QOIF2_E_CHANNELS;
+        }
+        if (this->fh.version != 2) {
+            return QOIF2_E_VERSION;
+        }
+
+        blocks_start = this->src->position();
+        this->read_buf = new LegacyFileBuffer(this->src, LEGACY_QOIF2_BUF_SZ);
+
+        return 0;
+    }
+
+    uint8_t get_block_flags() {
+        return this->bh1.flags;
+    }
+
+    int get_frame_count() {
+        return this->frame_count;
+    }
+
+    int read_and_render_block() {
+        // Serial.println("Reading blocks");
+        this->wbuf = 0;
+        this->rbuf = 0;
+        this->wbufpos = 0;
+        this->rbufpos = 0;
+
+        // Serial.println("Read bh1");
+        this->read_buf->read((uint8_t*)&this->bh1, sizeof(this->bh1));
+        if (this->bh1.flags == 0 && this->bh1.duration == 0 && this->bh1.datalen == 0) {
+            // bh1 is 7b, trailer is 8b ending in 0x01 - datalen should never be 0 so we should be in the trailer
+            if (this->read_buf->readByte() == 1) {
+                // if only 1 frame, break & delay, otherwise continue the loop
+                if (this->frame_count < 2)
+                    return QOIF2_B_ONE_FRAME;
+                return QOIF2_B_END;
+            } else {
+                // error condition
+                return QOIF2_E_TRAILER;
+            }
+        }
+
+        if (this->bh1.flags & QOIF2_F_START) {
+            this->frame_start = millis();
+            this->frame_count++;
+        }
+
+        if (this->bh1.flags & QOIF2_F_BIG) {
+            // Serial.println("Read bh2b");
+            this->read_buf->read((uint8_t*)&this->bh2b, sizeof(this->bh2b));
+            this->width = this->bh2b.width;
+            this->height = this->bh2b.height;
+            this->x = this->bh2b.x;
+            this->y = this->bh2b.y;
+        } else {
+            // Serial.println("Read bh2");
+            this->read_buf->read((uint8_t*)&this->bh2, sizeof(this->bh2));
+            this->width = this->bh2.width;
+            this->height = this->bh2.height;
+            this->x = this->bh2.x;
+            this->y = this->bh2.y;
+        }
+
+        this->sink->dmaWait();
+        this->sink->endWrite();
+        this->sink->startWrite();
+        this->sink->setAddrWindow(this->x, this->y, this->width, this->height);
+
+        // Serial.println("Read img data");
+        int read_b = 0;
+        while (read_b < (int) this->bh1.datalen) {
+            this->run = 1;
+            read_b += this->read_buf->read(&this->tag, 1);
+            switch (this->tag) {
+                case 0xff:
+                    // RGBA - not supported
+                    this->read_buf->skip(4);
+                    continue;
+                    break;
+                case 0xfe:
+                    // RGB - already verified 16b
+                    // Serial.println("tag: rgb");
+                    read_b += this->read_buf->read((uint8_t*)&this->cur_px, sizeof(this->cur_px));
+                    break;
+                default:
+                    this->arg1 = this->tag & 0b00111111;
+                    this->tag = this->tag >> 6;
+                    switch (this->tag) {
+                        case 0:
+                            // index
+                            // Serial.println("tag: index");
+                            this->cur_px = this->cache[this->arg1];
+                            break;
+                        case 1:
+                            // diff
+                            // Serial.println("tag: diff");
+                            this->dr = (this->arg1 >> 4) - 2;
+                            this->dg = ((this->arg1 >> 2) & 0b11) - 2;
+                            this->db = (this->arg1 & 0b11) - 2;
+                            this->r = this->last_px >> 11;
+                            this->g = this->last_px >> 5 & 0b111111;
+                            this->b = this->last_px & 0b11111;
+                            this->r += this->dr;
+                            this->g += this->dg;
+                            this->b += this->db;
+                            this->cur_px = (this->r << 11) | (this->g << 5) | this->b;
+                            break;
+                        case 2:
+                            // luma
+                            // Serial.println("tag: luma");
+                            read_b += this->read_buf->read((uint8_t*)&this->arg2, sizeof(this->arg2));
+                            this->cur_px = this->last_px;
+                            this->dg = this->arg1 - 32;
+                            this->dr = ((this->arg2 >> 4) - 8) + this->dg;
+                            this->db = ((this->arg2 & 0b1111) - 8) + this->dg;
+                            this->r = this->last_px >> 11;
+                            this->g = this->last_px >> 5 & 0b111111;
+                            this->b = this->last_px & 0b11111;
+                            this->r += this->dr;
+                            this->g += this->dg;
+                            this->b += this->db;
+                            this->cur_px = (this->r << 11) | (this->g << 5) | this->b;
+                            break;
+                        case 3:
+                            // run
+                            // Serial.println("tag: run");
+                            this->cur_px = this->last_px;
+                            this->run = this->arg1 + 1;
+                            break;
+                    }
+            }
+
+            if (this->run > 1 || this->rbufpos + this->run > LEGACY_QOIF2_BUF_SZ) {
+                // Dump the buffer to the screen if there's a run of pixels, or it's full
+                // Serial.println("Write to screen - buffer full");
+                this->sink->dmaWait();
+                this->wbuf = this->rbuf;
+                this->wbufpos = this->rbufpos;
+                this->sink->writePixels(this->buffer[this->wbuf], this->wbufpos);
+                this->rbuf = this->rbuf ? 0 : 1;
+                this->rbufpos = 0;
+            }
+            if (this->run > 1) {
+                // write the run of pixels
+                this->sink->dmaWait();
+                this->sink->writeColor(this->cur_px, this->run);
+            } else {
+                // otherwise, put the pixel into the buffer
+                this->buffer[this->rbuf][this->rbufpos++] = this->cur_px;
+            }
+            this->last_px = this->cur_px;
+            this->cache[(this->cur_px * 6311) % 64] = this->cur_px;
+        }
+
+        // Serial.println("End of block data");
+
+        if (this->rbufpos) {
+            // Serial.println("Write to screen - data still in buffer");
+            this->sink->dmaWait();
+            this->wbuf = this->rbuf;
+            this->wbufpos = this->rbufpos;
+            this->sink->writePixels(this->buffer[this->wbuf], this->wbufpos);
+        }
+
+        if (this->bh1.flags & QOIF2_F_END) {
+            this->sink->dmaWait();
+            this->sink->endWrite();
+            if (this->bh1.duration) {
+                this->read_buf->fill();
+                this->delay_ms = this->bh1.duration - (millis() - this->frame_start);
+                this->delay_diff = (float) this->delay_ms / (float) this->bh1.duration;
+                return QOIF2_B_DELAY;
+            }
+        }
+
+        // Serial.println("End of loop");
+        return QOIF2_B_CONTINUE;
+    }
+};
+
+#endif
@@ -0,0 +1,147 @@
+// Switching benchmark, decoders opened in the static arena against ones allocated each time
+//
+//   arena_bench [-n switches] <file.qox|directory>...
+//
+// Opens each file switches times (default 20), alternating between the two slots as the player
+// does, and plays it through twice with the frame cache - once with the decoder and its file
+// buffer allocated (QOIF2 on its own) and once in the arena (see Arena_impl.h). In the arena each
+// one's opened ahead while the last one's still open, then moved into the resident memory once
+// that one's closed, as the player does. Counts every allocation made while switching, which in
+// the arena has to be none, and checks both drew the same, kept the file in memory as often, and
+// how much each read. Then prints the arena's budget report.
+
+#include <Arduino.h>
+
+#include <string>
+#include <vector>
+
+#include "bench_impl.h"
+#include "QOIF2_impl.h"
+#include "Arena_impl.h"
+
+// Everything goes through malloc in the end, so counting it here counts operator new too
+extern "C" void* __libc_malloc(size_t size);
+size_t bench_mallocs = 0;
+
+extern "C" void* malloc(size_t size) {
+    bench_mallocs++;
+    return __libc_malloc(size);
+}
+
+FrameCache frame_cache(FRAME_CACHE_BYTES, arena.frame_cache);
+
+struct ArenaResult {
+    bool ok = true;
+    size_t mallocs = 0;
+    // switches the file was played resident, and what was read from the card
+    int resident = 0;
+    uint64_t hash = 0, switch_ns = 0, read_bytes = 0;
+};
+
+ArenaResult bench_arena(const std::vector<uint8_t>& data, int switches, bool in_arena) {
+    ArenaResult out;
+    HostSink sink(true);
+    MemorySource srcs[ARENA_SLOTS] = {MemorySource(&data), MemorySource(&data)};
+    QOIF2* last = NULL;
+    size_t mallocs = bench_mallocs;
+    for (int i = 0; i < switches; i++) {
+        MemorySource* src = &srcs[i % ARENA_SLOTS];
+        src->seek(0);
+        uint64_t start = bench_now_ns();
+        QOIF2* img;
+        if (in_arena) {
+            img = arena_open(i % ARENA_SLOTS, &sink, src);
+            if (img->open(false) != 0)
+                out.ok = false;
+            while (out.ok && img->idle());
+            if (last)
+                arena_close(last);
+            img->make_resident();
+        } else {
+            img = new QOIF2(&sink, src);
+            if (img->open() != 0)
+                out.ok = false;
+        }
+        img->set_frame_cache(&frame_cache);
+        out.switch_ns += bench_now_ns() - start;
+        out.resident += img->is_resident();
+
+        int passes = 0;
+        while (out.ok && passes < 2) {
+            int res = img->read_and_render_block();
+            if (res == QOIF2_B_END || res == QOIF2_B_ONE_FRAME)
+                passes++;
+            else if (res != QOIF2_B_DELAY && res != QOIF2_B_CONTINUE && res != QOIF2_B_PARTIAL)
+                out.ok = false;
+        }
+
+        out.read_bytes += img->get_read_bytes();
+        // in the arena it's closed once the next one's opened
+        start = bench_now_ns();
+        if (in_arena)
+            last = img;
+        else
+            delete img;
+        out.switch_ns += bench_now_ns() - start;
+        if (!out.ok)
+            break;
+    }
+    if (last)
+        arena_close(last);
+    out.mallocs = bench_mallocs - mallocs;
+    out.hash = sink.hash();
+    return out;
+}
+
+void print_arena(const std::string& name, const ArenaResult& r, int switches) {
+    if (!r.ok) {
+        printf("%-24s can't play it\n", name.c_str());
+        return;
+    }
+    printf("%-24s %12.2f %12.1f %9d %12.1f\n", name.c_str(), (double) r.mallocs / switches, r.switch_ns / 1000.0 / switches,
+        r.resident, r.read_bytes / 1024.0 / switches);
+}
+
+int main(int argc, char** argv) {
+    int switches = 20;
+    std::vector<std::string> args;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            switches = max(atoi(argv[++i]), 1);
+        else
+            args.push_back(argv[i]);
+    }
+
+    std::vector<std::string> files = bench_collect_files(args);
+    if (files.empty()) {
+        fprintf(stderr, "usage: %s [-n switches] <file.qox|directory>...\n", argv[0]);
+        return 1;
+    }
+
+    bool ok = true;
+    printf("%-24s %12s %12s %9s %12s\n", "file", "allocs/sw", "switch us", "resident", "KB read/sw");
+    for (const std::string& path : files) {
+        std::vector<uint8_t> data;
+        if (!bench_load_file(path, &data)) {
+            printf("%-24s can't read\n", bench_basename(path).c_str());
+            continue;
+        }
+        ArenaResult heap = bench_arena(data, switches, false);
+        ArenaResult in_arena = bench_arena(data, switches, true);
+        print_arena(bench_basename(path), heap, switches);
+        print_arena("  arena", in_arena, switches);
+        if (in_arena.mallocs)
+            printf("ARENA ALLOCATED\n");
+        if (in_arena.hash != heap.hash)
+            printf("ARENA DREW DIFFERENTLY\n");
+        if (in_arena.resident != heap.resident)
+            printf("ARENA KEPT IT IN MEMORY DIFFERENTLY\n");
+        ok &= heap.ok && in_arena.ok && !in_arena.mallocs && in_arena.hash == heap.hash && in_arena.resident == heap.resident;
+    }
+
+    Serial.out = stdout;
+    printf("\n");
+    arena_report();
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,324 @@
+#ifndef _BENCH_IMPL_H_
+#define _BENCH_IMPL_H_
+
+// Host stand-ins for the SD card and the display, plus the bits every benchmark needs
+
+#include <Arduino.h>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "constants.h"
+#include "ByteSource_impl.h"
+#include "PixelSink_impl.h"
+
+
+inline uint64_t bench_now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline uint64_t bench_now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+// A whole file held in memory, so the numbers measure the decoder and not the disk
+class MemorySource : public ByteSource {
+private:
+    const std::vector<uint8_t>* data;
+    uint32_t pos = 0;
+
+public:
+    uint64_t bytes_read = 0;
+    uint32_t reads = 0;
+
+    MemorySource(const std::vector<uint8_t>* data) {
+        this->data = data;
+    }
+
+    int read(uint8_t* buf, int len) {
+        int avail = (int) (this->data->size() - this->pos);
+        if (len > avail)
+            len = avail;
+        if (len <= 0)
+            return 0;
+        memcpy(buf, this->data->data() + this->pos, len);
+        this->pos += len;
+        this->bytes_read += len;
+        this->reads++;
+        return len;
+    }
+
+    bool seek(uint32_t pos) {
+        if (pos > this->data->size())
+            return false;
+        this->pos = pos;
+        return true;
+    }
+
+    uint32_t position() {
+        return this->pos;
+    }
+
+    uint32_t size() {
+        return this->data->size();
+    }
+};
+
+
+// Another source read as slowly as the SD card: every read takes read_us, plus byte_ns a byte
+class SlowSource : public ByteSource {
+private:
+    ByteSource* src;
+
+public:
+    uint32_t read_us = 100, byte_ns = 400;
+    uint64_t wait_ns = 0;
+
+    SlowSource(ByteSource* src) {
+        this->src = src;
+    }
+
+    int read(uint8_t* buf, int len) {
+        uint64_t start = bench_now_ns(), until = start + this->read_us * 1000ULL;
+        int read_b = this->src->read(buf, len);
+        if (read_b > 0)
+            until += (uint64_t) read_b * this->byte_ns;
+        while (bench_now_ns() < until);
+        this->wait_ns += bench_now_ns() - start;
+        return read_b;
+    }
+
+    bool seek(uint32_t pos) {
+        return this->src->seek(pos);
+    }
+
+    uint32_t position() {
+        return this->src->position();
+    }
+
+    uint32_t size() {
+        return this->src->size();
+    }
+};
+
+
+// Counts what would have gone over the display bus, optionally drawing it into a framebuffer
+class HostSink : public PixelSink {
+private:
+    uint16_t wx = 0, wy = 0, ww = 0, wh = 0;
+    uint32_t cursor = 0;
+
+protected:
+    void put(const uint16_t* colors, uint16_t color, uint32_t len) {
+        while (len && this->cursor < (uint32_t) this->ww * this->wh) {
+            uint32_t col = this->cursor % this->ww, row = this->cursor / this->ww;
+            uint32_t n = min(len, (uint32_t) this->ww - col);
+            uint16_t* dest = this->fb.data() + (this->wy + row) * SCREEN_WIDTH + this->wx + col;
+            if (this->wy + row < SCREEN_HEIGHT && this->wx + col + n <= SCREEN_WIDTH) {
+                if (colors) {
+                    memcpy(dest, colors, n * sizeof(uint16_t));
+                    colors += n;
+                } else {
+                    std::fill(dest, dest + n, color);
+                }
+            }
+            this->cursor += n;
+            len -= n;
+        }
+    }
+
+public:
+    bool render = false;
+    std::vector<uint16_t> fb;
+    uint64_t pixels = 0, transfers = 0, windows = 0;
+    // only counted by sinks that model the bus
+    uint64_t wait_ns = 0, dma_ns = 0;
+
+    HostSink(bool render = false) : fb(SCREEN_PX, 0) {
+        this->render = render;
+    }
+
+    // Lands anything still in flight, before looking at the framebuffer
+    virtual void sync() {}
+
+    void startWrite() {}
+    void endWrite() {}
+    void dmaWait() {}
+    bool dmaBusy() { return false; }
+
+    void setAddrWindow(uint16_t x, uint16_t y, uint16_t w, uint16_t h) {
+        this->wx = x;
+        this->wy = y;
+        this->ww = w;
+        this->wh = h;
+        this->cursor = 0;
+        this->windows++;
+    }
+
+    void writePixels(uint16_t* colors, uint32_t len) {
+        this->pixels += len;
+        this->transfers++;
+        if (this->render)
+            this->put(colors, 0, len);
+    }
+
+    void writeColor(uint16_t color, uint32_t len) {
+        this->pixels += len;
+        this->transfers++;
+        if (this->render)
+            this->put(NULL, color, len);
+    }
+
+    // FNV-1a over the framebuffer, to compare what different decoders put on screen
+    uint64_t hash(uint64_t h = 14695981039346656037ULL) {
+        const uint8_t* p = (const uint8_t*) this->fb.data();
+        for (size_t i = 0; i < this->fb.size() * sizeof(uint16_t); i++)
+            h = (h ^ p[i]) * 1099511628211ULL;
+        return h;
+    }
+};
+
+
+// Behaves like the badge's display: writePixels starts a DMA transfer and returns, and the bus
+// stays busy for setup_ns + len * px_ns afterwards. Everything else waits for the bus and then
+// keeps the CPU busy itself. When rendering, a buffer that changes while its transfer is in
+// flight - before the decoder has waited on it - is counted in early_reuse.
+class DmaSimSink : public HostSink {
+private:
+    uint64_t busy_until = 0;
+    uint16_t* pending = NULL;
+    std::vector<uint16_t> sent;
+    bool landed = true;
+
+    static void spin_until(uint64_t until) {
+        while (bench_now_ns() < until);
+    }
+
+    void wait_bus() {
+        uint64_t now = bench_now_ns();
+        if (now < this->busy_until) {
+            spin_until(this->busy_until);
+            this->wait_ns += this->busy_until - now;
+        }
+        this->sync();
+        if (this->pending && memcmp(this->pending, this->sent.data(), this->sent.size() * sizeof(uint16_t)) != 0)
+            this->early_reuse++;
+        this->pending = NULL;
+    }
+
+public:
+    uint32_t px_ns = 4, color_px_ns = 6, setup_ns = 250;
+    uint64_t early_reuse = 0;
+
+    using HostSink::HostSink;
+
+    void sync() {
+        if (!this->landed)
+            this->put(this->sent.data(), 0, this->sent.size());
+        this->landed = true;
+    }
+
+    void startWrite() {}
+
+    void endWrite() {
+        this->wait_bus();
+    }
+
+    void dmaWait() {
+        this->wait_bus();
+    }
+
+    bool dmaBusy() {
+        return bench_now_ns() < this->busy_until;
+    }
+
+    void setAddrWindow(uint16_t x, uint16_t y, uint16_t w, uint16_t h) {
+        this->wait_bus();
+        spin_until(bench_now_ns() + this->setup_ns);
+        HostSink::setAddrWindow(x, y, w, h);
+    }
+
+    void writePixels(uint16_t* colors, uint32_t len) {
+        this->wait_bus();
+        this->pixels += len;
+        this->transfers++;
+        if (this->render) {
+            this->pending = colors;
+            this->sent.assign(colors, colors + len);
+            this->landed = false;
+        }
+        uint64_t took = this->setup_ns + (uint64_t) len * this->px_ns;
+        this->busy_until = bench_now_ns() + took;
+        this->dma_ns += took;
+    }
+
+    void writeColor(uint16_t color, uint32_t len) {
+        this->wait_bus();
+        spin_until(bench_now_ns() + this->setup_ns + (uint64_t) len * this->color_px_ns);
+        HostSink::writeColor(color, len);
+    }
+};
+
+// pct in 0-100, sorts values in place
+template <typename T>
+T bench_percentile(std::vector<T>& values, double pct) {
+    if (values.empty())
+        return 0;
+    size_t idx = (size_t) ((pct / 100.0) * (values.size() - 1) + 0.5);
+    std::nth_element(values.begin(), values.begin() + idx, values.end());
+    return values[idx];
+}
+
+inline bool bench_load_file(const std::string& path, std::vector<uint8_t>* out) {
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (!fp)
+        return false;
+    fseek(fp, 0, SEEK_END);
+    long len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    out->resize(len);
+    bool ok = fread(out->data(), 1, len, fp) == (size_t) len;
+    fclose(fp);
+    return ok;
+}
+
+// Expands directories into the .qox files they contain, sorted so runs are comparable
+inline std::vector<std::string> bench_collect_files(const std::vector<std::string>& args, const char* ext = ".qox") {
+    std::vector<std::string> out;
+    for (const std::string& arg : args) {
+        struct stat st;
+        if (stat(arg.c_str(), &st) != 0)
+            continue;
+        if (!S_ISDIR(st.st_mode)) {
+            out.push_back(arg);
+            continue;
+        }
+        std::vector<std::string> found;
+        DIR* dir = opendir(arg.c_str());
+        if (!dir)
+            continue;
+        while (struct dirent* ent = readdir(dir)) {
+            std::string name(ent->d_name);
+            if (name.size() > strlen(ext) && strcasecmp(name.c_str() + name.size() - strlen(ext), ext) == 0)
+                found.push_back(arg + "/" + name);
+        }
+        closedir(dir);
+        std::sort(found.begin(), found.end());
+        out.insert(out.end(), found.begin(), found.end());
+    }
+    return out;
+}
+
+inline std::string bench_basename(const std::string& path) {
+    size_t slash = path.find_last_of('/');
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+#endif
@@ -0,0 +1,172 @@
+// Read-path micro-benchmark, the FileBuffer the decoder used before against the current one
+//
+//   filebuffer_bench [-t seconds] [file|directory]...
+//
+// Streams the given files (or, with none, a few MB of random bytes) through each buffer in the
+// ways the decoder reads, and prints MB/s for each. Every way sums what it read, and the sums
+// have to agree for the numbers to mean anything.
+
+#include <Arduino.h>
+
+#include <string>
+#include <vector>
+
+#include "bench_impl.h"
+#include "QOIF2_impl.h"
+#include "LegacyQOIF2_impl.h"
+
+#define RANDOM_BYTES (4 * 1024 * 1024)
+
+
+// Bytes each tag byte is followed by, from the decoder's op table
+uint8_t op_args[256];
+
+// One byte at a time through read(), as the decoder originally fetched every tag
+template <class Buffer>
+uint64_t read_single(Buffer* fb, size_t len) {
+    uint64_t sum = 0;
+    uint8_t b = 0;
+    for (size_t i = 0; i < len; i++) {
+        fb->read(&b, 1);
+        sum += b;
+    }
+    return sum;
+}
+
+template <class Buffer>
+uint64_t read_bytes(Buffer* fb, size_t len) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < len; i++)
+        sum += fb->readByte();
+    return sum;
+}
+
+// A tag, then its arguments in one read(), the way the decoder did it before spans
+template <class Buffer>
+uint64_t read_ops(Buffer* fb, size_t len) {
+    uint64_t sum = 0;
+    uint8_t args[4];
+    size_t i = 0;
+    while (i < len) {
+        uint8_t tag = fb->readByte();
+        uint8_t n = min((size_t) op_args[tag], len - i - 1);
+        sum += tag;
+        if (n) {
+            fb->read(args, n);
+            for (uint8_t j = 0; j < n; j++)
+                sum += args[j];
+        }
+        i += 1 + n;
+    }
+    return sum;
+}
+
+// The same ops, walked straight out of peek()'s spans
+uint64_t span_ops(FileBuffer* fb, size_t len) {
+    uint64_t sum = 0;
+    size_t left = len;
+    while (left) {
+        int avail;
+        const uint8_t* p = fb->peek(&avail, QOIF2_MAX_OP);
+        const uint8_t *start = p, *limit = p + min(left, (size_t) max(avail - QOIF2_MAX_OP + 1, 1));
+        while (p < limit) {
+            uint8_t tag = *p++;
+            uint8_t n = min((size_t) op_args[tag], (size_t) (start + left - p));
+            sum += tag;
+            for (uint8_t j = 0; j < n; j++)
+                sum += *p++;
+        }
+        fb->consume(p - start);
+        left -= p - start;
+    }
+    return sum;
+}
+
+struct Way {
+    const char* name;
+    uint64_t (*legacy)(LegacyFileBuffer*, size_t);
+    uint64_t (*current)(FileBuffer*, size_t);
+};
+
+template <class Buffer>
+double time_way(uint64_t (*fn)(Buffer*, size_t), const std::vector<uint8_t>& data, int buf_sz, double min_seconds, uint64_t* sum) {
+    uint64_t ns = 0, bytes = 0;
+    while (ns == 0 || ns < min_seconds * 1e9) {
+        MemorySource src(&data);
+        Buffer fb(&src, buf_sz);
+        uint64_t start = bench_now_ns();
+        *sum = fn(&fb, data.size());
+        ns += bench_now_ns() - start;
+        bytes += data.size();
+    }
+    return bytes / (ns / 1e9) / 1e6;
+}
+
+int main(int argc, char** argv) {
+    double min_seconds = 1;
+    std::vector<std::string> args;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            min_seconds = atof(argv[++i]);
+        } else {
+            args.push_back(argv[i]);
+        }
+    }
+
+    for (int tag = 0; tag < 256; tag++) {
+        switch (QOIF2_OPS[tag].op) {
+            case QOIF2_OP_LUMA: op_args[tag] = 1; break;
+            case QOIF2_OP_RGB: op_args[tag] = 2; break;
+            case QOIF2_OP_SKIP: op_args[tag] = 2; break;
+            default: op_args[tag] = 0; break;
+        }
+    }
+
+    std::vector<uint8_t> data;
+    for (const std::string& path : bench_collect_files(args)) {
+        std::vector<uint8_t> file;
+        if (bench_load_file(path, &file))
+            data.insert(data.end(), file.begin(), file.end());
+    }
+    if (data.empty()) {
+        srand(1);
+        data.resize(RANDOM_BYTES);
+        for (uint8_t& b : data)
+            b = rand();
+    }
+    printf("%zu bytes, buffer %d bytes before and %d after\n", data.size(), LEGACY_QOIF2_BUF_SZ, QOIF2_FILE_BUF_SZ);
+
+    const Way ways[] = {
+        {"read(1)", read_single<LegacyFileBuffer>, read_single<FileBuffer>},
+        {"readByte", read_bytes<LegacyFileBuffer>, read_bytes<FileBuffer>},
+        {"ops, read", read_ops<LegacyFileBuffer>, read_ops<FileBuffer>},
+        {"ops, span", NULL, span_ops},
+    };
+
+    printf("%-12s %10s %10s %8s\n", "", "before", "after", "speedup");
+    uint64_t expect = 0;
+    for (const uint8_t& b : data)
+        expect += b;
+    bool ok = true;
+    for (const Way& way : ways) {
+        uint64_t sum = 0;
+        double before = 0, after;
+        printf("%-12s", way.name);
+        if (way.legacy) {
+            before = time_way(way.legacy, data, LEGACY_QOIF2_BUF_SZ, min_seconds, &sum);
+            ok &= sum == expect;
+            printf(" %10.1f", before);
+        } else {
+            printf(" %10s", "-");
+        }
+        after = time_way(way.current, data, QOIF2_FILE_BUF_SZ, min_seconds, &sum);
+        ok &= sum == expect;
+        printf(" %10.1f", after);
+        if (before)
+            printf(" %7.2fx", after / before);
+        printf("\n");
+    }
+    printf("MB/s%s\n", ok ? "" : ", READ THE WRONG BYTES");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,157 @@
+// File switching benchmark, the directory walk FileList used to do against the on-card index
+//
+//   filelist_bench [-s steps] [count]...
+//
+// Fills a simulated card (see host/SD.h) with a directory of count .qox files, and a few that
+// aren't animations, then sets up a list of them and steps through it with next_file. Prints
+// what setting up and each step cost: host time, what the card was asked to do, and an
+// estimate of how long that takes on the badge (see the SD_* costs below). Counts default to
+// 10, 100 and 1000. Both lists have to step through the same files for the numbers to count.
+
+#include <Arduino.h>
+#include <SD.h>
+
+#include <string>
+#include <vector>
+
+#include "bench_impl.h"
+#include "FileList_impl.h"
+#include "LegacyFileList_impl.h"
+
+// Rough costs of the card on the badge: every directory entry looked at (16 to a sector), and
+// every read or write call plus its bytes, the same as SlowSource's
+#define SD_DIR_ENTRY_US 20
+#define SD_CALL_US 100
+#define SD_BYTE_NS 400
+
+
+struct ListCost {
+    double host_us = 0;
+    HostSDStats ops;
+
+    double card_us() const {
+        return this->ops.dir_entries * SD_DIR_ENTRY_US + (this->ops.reads + this->ops.writes) * SD_CALL_US
+            + (this->ops.bytes_read + this->ops.bytes_written) * SD_BYTE_NS / 1000.0;
+    }
+};
+
+HostSDStats stats_since(const HostSDStats& before) {
+    HostSDStats now = host_sd.stats, out;
+    out.opens = now.opens - before.opens;
+    out.dir_entries = now.dir_entries - before.dir_entries;
+    out.reads = now.reads - before.reads;
+    out.writes = now.writes - before.writes;
+    out.seeks = now.seeks - before.seeks;
+    out.removes = now.removes - before.removes;
+    out.bytes_read = now.bytes_read - before.bytes_read;
+    out.bytes_written = now.bytes_written - before.bytes_written;
+    return out;
+}
+
+// Runs fn, and returns what it cost
+template <class Fn>
+ListCost measure(Fn fn) {
+    ListCost out;
+    HostSDStats before = host_sd.stats;
+    uint64_t start = bench_now_ns();
+    fn();
+    out.host_us = (bench_now_ns() - start) / 1000.0;
+    out.ops = stats_since(before);
+    return out;
+}
+
+void make_card(int count) {
+    host_sd = HostSDCard();
+    host_sd.add("/preferences.bin", std::vector<uint8_t>(sizeof(Prefs)));
+    for (int i = 0; i < count; i++) {
+        char name[64];
+        // animations with a header, and now and then something that isn't one
+        snprintf(name, sizeof(name), "/animation_%04d.qox", i);
+        // every so often one's name is as long as the player can open
+        std::string path = name;
+        if (i % 10 == 7)
+            path.insert(path.size() - 4, FILELIST_PATH_LEN - 1 - path.size(), 'x');
+        QOIF2FileHeader header = {QOIF2_MAGIC, 240, 320, 2, 0, QOIF2_VERSION};
+        std::vector<uint8_t> data((uint8_t*) &header, (uint8_t*) &header + sizeof(header));
+        data.resize(sizeof(header) + 1000 + i);
+        host_sd.add(path, data);
+        if (i % 10 == 5) {
+            snprintf(name, sizeof(name), "/notes_%04d.txt", i);
+            host_sd.add(name, std::vector<uint8_t>(100));
+            snprintf(name, sizeof(name), "/._animation_%04d.qox", i);
+            host_sd.add(name, std::vector<uint8_t>(100));
+        }
+    }
+}
+
+void print_row(int count, const char* what, const ListCost& cost, int steps = 1) {
+    printf("%6d %-22s %10.1f %10.2f %7.1f %9.1f %7.1f %9.0f\n", count, what,
+        cost.host_us / steps, cost.card_us() / steps / 1000.0,
+        (double) cost.ops.opens / steps, (double) cost.ops.dir_entries / steps,
+        (double) (cost.ops.reads + cost.ops.writes) / steps, (double) (cost.ops.bytes_read + cost.ops.bytes_written) / steps);
+}
+
+int main(int argc, char** argv) {
+    int steps = 100;
+    std::vector<int> counts;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            steps = atoi(argv[++i]);
+        } else {
+            counts.push_back(atoi(argv[i]));
+        }
+    }
+    if (counts.empty())
+        counts = {10, 100, 1000};
+
+    bool ok = true;
+    printf("%6s %-22s %10s %10s %7s %9s %7s %9s\n", "files", "", "host us", "card ms", "opens", "dir ents", "r/w", "bytes");
+    for (int count : counts) {
+        make_card(count);
+        std::vector<std::string> before_files, after_files;
+
+        LegacyFileList before(FILE_DIRECTORY);
+        ListCost before_init = measure([&] { before.init(); });
+        ListCost before_step = measure([&] {
+            for (int i = 0; i < steps; i++) {
+                before.next_file(NULL);
+                before_files.push_back(before.get_cur_file());
+            }
+        });
+
+        FileList after(FILE_DIRECTORY);
+        ListCost cold_init = measure([&] { after.init(); });
+        ListCost warm_init = measure([&] { after.init(); });
+        ListCost after_step = measure([&] {
+            for (int i = 0; i < steps; i++) {
+                after.next_file(NULL);
+                after_files.push_back(after.get_cur_file());
+            }
+        });
+        ok &= after.is_indexed() && after.get_num_files() == count && before_files == after_files;
+
+        // Anything changing in the directory has to be noticed
+        host_sd.add("/added.qox", std::vector<uint8_t>(100));
+        after.init();
+        ok &= after.get_num_files() == count + 1;
+        host_sd.find("/added.qox")->data.resize(200);
+        ListCost changed_init = measure([&] { after.init(); });
+        ok &= changed_init.ops.writes > 0 && after.get_num_files() == count + 1;
+
+        // One with a name too long to open is left out
+        std::string too_long = "/" + std::string(FILELIST_PATH_LEN - 5, 'x') + ".qox";
+        host_sd.add(too_long, std::vector<uint8_t>(100));
+        after.init();
+        ok &= after.get_num_files() == count + 1;
+
+        print_row(count, "before: init", before_init);
+        print_row(count, "before: next_file", before_step, steps);
+        print_row(count, "after: init, new index", cold_init);
+        print_row(count, "after: init", warm_init);
+        print_row(count, "after: next_file", after_step, steps);
+    }
+    if (!ok)
+        printf("LISTS DIFFER\n");
+    return ok ? 0 : 1;
+}
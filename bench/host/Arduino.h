@@ -0,0 +1,104 @@
+#ifndef _HOST_ARDUINO_H_
+#define _HOST_ARDUINO_H_
+
+// Just enough of the Arduino core for the decoder headers to build on a desktop
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+
+using std::min;
+using std::max;
+
+#define DEC 10
+#define HEX 16
+
+// Added to the clock, so benchmarks can let time pass without waiting for it
+inline unsigned long host_skipped_us = 0;
+
+inline unsigned long micros() {
+    static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count() + host_skipped_us;
+}
+
+inline void host_skip_ms(unsigned long ms) {
+    host_skipped_us += ms * 1000;
+}
+
+inline void host_skip_us(unsigned long us) {
+    host_skipped_us += us;
+}
+
+inline unsigned long millis() {
+    return micros() / 1000;
+}
+
+inline void delayMicroseconds(unsigned int us) {
+    unsigned long until = micros() + us;
+    while (micros() < until);
+}
+
+inline void delay(unsigned long ms) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+// Nothing interrupts a host program
+inline void noInterrupts() {}
+inline void interrupts() {}
+
+inline long map(long x, long in_min, long in_max, long out_min, long out_max) {
+    return (x - in_min) * (out_max - out_min) / (in_max - in_min) + out_min;
+}
+
+// The parts of String the reference FileList uses
+class String {
+public:
+    std::string s;
+
+    String(const char* v) : s(v) {}
+
+    int lastIndexOf(const char* v) const {
+        size_t i = this->s.rfind(v);
+        return i == std::string::npos ? -1 : (int) i;
+    }
+    void remove(unsigned int index, unsigned int count) { this->s.erase(index, count); }
+    void toUpperCase() { for (char& c : this->s) c = toupper(c); }
+    bool endsWith(const String& v) const {
+        return this->s.size() >= v.s.size() && this->s.compare(this->s.size() - v.s.size(), v.s.size(), v.s) == 0;
+    }
+    char operator[](unsigned int index) const { return index < this->s.size() ? this->s[index] : 0; }
+    const char* c_str() const { return this->s.c_str(); }
+};
+
+// Serial output is dropped unless the host program points it somewhere
+class HostSerial {
+public:
+    FILE* out = NULL;
+
+    void print(const char* v) { if (this->out) fputs(v, this->out); }
+    void print(const String& v) { this->print(v.c_str()); }
+    void print(char v) { if (this->out) fputc(v, this->out); }
+    void print(int v, int base = DEC) { this->print((long) v, base); }
+    void print(unsigned int v, int base = DEC) { this->print((unsigned long) v, base); }
+    void print(long v, int base = DEC) { if (this->out) fprintf(this->out, base == HEX ? "%lx" : "%ld", v); }
+    void print(unsigned long v, int base = DEC) { if (this->out) fprintf(this->out, base == HEX ? "%lx" : "%lu", v); }
+    void print(double v, int digits = 2) { if (this->out) fprintf(this->out, "%.*f", digits, v); }
+
+    void println() { this->print('\n'); }
+    template <typename T> void println(T v) { this->print(v); this->println(); }
+    template <typename T> void println(T v, int arg) { this->print(v, arg); this->println(); }
+
+    int available() { return 0; }
+    int read() { return -1; }
+};
+
+inline HostSerial Serial;
+
+#endif
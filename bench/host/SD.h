@@ -0,0 +1,208 @@
+#ifndef _HOST_SD_H_
+#define _HOST_SD_H_
+
+// Just enough of the Arduino SD library for FileList and the prefs to run on a desktop, over a
+// card held in memory. Counts what a real card would have to do, so benchmarks can compare ways
+// of using it.
+
+#include <Arduino.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#define FILE_READ 0
+// as on the badge, writes always go on the end of the file
+#define FILE_WRITE 1
+
+struct HostSDStats {
+    uint32_t opens = 0, dir_entries = 0, reads = 0, writes = 0, seeks = 0, removes = 0;
+    uint64_t bytes_read = 0, bytes_written = 0;
+};
+
+struct HostSDEntry {
+    std::string path;
+    std::vector<uint8_t> data;
+    bool removed = false;
+};
+
+class HostSDCard {
+public:
+    // in the order they were created, as FAT keeps them
+    std::vector<std::shared_ptr<HostSDEntry>> entries;
+    HostSDStats stats;
+
+    // Opening by name reads through the directory to it, as FAT does
+    std::shared_ptr<HostSDEntry> find(const std::string& path, bool count = false) {
+        for (auto& e : this->entries) {
+            if (count)
+                this->stats.dir_entries++;
+            if (!e->removed && e->path == path)
+                return e;
+        }
+        return NULL;
+    }
+
+    std::shared_ptr<HostSDEntry> add(const std::string& path, const std::vector<uint8_t>& data = {}) {
+        auto e = std::make_shared<HostSDEntry>();
+        e->path = path;
+        e->data = data;
+        this->entries.push_back(e);
+        return e;
+    }
+};
+
+inline HostSDCard host_sd;
+
+class File {
+private:
+    std::shared_ptr<HostSDEntry> entry;
+    std::string dir_path, file_name;
+    bool is_dir = false;
+    size_t pos = 0, next_entry = 0;
+
+public:
+    File() {}
+
+    static File open_entry(std::shared_ptr<HostSDEntry> entry) {
+        File f;
+        f.entry = entry;
+        size_t slash = entry->path.find_last_of('/');
+        f.file_name = entry->path.substr(slash + 1);
+        return f;
+    }
+
+    static File open_dir(const std::string& path) {
+        File f;
+        f.is_dir = true;
+        f.dir_path = path;
+        if (f.dir_path.empty() || f.dir_path.back() != '/')
+            f.dir_path += '/';
+        return f;
+    }
+
+    operator bool() {
+        return this->is_dir || (this->entry && !this->entry->removed);
+    }
+
+    const char* name() {
+        return this->file_name.c_str();
+    }
+
+    bool isDirectory() {
+        return this->is_dir;
+    }
+
+    File openNextFile() {
+        auto& entries = host_sd.entries;
+        while (this->next_entry < entries.size()) {
+            auto e = entries[this->next_entry++];
+            host_sd.stats.dir_entries++;
+            if (e->removed || e->path.compare(0, this->dir_path.size(), this->dir_path) != 0)
+                continue;
+            if (e->path.find('/', this->dir_path.size()) != std::string::npos)
+                continue;
+            return open_entry(e);
+        }
+        return File();
+    }
+
+    void rewindDirectory() {
+        this->next_entry = 0;
+    }
+
+    int read(void* buf, size_t len) {
+        if (!this->entry)
+            return -1;
+        size_t n = min(len, this->entry->data.size() - min(this->pos, this->entry->data.size()));
+        memcpy(buf, this->entry->data.data() + this->pos, n);
+        this->pos += n;
+        host_sd.stats.reads++;
+        host_sd.stats.bytes_read += n;
+        return n;
+    }
+
+    int read() {
+        uint8_t b;
+        return this->read(&b, 1) == 1 ? b : -1;
+    }
+
+    size_t write(const uint8_t* buf, size_t len) {
+        if (!this->entry)
+            return 0;
+        this->entry->data.insert(this->entry->data.end(), buf, buf + len);
+        host_sd.stats.writes++;
+        host_sd.stats.bytes_written += len;
+        return len;
+    }
+
+    size_t write(uint8_t b) {
+        return this->write(&b, 1);
+    }
+
+    bool seek(uint32_t pos) {
+        host_sd.stats.seeks++;
+        if (!this->entry || pos > this->entry->data.size())
+            return false;
+        this->pos = pos;
+        return true;
+    }
+
+    uint32_t position() {
+        return this->pos;
+    }
+
+    uint32_t size() {
+        return this->entry ? this->entry->data.size() : 0;
+    }
+
+    int available() {
+        return this->size() - min((uint32_t) this->pos, this->size());
+    }
+
+    void flush() {}
+
+    void close() {
+        this->entry = NULL;
+        this->is_dir = false;
+    }
+};
+
+class SDClass {
+public:
+    bool begin(uint8_t cs) {
+        return true;
+    }
+
+    File open(const char* path, uint8_t mode = FILE_READ) {
+        host_sd.stats.opens++;
+        std::string p(path);
+        if (p == "/" || (!p.empty() && p.back() == '/'))
+            return File::open_dir(p);
+        auto e = host_sd.find(p, true);
+        if (!e) {
+            if (mode != FILE_WRITE)
+                return File();
+            e = host_sd.add(p);
+        }
+        return File::open_entry(e);
+    }
+
+    bool exists(const char* path) {
+        return host_sd.find(path) != NULL;
+    }
+
+    bool remove(const char* path) {
+        auto e = host_sd.find(path);
+        if (!e)
+            return false;
+        host_sd.stats.removes++;
+        // a new file with the same name goes on the end, as on a FAT card
+        e->removed = true;
+        return true;
+    }
+};
+
+inline SDClass SD;
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef _HOST_TOUCHSCREEN_H_
+#define _HOST_TOUCHSCREEN_H_
+
+// A touchscreen that reads back whatever the host program last put on it
+
+#include <Arduino.h>
+
+class TSPoint {
+public:
+    int16_t x = 0, y = 0, z = 0;
+};
+
+class TouchScreen {
+public:
+    uint16_t pressureThreshhold = 10;
+    TSPoint point;
+    uint32_t reads = 0;
+
+    TouchScreen(uint8_t xp, uint8_t yp, uint8_t xm, uint8_t ym, uint16_t rx) {}
+
+    TSPoint getPoint() {
+        this->reads++;
+        return this->point;
+    }
+};
+
+#endif
@@ -0,0 +1,165 @@
+// Preferences saving benchmark, the whole struct written on every change against the journal
+//
+//   prefs_bench [-n switches] [-d seconds]
+//
+// Moves on to another file switches times (default 100), seconds apart (default 10) with the
+// player's idle loop running in between, and counts what that wrote to a simulated card (see
+// host/SD.h). Then checks the journal holds up: what's read back is what was saved, a record
+// cut off part way through is passed over for the one before, compacting keeps the latest,
+// and the old preferences.bin is carried over.
+
+#include <Arduino.h>
+#include <SD.h>
+
+#include "prefs.h"
+#include "LegacyPrefs_impl.h"
+
+// How often the player's idle loop gets round to prefs_idle()
+#define IDLE_MS 50
+
+
+struct WriteCost {
+    uint32_t writes = 0, opens = 0, removes = 0;
+    uint64_t bytes = 0;
+};
+
+WriteCost cost_since(const HostSDStats& before) {
+    WriteCost out;
+    out.writes = host_sd.stats.writes - before.writes;
+    out.opens = host_sd.stats.opens - before.opens;
+    out.removes = host_sd.stats.removes - before.removes;
+    out.bytes = host_sd.stats.bytes_written - before.bytes_written;
+    return out;
+}
+
+void print_cost(const char* name, const WriteCost& cost, int switches) {
+    printf("%-24s %8u %8u %8u %10llu %10.2f\n", name, cost.writes, cost.opens, cost.removes,
+        (unsigned long long) cost.bytes, 100.0 * cost.writes / switches);
+}
+
+void switch_to(Prefs* prefs, int i) {
+    char name[32];
+    snprintf(name, sizeof(name), "/animation_%04d.qox", i);
+    set_pref_last_filename(prefs, name);
+}
+
+bool same(Prefs* a, Prefs* b) {
+    return memcmp(a, b, sizeof(Prefs)) == 0;
+}
+
+bool check(const char* what, bool ok) {
+    if (!ok)
+        printf("FAILED: %s\n", what);
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    int switches = 100, seconds = 10;
+    Prefs prefs, back;
+    bool ok = true;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            switches = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+            seconds = atoi(argv[++i]);
+    }
+
+    printf("%d switches, %d s apart\n", switches, seconds);
+    printf("%-24s %8s %8s %8s %10s %10s\n", "", "writes", "opens", "removes", "bytes", "writes/100");
+
+    host_sd = HostSDCard();
+    read_prefs(&prefs);
+    HostSDStats start = host_sd.stats;
+    for (int i = 0; i < switches; i++) {
+        switch_to(&prefs, i);
+        legacy_write_prefs(&prefs);
+        host_skip_ms(seconds * 1000);
+    }
+    print_cost("before", cost_since(start), switches);
+
+    host_sd = HostSDCard();
+    read_prefs(&prefs);
+    start = host_sd.stats;
+    for (int i = 0; i < switches; i++) {
+        switch_to(&prefs, i);
+        write_prefs(&prefs);
+        for (int t = 0; t < seconds * 1000; t += IDLE_MS) {
+            host_skip_ms(IDLE_MS);
+            prefs_idle(&prefs);
+        }
+    }
+    print_cost("after", cost_since(start), switches);
+
+    // Settings aren't held back as long as the filename
+    flush_prefs(&prefs);
+    prefs.display_time_s = 20;
+    write_prefs(&prefs);
+    unsigned long changed = millis();
+    uint32_t writes = host_sd.stats.writes;
+    while (host_sd.stats.writes == writes && millis() - changed < PREFS_FILENAME_DELAY_MS) {
+        host_skip_ms(IDLE_MS);
+        prefs_idle(&prefs);
+    }
+    printf("%-24s %8lu ms\n", "setting saved after", millis() - changed);
+    ok &= check("setting saved soon", millis() - changed <= PREFS_SETTINGS_DELAY_MS + IDLE_MS);
+
+    // Whatever was last saved is what's read back
+    switch_to(&prefs, 9999);
+    flush_prefs(&prefs);
+    read_prefs(&back);
+    ok &= check("read back", same(&prefs, &back));
+
+    // A record cut short is passed over for the one before, and nothing's lost after it
+    Prefs before_torn = prefs;
+    prefs.brightness = 10;
+    flush_prefs(&prefs);
+    for (const char* name : {PREFS_JOURNAL_A, PREFS_JOURNAL_B}) {
+        auto journal = host_sd.find(name);
+        if (journal && journal->data.size() >= sizeof(PrefsRecordHeader) + sizeof(Prefs))
+            journal->data.resize(journal->data.size() - 10);
+    }
+    read_prefs(&back);
+    ok &= check("torn record skipped", same(&before_torn, &back));
+    prefs = back;
+    prefs.brightness = 20;
+    flush_prefs(&prefs);
+    read_prefs(&back);
+    ok &= check("saved after torn record", same(&prefs, &back));
+
+    // Compacting keeps the journals small, and the latest record
+    for (int i = 0; i < 200; i++) {
+        prefs.display_time_s = i + 1;
+        flush_prefs(&prefs);
+    }
+    uint32_t journal_bytes = 0;
+    for (const char* name : {PREFS_JOURNAL_A, PREFS_JOURNAL_B}) {
+        auto journal = host_sd.find(name);
+        if (journal)
+            journal_bytes += journal->data.size();
+    }
+    read_prefs(&back);
+    ok &= check("compacted", journal_bytes <= PREFS_JOURNAL_MAX && same(&prefs, &back));
+
+    // The old file is carried over - the last of the copies that were added to it - and then
+    // removed. Version 2 didn't have flags or the auto brightness range.
+    host_sd = HostSDCard();
+    std::vector<uint8_t> legacy;
+    for (uint16_t display_time : {42, 43}) {
+        Prefs old = {};
+        old.version = 2;
+        old.display_time_s = display_time;
+        strcpy(old.last_filename, "/old.qox");
+        old.brightness = 77;
+        legacy.insert(legacy.end(), (uint8_t*) &old, (uint8_t*) &old + 133);
+    }
+    host_sd.add(PREFS_FILENAME, legacy);
+    read_prefs(&back);
+    ok &= check("migrated", back.version == PREFS_VERSION && back.display_time_s == 43 && back.brightness == 77
+        && strcmp(back.last_filename, "/old.qox") == 0 && back.bri_auto_min == 25 && back.bri_auto_max == 255);
+    ok &= check("old file removed", !SD.exists(PREFS_FILENAME));
+    read_prefs(&prefs);
+    ok &= check("migrated read back", same(&prefs, &back));
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,840 @@
+// Decode throughput benchmark for QOIF2, run over a corpus of .qox files made by convert/convert.py
+//
+//   qoif2_bench [-t seconds] [-c] [-r] [-d] [-w pixels] [-s] [-l] [-m bytes] [-n] [-k] [-b us] [-p slowdown] [-e bytes] [-z] <file.qox|directory>...
+//
+//   -t  minimum decode time per file, in seconds (default 1)
+//   -c  also draw into a framebuffer and print a hash of every frame shown, to check decoders agree
+//       - and first check a hand-built 24 bit file whose frames start with runs (see check_rgb_runs)
+//   -r  also run the reference (pre-optimization) decoder on each file and print the speedup
+//   -d  draw through a simulated DMA display (see DmaSimSink) and report frames/s and how much
+//       of the bus time the decoder managed to overlap with decoding
+//   -w  shortest run sent with writeColor - by default it's calibrated against the simulated
+//       display with -d, and QOIF2_RUN_THRESHOLD otherwise
+//   -s  read through a simulated SD card (see SlowSource) and report how often, and for how
+//       long, decoding had to wait on it. Between blocks the decoder gets to read ahead the way
+//       the player lets it: one slice after each block, and as much as it wants in a delay.
+//   -l  play each file over and over with the same decoder, as the player does, instead of
+//       reopening it for every pass. "first us" is the time to the first frame of each pass
+//       (including reopening and the trailer); with -c every pass has to match the first.
+//   -m  give the decoder a frame cache of this many bytes, and report the share of blocks sent
+//       from it and how much of it was used. Only helps with -l.
+//   -n  also play the files one after another, as the player moves on to the next, and report
+//       the time from the end of one to the first block of the next being sent - reopening
+//       each file then, and with the next one opened and buffered while the last one plays
+//   -k  for files with an index, also seek to every frame in a shuffled order and check each
+//       one is drawn the same as when played through, and report how long seeking took
+//   -b  give the decoder a budget of this many us per call (see QOIF2::budget_us), and report
+//       how long calls took - the longest the player would go without looking at the touchscreen.
+//       0 reports the same without a budget.
+//   -p  also play each file three times through against the clock, as the player does, on a
+//       badge this many times slower than the host - decoding time is stretched to match, and
+//       delays are skipped over. Reports the file's frame rate against what was shown, frames
+//       that were late and that were dropped to catch up, for the reference decoder (which
+//       times each frame on its own) and this one. Every frame shown has to match that frame
+//       played straight through. Also reports what was read from the card, and how much that
+//       comes to a minute - overall, which for a short run is mostly the first read, and after
+//       the first loop - for files small enough to be read into memory whole (see -e), both
+//       that way and streamed.
+//   -e  largest file read into memory whole rather than streamed (see QOIF2::resident_max),
+//       default QOIF2_RESIDENT_BYTES - 0 to stream everything
+//   -z  print where the time went inside the decoder, by profiler zone (see Profiler_impl.h) -
+//       only qoif2_bench_profiled, built with PROFILER 1, has any
+//
+// A mix of pixel formats (565, palette and 24 bit) also gets a total for each, as each one is
+// decoded by its own instantiation of the decoder.
+
+#include <Arduino.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "bench_impl.h"
+#include "QOIF2_impl.h"
+#include "LegacyQOIF2_impl.h"
+
+
+struct BenchResult {
+    bool ok = true;
+    int passes = 0;
+    uint64_t frames = 0, blocks = 0, pixels = 0, bytes = 0, decode_ns = 0, hash = 14695981039346656037ULL;
+    uint64_t transfers = 0, wait_ns = 0, dma_ns = 0, early_reuse = 0;
+    uint64_t runs_inlined = 0, runs_filled = 0, stalls = 0, stall_us = 0, loop_differs = 0;
+    uint64_t cache_hits = 0, cache_misses = 0, cache_bytes = 0;
+    // first_us is the first frame of each pass, including reopening the file if it was
+    std::vector<uint32_t> frame_us, first_us, call_us;
+};
+
+uint16_t run_threshold = QOIF2_RUN_THRESHOLD;
+FrameCache* frame_cache = NULL;
+uint32_t budget_us = 0, resident_max = QOIF2_RESIDENT_BYTES;
+bool budgeted = false;
+
+// The reference decoder has no run policy or stats
+void setup_decoder(QOIF2* img) {
+    img->run_threshold = run_threshold;
+    img->budget_us = budget_us;
+    img->resident_max = resident_max;
+    if (frame_cache)
+        img->set_frame_cache(frame_cache);
+}
+void setup_decoder(LegacyQOIF2* img) {}
+
+void count_block(BenchResult* out, QOIF2* img) {
+    out->runs_inlined += img->stats.runs_inlined;
+    out->runs_filled += img->stats.runs_filled;
+}
+void count_block(BenchResult* out, LegacyQOIF2* img) {}
+
+void count_file(BenchResult* out, QOIF2* img) {
+    out->stalls += img->get_stalls();
+    out->stall_us += img->get_stall_us();
+    if (frame_cache) {
+        out->cache_hits += frame_cache->hits;
+        out->cache_misses += frame_cache->misses;
+        out->cache_bytes = max(out->cache_bytes, (uint64_t) frame_cache->used);
+    }
+}
+void count_file(BenchResult* out, LegacyQOIF2* img) {}
+
+// The reference decoder only reads from the card when it runs dry, or fills up after a frame
+int idle(QOIF2* img) {
+    return img->idle();
+}
+int idle(LegacyQOIF2* img) {
+    return 0;
+}
+
+template <class Decoder>
+BenchResult bench_file(const std::vector<uint8_t>& data, double min_seconds, bool check, bool dma, bool slow, bool loop) {
+    BenchResult out;
+    DmaSimSink dma_sink(check);
+    HostSink plain_sink(check);
+    HostSink& sink = dma ? dma_sink : plain_sink;
+    MemorySource mem(&data);
+    SlowSource card(&mem);
+    ByteSource* src = slow ? (ByteSource*) &card : &mem;
+    std::unique_ptr<Decoder> img;
+
+    // Reopening the file, and reading the trailer, count towards the time to show the first frame
+    uint64_t frame_ns = 0, gap_ns = 0, pass_hash = 14695981039346656037ULL;
+    int pass_frames = 0;
+    // reading the card isn't all counted as decoding, so it's the wall clock that says when to stop
+    uint64_t wall_start = bench_now_ns();
+    while (true) {
+        if (!img) {
+            uint64_t start = bench_now_ns();
+            src->seek(0);
+            img.reset(new Decoder(&sink, src));
+            setup_decoder(img.get());
+            if (img->open() != 0) {
+                out.ok = false;
+                return out;
+            }
+            gap_ns += bench_now_ns() - start;
+        }
+
+        uint64_t start = bench_now_ns();
+        int res = img->read_and_render_block();
+        uint64_t took = bench_now_ns() - start;
+        if (budgeted)
+            out.call_us.push_back(took / 1000);
+
+        if (res == QOIF2_B_PARTIAL) {
+            out.decode_ns += took;
+            frame_ns += took;
+            if (slow)
+                idle(img.get());
+            continue;
+        }
+
+        if (res == QOIF2_B_END || res == QOIF2_B_ONE_FRAME) {
+            gap_ns += took;
+            if (check && out.passes > 0 && pass_hash != out.hash)
+                out.loop_differs++;
+            pass_hash = 14695981039346656037ULL;
+            pass_frames = 0;
+            out.bytes += data.size();
+            out.passes++;
+            bool again = (slow ? bench_now_ns() - wall_start : out.decode_ns) < min_seconds * 1e9;
+            if (!loop || res == QOIF2_B_ONE_FRAME || !again) {
+                count_file(&out, img.get());
+                img.reset();
+            }
+            if (!again)
+                break;
+            continue;
+        }
+        if (res != QOIF2_B_DELAY && res != QOIF2_B_CONTINUE) {
+            out.ok = false;
+            return out;
+        }
+
+        out.blocks++;
+        count_block(&out, img.get());
+        if (slow) {
+            if (res == QOIF2_B_DELAY)
+                while (idle(img.get()));
+            else
+                idle(img.get());
+        }
+        out.decode_ns += took;
+        frame_ns += took;
+        if (img->get_block_flags() & QOIF2_F_END) {
+            out.frames++;
+            out.frame_us.push_back(frame_ns / 1000);
+            if (pass_frames++ == 0) {
+                out.first_us.push_back((gap_ns + frame_ns) / 1000);
+                gap_ns = 0;
+            }
+            frame_ns = 0;
+            if (check) {
+                sink.sync();
+                if (out.passes == 0)
+                    out.hash = sink.hash(out.hash);
+                else
+                    pass_hash = sink.hash(pass_hash);
+            }
+        }
+    }
+
+    out.pixels = sink.pixels;
+    out.transfers = sink.transfers;
+    out.wait_ns = sink.wait_ns;
+    out.dma_ns = sink.dma_ns;
+    out.early_reuse = dma_sink.early_reuse;
+    return out;
+}
+
+struct SeekResult {
+    bool ok = true;
+    uint32_t seeks = 0, differs = 0;
+    uint64_t blocks = 0;
+    std::vector<uint32_t> seek_us;
+};
+
+// Seeks to every frame in turn, in a shuffled order so it isn't always going forward, and
+// compares the frame drawn after each with what playing the file through drew
+SeekResult bench_seek(const std::vector<uint8_t>& data) {
+    SeekResult out;
+    HostSink sink(true);
+    MemorySource src(&data);
+    QOIF2 img(&sink, &src);
+    setup_decoder(&img);
+    if (img.open() != 0 || img.get_index_count() == 0) {
+        out.ok = false;
+        return out;
+    }
+
+    std::vector<uint64_t> expect;
+    while (true) {
+        int res = img.read_and_render_block();
+        if (res == QOIF2_B_PARTIAL)
+            continue;
+        if (res != QOIF2_B_DELAY && res != QOIF2_B_CONTINUE)
+            break;
+        if (img.get_block_flags() & QOIF2_F_END)
+            expect.push_back(sink.hash());
+    }
+    if (expect.size() != img.get_index_count()) {
+        out.ok = false;
+        return out;
+    }
+
+    std::vector<uint32_t> order(expect.size());
+    for (uint32_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    srand(1);
+    for (uint32_t i = order.size() - 1; i > 0; i--)
+        std::swap(order[i], order[rand() % (i + 1)]);
+
+    for (uint32_t frame : order) {
+        uint64_t blocks = sink.windows, start = bench_now_ns();
+        int res = img.seek_frame(frame);
+        if (res == 0) {
+            do {
+                res = img.read_and_render_block();
+            } while (res == QOIF2_B_PARTIAL || (res == QOIF2_B_CONTINUE && !(img.get_block_flags() & QOIF2_F_END)));
+        }
+        out.seek_us.push_back((bench_now_ns() - start) / 1000);
+        out.blocks += sink.windows - blocks;
+        out.seeks++;
+        if ((res != QOIF2_B_DELAY && res != QOIF2_B_CONTINUE) || sink.hash() != expect[frame])
+            out.differs++;
+    }
+    return out;
+}
+
+void print_seek(const std::string& name, SeekResult& r) {
+    if (!r.ok) {
+        printf("%-24s can't seek\n", name.c_str());
+        return;
+    }
+    printf("%-24s %6u seeks, %5.1f blocks/seek, p50 %u us, p99 %u us, max %u us",
+        name.c_str(), r.seeks, (double) r.blocks / max(r.seeks, (uint32_t) 1),
+        bench_percentile(r.seek_us, 50), bench_percentile(r.seek_us, 99), bench_percentile(r.seek_us, 100));
+    if (r.differs)
+        printf("  SEEK OUTPUT DIFFERS %u TIMES", r.differs);
+    printf("\n");
+}
+
+// Notes when the first pixels after mark() go out
+class FirstPixelSink : public HostSink {
+public:
+    uint64_t first_ns = 0;
+    bool marked = false;
+
+    void mark() {
+        this->marked = true;
+        this->first_ns = 0;
+    }
+
+    void writePixels(uint16_t* colors, uint32_t len) {
+        this->sent();
+        HostSink::writePixels(colors, len);
+    }
+
+    void writeColor(uint16_t color, uint32_t len) {
+        this->sent();
+        HostSink::writeColor(color, len);
+    }
+
+private:
+    void sent() {
+        if (this->marked) {
+            this->first_ns = bench_now_ns();
+            this->marked = false;
+        }
+    }
+};
+
+// A file being played through its own sources, so two can be open at once
+struct SwitchSlot {
+    std::unique_ptr<MemorySource> mem;
+    std::unique_ptr<SlowSource> card;
+    std::unique_ptr<QOIF2> img;
+
+    int open(const std::vector<uint8_t>* data, HostSink* sink, bool slow, bool fill) {
+        this->mem.reset(new MemorySource(data));
+        this->card.reset(new SlowSource(this->mem.get()));
+        this->img.reset(new QOIF2(sink, slow ? (ByteSource*) this->card.get() : this->mem.get()));
+        this->img->run_threshold = run_threshold;
+        this->img->budget_us = budget_us;
+        this->img->resident_max = resident_max;
+        return this->img->open(fill);
+    }
+};
+
+// Plays each file through once and moves on to the next, rounds times over. With prefetch the
+// next file's opened without filling its buffer as soon as the last one starts, and is read
+// ahead a slice at a time whenever the one playing has a full buffer, as the player does. Times
+// from the end of each file to the first pixels of the next going out.
+bool bench_switch(const std::vector<std::vector<uint8_t>>& files, bool slow, bool prefetch, int rounds, std::vector<uint32_t>* switch_us) {
+    FirstPixelSink sink;
+    SwitchSlot cur, next;
+    size_t cur_file = 0;
+    uint64_t switch_start = 0;
+
+    if (cur.open(&files[0], &sink, slow, true) != 0)
+        return false;
+    if (frame_cache)
+        cur.img->set_frame_cache(frame_cache);
+    for (size_t switches = 0; switches < rounds * files.size(); ) {
+        int res = cur.img->read_and_render_block();
+        if (switch_start && sink.first_ns) {
+            switch_us->push_back((sink.first_ns - switch_start) / 1000);
+            switch_start = 0;
+        }
+        if (res == QOIF2_B_END || res == QOIF2_B_ONE_FRAME) {
+            switch_start = bench_now_ns();
+            sink.mark();
+            cur_file = (cur_file + 1) % files.size();
+            if (next.img) {
+                std::swap(cur, next);
+                next = SwitchSlot();
+            } else if (cur.open(&files[cur_file], &sink, slow, true) != 0) {
+                return false;
+            }
+            if (frame_cache)
+                cur.img->set_frame_cache(frame_cache);
+            switches++;
+            continue;
+        }
+        if (res != QOIF2_B_DELAY && res != QOIF2_B_CONTINUE && res != QOIF2_B_PARTIAL)
+            return false;
+
+        if (prefetch && !next.img && next.open(&files[(cur_file + 1) % files.size()], &sink, slow, false) != 0)
+            return false;
+        if (res == QOIF2_B_DELAY) {
+            while (cur.img->idle());
+            while (next.img && next.img->idle());
+        } else if (!cur.img->idle() && next.img) {
+            next.img->idle();
+        }
+    }
+    return true;
+}
+
+void print_switch(const char* name, bool ok, std::vector<uint32_t>& switch_us) {
+    if (!ok) {
+        printf("%-24s failed to decode\n", name);
+        return;
+    }
+    printf("%-24s %6zu switches to the first pixel, p50 %u us, p90 %u us, max %u us\n", name, switch_us.size(),
+        bench_percentile(switch_us, 50), bench_percentile(switch_us, 90), bench_percentile(switch_us, 100));
+}
+
+void put_le(std::vector<uint8_t>* out, uint32_t v, int bytes) {
+    for (int i = 0; i < bytes; i++)
+        out->push_back(v >> (8 * i));
+}
+
+// A whole screen block of a 24 bit file that starts with a run op - which carries on the previous
+// pixel, opaque black after a reset - then `alternate` pixels going between two colors, and the
+// rest in color. The encoder never starts a block with a run, so the corpus can't cover this.
+void rgb_block(std::vector<uint8_t>* out, uint8_t flags, uint32_t lead, uint32_t alternate, uint32_t color) {
+    std::vector<uint8_t> data;
+    data.push_back(0xc0 | (lead - 1));
+    for (uint32_t i = 0; i < alternate; i++) {
+        uint32_t c = i & 1 ? 0xff0000 : 0x0000ff;
+        data.insert(data.end(), {0xfe, (uint8_t) c, (uint8_t) (c >> 8), (uint8_t) (c >> 16)});
+    }
+    data.insert(data.end(), {0xfe, (uint8_t) color, (uint8_t) (color >> 8), (uint8_t) (color >> 16)});
+    for (uint32_t left = SCREEN_PX - lead - alternate - 1; left; ) {
+        uint32_t n = min(left, (uint32_t) 62);
+        data.push_back(0xc0 | (n - 1));
+        left -= n;
+    }
+    out->push_back(flags | QOIF2_F_START | QOIF2_F_END);
+    put_le(out, 10, 2);
+    put_le(out, data.size(), 4);
+    for (uint32_t v : {SCREEN_WIDTH, SCREEN_HEIGHT, 0, 0})
+        put_le(out, v, 2);
+    out->insert(out->end(), data.begin(), data.end());
+}
+
+// Plays a 24 bit file whose every frame starts with a run, and checks each run is the color the
+// decoder's state says it is: black after the keyframes (and the loop starting again), and the
+// last frame's color where the frame cache hands back to the file part way through the loop
+bool check_rgb_runs() {
+    std::vector<uint8_t> data;
+    put_le(&data, QOIF2_MAGIC, 4);
+    put_le(&data, SCREEN_WIDTH, 4);
+    put_le(&data, SCREEN_HEIGHT, 4);
+    data.insert(data.end(), {3, 0, QOIF2_VERSION});
+    std::vector<uint32_t> offsets;
+    offsets.push_back(data.size());
+    rgb_block(&data, QOIF2_F_KEY, 40, 0, 0xffffff);
+    offsets.push_back(data.size());
+    rgb_block(&data, QOIF2_F_KEY, 40, 0, 0x00ff00);
+    // too big for the cache, so the loop streams from here
+    offsets.push_back(data.size());
+    rgb_block(&data, 0, 40, 2000, 0xff0000);
+    data.insert(data.end(), {0, 0, 0, 0, 0, 0, 0, 1});
+    uint32_t index_offset = data.size();
+    for (uint32_t i = 0; i < offsets.size(); i++) {
+        put_le(&data, i, 4);
+        put_le(&data, offsets[i], 4);
+        put_le(&data, i * 10, 4);
+        data.push_back((i < 2 ? QOIF2_F_KEY : 0) | QOIF2_F_START | QOIF2_F_END);
+    }
+    put_le(&data, offsets.size(), 4);
+    put_le(&data, index_offset, 4);
+    put_le(&data, QOIF2_INDEX_MAGIC, 4);
+
+    const uint16_t expect[3] = {0x0000, 0x0000, 0x07e0};
+    HostSink sink(true);
+    MemorySource src(&data);
+    FrameCache cache(4096);
+    QOIF2 img(&sink, &src);
+    img.set_frame_cache(&cache);
+    if (img.open() != 0)
+        return false;
+    uint32_t frame = 0, resumed = 0;
+    for (int pass = 0; pass < 2; ) {
+        int res = img.read_and_render_block();
+        if (res == QOIF2_B_PARTIAL)
+            continue;
+        if (res == QOIF2_B_END) {
+            pass++;
+            frame = 0;
+            continue;
+        }
+        if (res != QOIF2_B_DELAY && res != QOIF2_B_CONTINUE)
+            return false;
+        if (!(img.get_block_flags() & QOIF2_F_END))
+            continue;
+        if (sink.fb[0] != expect[frame] || sink.fb[39] != expect[frame])
+            return false;
+        if (pass && frame == 2)
+            resumed++;
+        frame++;
+    }
+    // the second loop has to have had the first two frames from the cache, and the last from the file
+    return resumed == 1 && cache.complete && !cache.whole_loop && cache.blocks == 2;
+}
+
+struct TimelineResult {
+    bool ok = true;
+    uint32_t shown = 0, late = 0, dropped = 0, wrong = 0;
+    uint64_t elapsed_us = 0;
+    double authored_fps = 0;
+    // from the card, for decoders that count it
+    bool counted = false, resident = false;
+    uint32_t read_bytes = 0, read_per_min = 0;
+    // after the first loop, when a resident file's all been read
+    uint32_t steady_per_min = 0;
+};
+
+// Which frame was just shown. The reference decoder doesn't say, and never skips any.
+bool shown_frame(QOIF2* img, uint32_t* frame) {
+    *frame = img->get_frame_num() - 1;
+    return true;
+}
+bool shown_frame(LegacyQOIF2* img, uint32_t* frame) {
+    return false;
+}
+uint32_t frames_dropped(QOIF2* img) {
+    return img->play.dropped;
+}
+uint32_t frames_dropped(LegacyQOIF2* img) {
+    return 0;
+}
+void count_reads(TimelineResult* out, QOIF2* img) {
+    out->counted = true;
+    out->resident = img->is_resident();
+    out->read_bytes = img->get_read_bytes();
+    out->read_per_min = img->get_read_bytes_per_min();
+}
+void count_reads(TimelineResult* out, LegacyQOIF2* img) {}
+uint32_t read_bytes(QOIF2* img) {
+    return img->get_read_bytes();
+}
+uint32_t read_bytes(LegacyQOIF2* img) {
+    return 0;
+}
+
+template <class Decoder>
+TimelineResult bench_timeline(const std::vector<uint8_t>& data, double slowdown) {
+    TimelineResult out;
+    HostSink sink(true);
+    MemorySource src(&data);
+    std::vector<uint64_t> expect;
+    uint32_t loop_ms = 0;
+
+    {
+        QOIF2 img(&sink, &src);
+        if (img.open() != 0) {
+            out.ok = false;
+            return out;
+        }
+        while (true) {
+            int res = img.read_and_render_block();
+            if (res != QOIF2_B_DELAY && res != QOIF2_B_CONTINUE)
+                break;
+            if (img.get_block_flags() & QOIF2_F_END) {
+                expect.push_back(sink.hash());
+                loop_ms += img.get_block_duration();
+            }
+        }
+    }
+    if (expect.empty() || !loop_ms) {
+        out.ok = false;
+        return out;
+    }
+    out.authored_fps = expect.size() * 1000.0 / loop_ms;
+
+    src.seek(0);
+    Decoder img(&sink, &src);
+    setup_decoder(&img);
+    if (img.open() != 0) {
+        out.ok = false;
+        return out;
+    }
+    uint32_t passes = 0, frame, steady_bytes = 0;
+    unsigned long start = micros(), steady_start = 0;
+    while (passes < 3) {
+        uint64_t took = bench_now_ns();
+        int res = img.read_and_render_block();
+        took = bench_now_ns() - took;
+        host_skip_us(took * (slowdown - 1) / 1000);
+
+        if (res == QOIF2_B_END || res == QOIF2_B_ONE_FRAME) {
+            if (++passes == 1) {
+                steady_bytes = read_bytes(&img);
+                steady_start = micros();
+            }
+            continue;
+        }
+        if (res == QOIF2_B_PARTIAL)
+            continue;
+        if (res != QOIF2_B_DELAY && res != QOIF2_B_CONTINUE) {
+            out.ok = false;
+            return out;
+        }
+        if (img.get_block_flags() & QOIF2_F_END) {
+            // checking isn't part of playing, so the clock's held still for it
+            uint64_t check_start = bench_now_ns();
+            if (shown_frame(&img, &frame) && (frame >= expect.size() || sink.hash() != expect[frame]))
+                out.wrong++;
+            out.shown++;
+            host_skipped_us -= (bench_now_ns() - check_start) / 1000;
+        }
+        if (res == QOIF2_B_DELAY) {
+            if (img.delay_ms > 0)
+                host_skip_ms(img.delay_ms);
+            else
+                out.late++;
+        }
+    }
+    out.elapsed_us = micros() - start;
+    out.dropped = frames_dropped(&img);
+    count_reads(&out, &img);
+    if (micros() > steady_start)
+        out.steady_per_min = (uint64_t) (read_bytes(&img) - steady_bytes) * 60000000 / (micros() - steady_start);
+    return out;
+}
+
+void print_timeline(const char* name, const TimelineResult& r) {
+    if (!r.ok) {
+        printf("%-24s can't play it\n", name);
+        return;
+    }
+    printf("%-24s %6u shown, %7.1f fps of %5.1f, %6u late, %6u dropped", name, r.shown,
+        r.shown * 1e6 / max(r.elapsed_us, (uint64_t) 1), r.authored_fps, r.late, r.dropped);
+    if (r.counted)
+        printf(", %7.1f KB read, %8.1f KB/min, %8.1f after the first loop%s", r.read_bytes / 1024.0, r.read_per_min / 1024.0,
+            r.steady_per_min / 1024.0, r.resident ? " in RAM" : "");
+    if (r.wrong)
+        printf("  WRONG FRAME SHOWN %u TIMES", r.wrong);
+    printf("\n");
+}
+
+void print_header(bool dma, bool slow, bool loop) {
+    printf("%-24s %6s %6s %9s %8s %9s %8s %8s %8s %8s",
+        "file", "frames", "passes", "Mpx/s", "MB/s", "blocks/s", "p50 us", "p90 us", "p99 us", "max us");
+    if (dma)
+        printf(" %8s %8s %8s %8s %8s", "frames/s", "px/xfer", "overlap", "inl/frm", "fill/frm");
+    if (slow)
+        printf(" %9s %9s", "stalls/f", "stall us/f");
+    if (slow || loop)
+        printf(" %8s", "first us");
+    if (frame_cache)
+        printf(" %7s %9s", "cached", "cache KB");
+    if (budgeted)
+        printf(" %8s %8s", "call p99", "call max");
+    printf("\n");
+}
+
+void add_result(BenchResult* total, const BenchResult& r) {
+    if (!r.ok)
+        return;
+    total->passes += r.passes;
+    total->frames += r.frames;
+    total->blocks += r.blocks;
+    total->pixels += r.pixels;
+    total->bytes += r.bytes;
+    total->decode_ns += r.decode_ns;
+    total->transfers += r.transfers;
+    total->wait_ns += r.wait_ns;
+    total->dma_ns += r.dma_ns;
+    total->runs_inlined += r.runs_inlined;
+    total->runs_filled += r.runs_filled;
+    total->stalls += r.stalls;
+    total->stall_us += r.stall_us;
+    total->loop_differs += r.loop_differs;
+    total->cache_hits += r.cache_hits;
+    total->cache_misses += r.cache_misses;
+    total->cache_bytes += r.cache_bytes;
+    total->frame_us.insert(total->frame_us.end(), r.frame_us.begin(), r.frame_us.end());
+    total->first_us.insert(total->first_us.end(), r.first_us.begin(), r.first_us.end());
+    total->call_us.insert(total->call_us.end(), r.call_us.begin(), r.call_us.end());
+}
+
+void print_speedup(const BenchResult& before, const BenchResult& after, bool check) {
+    if (!before.ok || !after.ok)
+        return;
+    double speedup = ((double) after.frames / after.decode_ns) / ((double) before.frames / before.decode_ns);
+    printf("%-24s %.2fx", "  speedup", speedup);
+    if (check)
+        printf("  %s", before.hash == after.hash ? "output matches" : "OUTPUT DIFFERS");
+    printf("\n");
+}
+
+void print_result(const std::string& name, BenchResult& r, bool check, bool dma, bool slow, bool loop) {
+    if (!r.ok) {
+        printf("%-24s failed to decode\n", name.c_str());
+        return;
+    }
+    double secs = r.decode_ns / 1e9;
+    printf("%-24s %6llu %6d %9.2f %8.2f %9.0f %8u %8u %8u %8u",
+        name.c_str(),
+        (unsigned long long) r.frames,
+        r.passes,
+        r.pixels / secs / 1e6,
+        r.bytes / secs / 1e6,
+        r.blocks / secs,
+        bench_percentile(r.frame_us, 50),
+        bench_percentile(r.frame_us, 90),
+        bench_percentile(r.frame_us, 99),
+        bench_percentile(r.frame_us, 100));
+    if (dma) {
+        // how much of the time the bus was busy the CPU spent doing something other than waiting for it
+        double overlap = r.dma_ns ? 1.0 - (double) min(r.wait_ns, r.dma_ns) / r.dma_ns : 0;
+        double frames = max(r.frames, (uint64_t) 1);
+        printf(" %8.1f %8.0f %7.1f%% %8.1f %8.1f", r.frames / secs, (double) r.pixels / max(r.transfers, (uint64_t) 1), overlap * 100,
+            r.runs_inlined / frames, r.runs_filled / frames);
+    }
+    if (slow) {
+        double frames = max(r.frames, (uint64_t) 1);
+        printf(" %9.2f %9.1f", r.stalls / frames, r.stall_us / frames);
+    }
+    if (slow || loop)
+        printf(" %8u", bench_percentile(r.first_us, 50));
+    if (frame_cache) {
+        uint64_t blocks = max(r.cache_hits + r.cache_misses, (uint64_t) 1);
+        printf(" %6.1f%% %9.1f", 100.0 * r.cache_hits / blocks, r.cache_bytes / 1024.0);
+    }
+    if (budgeted)
+        printf(" %8u %8u", bench_percentile(r.call_us, 99), bench_percentile(r.call_us, 100));
+    if (check)
+        printf("  %016llx", (unsigned long long) r.hash);
+    if (r.early_reuse)
+        printf("  BUFFER REUSED IN FLIGHT %llu TIMES", (unsigned long long) r.early_reuse);
+    if (r.loop_differs)
+        printf("  LOOP OUTPUT DIFFERS %llu TIMES", (unsigned long long) r.loop_differs);
+    printf("\n");
+}
+
+int main(int argc, char** argv) {
+    double min_seconds = 1, slowdown = 0;
+    bool check = false, reference = false, dma = false, calibrate = true, slow = false, loop = false, seek = false, next = false, profile = false;
+    std::vector<std::string> args;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            min_seconds = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-c") == 0) {
+            check = true;
+        } else if (strcmp(argv[i], "-r") == 0) {
+            reference = true;
+        } else if (strcmp(argv[i], "-d") == 0) {
+            dma = true;
+        } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            run_threshold = atoi(argv[++i]);
+            calibrate = false;
+        } else if (strcmp(argv[i], "-s") == 0) {
+            slow = true;
+        } else if (strcmp(argv[i], "-l") == 0) {
+            loop = true;
+        } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            frame_cache = new FrameCache(atol(argv[++i]));
+        } else if (strcmp(argv[i], "-n") == 0) {
+            next = true;
+        } else if (strcmp(argv[i], "-k") == 0) {
+            seek = true;
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            budget_us = atol(argv[++i]);
+            budgeted = true;
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            slowdown = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+            resident_max = atol(argv[++i]);
+        } else if (strcmp(argv[i], "-z") == 0) {
+            profile = true;
+        } else {
+            args.push_back(argv[i]);
+        }
+    }
+
+    std::vector<std::string> files = bench_collect_files(args);
+    if (files.empty()) {
+        fprintf(stderr, "usage: %s [-t seconds] [-c] [-r] [-d] [-w pixels] [-s] [-l] [-m bytes] [-n] [-k] [-b us] [-p slowdown] [-e bytes] [-z] <file.qox|directory>...\n", argv[0]);
+        return 1;
+    }
+
+    if (dma && calibrate) {
+        DmaSimSink sink;
+        run_threshold = qoif2_calibrate_run_threshold(&sink, 0);
+    }
+    printf("run threshold %u px\n", run_threshold);
+
+    bool ok = true;
+    if (check) {
+        bool runs = check_rgb_runs();
+        printf("%-24s %s\n", "rgb runs after a reset", runs ? "ok" : "WRONG COLOR");
+        ok &= runs;
+    }
+    BenchResult total, total_reference;
+    // and for each of the decoder's formats, by the channels in the file header
+    BenchResult format_total[4];
+    const char* format_names[4] = {"", "total palette", "total 565", "total rgb888"};
+    std::vector<std::vector<uint8_t>> loaded;
+    print_header(dma, slow, loop);
+    for (const std::string& path : files) {
+        std::vector<uint8_t> data;
+        if (!bench_load_file(path, &data)) {
+            printf("%-24s can't read\n", bench_basename(path).c_str());
+            continue;
+        }
+        if (next)
+            loaded.push_back(data);
+        BenchResult before;
+        if (reference)
+            before = bench_file<LegacyQOIF2>(data, min_seconds, check, dma, slow, loop);
+        BenchResult r = bench_file<QOIF2>(data, min_seconds, check, dma, slow, loop);
+        print_result(bench_basename(path), r, check, dma, slow, loop);
+        add_result(&total, r);
+        if (data.size() > 12 && data[12] >= 1 && data[12] <= 3)
+            add_result(&format_total[data[12]], r);
+        if (reference) {
+            print_result("  reference", before, check, dma, slow, loop);
+            print_speedup(before, r, check);
+            add_result(&total_reference, before);
+        }
+        if (seek) {
+            SeekResult sr = bench_seek(data);
+            print_seek("  seek", sr);
+        }
+        if (slowdown >= 1) {
+            TimelineResult before = bench_timeline<LegacyQOIF2>(data, slowdown);
+            TimelineResult after = bench_timeline<QOIF2>(data, slowdown);
+            print_timeline("  clock, reference", before);
+            print_timeline("  clock", after);
+            ok &= after.ok && !after.wrong;
+            if (after.resident) {
+                uint32_t resident = resident_max;
+                resident_max = 0;
+                TimelineResult streamed = bench_timeline<QOIF2>(data, slowdown);
+                resident_max = resident;
+                print_timeline("  clock, streamed", streamed);
+                ok &= streamed.ok && !streamed.wrong;
+            }
+        }
+    }
+    if (total.passes)
+        print_result("total", total, false, dma, slow, loop);
+    // only worth it with more than one format in the mix
+    if (total.passes != format_total[1].passes && total.passes != format_total[2].passes && total.passes != format_total[3].passes) {
+        for (int i = 1; i <= 3; i++) {
+            if (format_total[i].passes)
+                print_result(format_names[i], format_total[i], false, dma, slow, loop);
+        }
+    }
+    if (total_reference.passes) {
+        print_result("  reference", total_reference, false, dma, slow, loop);
+        print_speedup(total_reference, total, false);
+    }
+    if (!loaded.empty()) {
+        std::vector<uint32_t> reopen_us, prefetch_us;
+        bool switched = bench_switch(loaded, slow, false, 3, &reopen_us);
+        print_switch("switch, reopening", switched, reopen_us);
+        switched = bench_switch(loaded, slow, true, 3, &prefetch_us);
+        print_switch("switch, prefetched", switched, prefetch_us);
+    }
+    if (profile) {
+        Serial.out = stdout;
+        profiler_report();
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,242 @@
+// Tearing benchmark, frames sent as soon as they're decoded against SyncedSink
+//
+//   sync_bench [-r hz] [-p slowdown] [-x px_ns] [-b us] <file.qox|directory>...
+//
+// Plays each file three times through on a simulated panel refreshing hz times a second
+// (default 70, the ILI9341's own rate), with the host clock standing in for the badge's: pixels
+// take px_ns each to send (default 100) and decoding is stretched slowdown times (default 10).
+// A frame has torn if any refresh showed some of its lines and not others. Reports frames torn,
+// with sync the ones that were late (still being sent when the next refresh got to them), the
+// time spent waiting on the panel and the frame rate. With sync, frames have to be drawn the
+// same, and only late ones can tear.
+//
+// With -b the decoder gets a budget of us per call, as the player gives it, and hands back rather
+// than waiting on the panel for longer than that - "call max" is the longest a call took, which
+// is the longest the player went without looking at the touchscreen.
+
+#include <Arduino.h>
+
+#include <cmath>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "bench_impl.h"
+#include "QOIF2_impl.h"
+#include "SyncSource_impl.h"
+
+#define SETUP_NS 2000
+
+
+// Sends everything at px_ns a pixel on the host clock, noting when each line was written to
+class PanelSimSink : public HostSink {
+private:
+    uint16_t wy = 0, ww = 0;
+    uint32_t cursor = 0;
+    uint64_t owed_ns = 0;
+
+    void send(uint32_t len) {
+        uint64_t start_ns = (uint64_t) micros() * 1000 + SETUP_NS;
+        for (uint32_t i = 0; i < len; ) {
+            uint32_t row = this->wy + (this->cursor + i) / this->ww;
+            uint32_t n = min(len - i, this->ww - (this->cursor + i) % this->ww);
+            if (row < SCREEN_HEIGHT) {
+                double first = start_ns + (double) i * this->px_ns, last = first + (double) (n - 1) * this->px_ns;
+                if (!this->written[row]) {
+                    this->first_ns[row] = first;
+                    this->written[row] = true;
+                }
+                this->last_ns[row] = last;
+            }
+            i += n;
+        }
+        this->cursor += len;
+        this->owed_ns += SETUP_NS + (uint64_t) len * this->px_ns;
+        host_skip_us(this->owed_ns / 1000);
+        this->owed_ns %= 1000;
+    }
+
+public:
+    uint32_t px_ns = 100;
+    // when each line of this frame was first and last written to
+    std::vector<double> first_ns, last_ns;
+    std::vector<bool> written;
+
+    PanelSimSink() : HostSink(true), first_ns(SCREEN_HEIGHT), last_ns(SCREEN_HEIGHT), written(SCREEN_HEIGHT) {}
+
+    void startFrame() {
+        std::fill(this->written.begin(), this->written.end(), false);
+    }
+
+    void setAddrWindow(uint16_t x, uint16_t y, uint16_t w, uint16_t h) {
+        HostSink::setAddrWindow(x, y, w, h);
+        this->wy = y;
+        this->ww = w;
+        this->cursor = 0;
+    }
+
+    void writePixels(uint16_t* colors, uint32_t len) {
+        this->send(len);
+        HostSink::writePixels(colors, len);
+    }
+
+    void writeColor(uint16_t color, uint32_t len) {
+        this->send(len);
+        HostSink::writeColor(color, len);
+    }
+
+    // Whether the frame just written tore on a panel refreshing every period_us from phase_us:
+    // each line first shows on the first refresh to scan it out after it was written, and they
+    // all have to be the same one
+    bool torn(uint32_t period_us, uint32_t phase_us) {
+        double period = period_us * 1000.0, line = period / SCREEN_HEIGHT;
+        bool any = false;
+        double shown_on = 0;
+        for (uint32_t row = 0; row < SCREEN_HEIGHT; row++) {
+            if (!this->written[row])
+                continue;
+            for (double t : {this->first_ns[row], this->last_ns[row]}) {
+                double k = std::ceil((t - phase_us * 1000.0 - row * line) / period);
+                if (any && k != shown_on)
+                    return true;
+                shown_on = k;
+                any = true;
+            }
+        }
+        return false;
+    }
+};
+
+struct SyncResult {
+    bool ok = true;
+    uint32_t frames = 0, torn = 0, late = 0;
+    uint64_t wait_us = 0, elapsed_us = 0, call_max_us = 0;
+    // what each frame looked like - frames can be dropped to catch up, so not every one's there
+    std::map<uint32_t, uint64_t> hashes;
+};
+
+// Frames both drew, drawn the same
+bool same_frames(const SyncResult& a, const SyncResult& b) {
+    for (const auto& frame : a.hashes) {
+        auto other = b.hashes.find(frame.first);
+        if (other != b.hashes.end() && other->second != frame.second)
+            return false;
+    }
+    return true;
+}
+
+SyncResult bench_sync(const std::vector<uint8_t>& data, bool synced, uint32_t period_us, double slowdown, uint32_t px_ns, uint32_t budget_us) {
+    SyncResult out;
+    PanelSimSink panel;
+    panel.px_ns = px_ns;
+    // the panel's refreshes don't start when playing does
+    uint32_t phase_us = (micros() + period_us / 3) % period_us;
+    TimerSyncSource timer(period_us, phase_us);
+    SyncedSink sync_sink(&panel, &timer);
+    sync_sink.enabled = synced;
+    MemorySource src(&data);
+
+    QOIF2 img(&sync_sink, &src);
+    img.budget_us = budget_us;
+    if (img.open() != 0) {
+        out.ok = false;
+        return out;
+    }
+    uint32_t passes = 0;
+    unsigned long start = micros();
+    while (passes < 3) {
+        uint32_t waited = sync_sink.wait_us;
+        uint64_t took = bench_now_ns();
+        int res = img.read_and_render_block();
+        took = bench_now_ns() - took;
+        // waiting on the panel and sending don't take any longer on the badge, decoding does
+        uint64_t decode_us = took / 1000 - min((uint64_t) (sync_sink.wait_us - waited), took / 1000);
+        host_skip_us(decode_us * (slowdown - 1));
+        out.call_max_us = max(out.call_max_us, took / 1000 + (uint64_t) (decode_us * (slowdown - 1)));
+
+        if (res == QOIF2_B_PARTIAL)
+            continue;
+        if (res == QOIF2_B_END || res == QOIF2_B_ONE_FRAME) {
+            passes++;
+            continue;
+        }
+        if (res != QOIF2_B_DELAY && res != QOIF2_B_CONTINUE) {
+            out.ok = false;
+            return out;
+        }
+        if (img.get_block_flags() & QOIF2_F_END) {
+            // checking isn't part of playing, so the clock's held still for it
+            uint64_t check_start = bench_now_ns();
+            out.frames++;
+            out.torn += panel.torn(period_us, phase_us);
+            out.hashes[img.get_frame_num() - 1] = panel.hash();
+            host_skipped_us -= (bench_now_ns() - check_start) / 1000;
+        }
+        if (res == QOIF2_B_DELAY && img.delay_ms > 0)
+            host_skip_ms(img.delay_ms);
+    }
+    out.elapsed_us = micros() - start;
+    out.wait_us = sync_sink.wait_us;
+    out.late = sync_sink.late;
+    return out;
+}
+
+void print_sync(const std::string& name, const SyncResult& r) {
+    if (!r.ok) {
+        printf("%-24s can't play it\n", name.c_str());
+        return;
+    }
+    printf("%-24s %8u %8u %8u %12.0f %8.1f %9llu\n", name.c_str(), r.frames, r.torn, r.late,
+        r.frames ? (double) r.wait_us / r.frames : 0, r.frames * 1e6 / max(r.elapsed_us, (uint64_t) 1),
+        (unsigned long long) r.call_max_us);
+}
+
+int main(int argc, char** argv) {
+    uint32_t hz = 70, px_ns = 100, budget_us = 0;
+    double slowdown = 10;
+    std::vector<std::string> args;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+            hz = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+            slowdown = max(atof(argv[++i]), 1.0);
+        else if (strcmp(argv[i], "-x") == 0 && i + 1 < argc)
+            px_ns = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+            budget_us = atol(argv[++i]);
+        else
+            args.push_back(argv[i]);
+    }
+
+    std::vector<std::string> files = bench_collect_files(args);
+    if (files.empty() || !hz) {
+        fprintf(stderr, "usage: %s [-r hz] [-p slowdown] [-x px_ns] [-b us] <file.qox|directory>...\n", argv[0]);
+        return 1;
+    }
+
+    bool ok = true;
+    uint32_t period_us = 1000000 / hz;
+    printf("%u Hz, %u ns/px, decoding %.1fx slower", hz, px_ns, slowdown);
+    if (budget_us)
+        printf(", %u us budget", budget_us);
+    printf("\n%-24s %8s %8s %8s %12s %8s %9s\n", "file", "frames", "torn", "late", "wait us/fr", "fps", "call max");
+    for (const std::string& path : files) {
+        std::vector<uint8_t> data;
+        if (!bench_load_file(path, &data)) {
+            printf("%-24s can't read\n", bench_basename(path).c_str());
+            continue;
+        }
+        SyncResult before = bench_sync(data, false, period_us, slowdown, px_ns, budget_us);
+        SyncResult after = bench_sync(data, true, period_us, slowdown, px_ns, budget_us);
+        print_sync(bench_basename(path), before);
+        print_sync("  synced", after);
+        bool same = same_frames(before, after);
+        if (!same)
+            printf("SYNCED FRAMES DRAWN DIFFERENTLY\n");
+        if (after.torn > after.late)
+            printf("SYNCED FRAMES TORE ON TIME\n");
+        ok &= after.ok && same && after.torn <= after.late;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,192 @@
+// Frame telemetry benchmark, playing files through the histograms as the player does
+//
+//   telemetry_bench [-l loops] <file.qox|directory>...
+//
+// Plays each file loops times through (default 3) with the card and the display as slow as the
+// badge's (see SlowSource and DmaSimSink), adding every frame to Telemetry, and prints its
+// summary. Each histogram's percentiles are checked against the exact ones - they can only be
+// rounded up to the top of their bucket - and the CSV written to a simulated card (see host/SD.h)
+// is read back: a header, then a row for each metric of each file, its buckets adding up to
+// its frames. Written over and over the way the player does it, the CSV has to be started again
+// rather than growing past TELEMETRY_CSV_MAX. Then prints what adding a frame costs on the host,
+// and the RAM it all takes.
+
+#include <Arduino.h>
+#include <SD.h>
+
+#include <algorithm>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "bench_impl.h"
+#include "QOIF2_impl.h"
+#include "Telemetry_impl.h"
+
+#define CSV_PATH "/telemetry.csv"
+
+
+bool check(const char* what, bool ok) {
+    if (!ok)
+        printf("FAILED: %s\n", what);
+    return ok;
+}
+
+// The percentiles as Telemetry would have them, if it kept every value
+uint32_t exact_percentile(std::vector<uint32_t> values, uint8_t pct) {
+    if (values.empty())
+        return 0;
+    std::sort(values.begin(), values.end());
+    size_t want = ((uint64_t) values.size() * pct + 99) / 100;
+    return values[max(want, (size_t) 1) - 1];
+}
+
+bool bench_file(const std::vector<uint8_t>& data, const std::string& name, int loops, Telemetry* telemetry) {
+    DmaSimSink sink;
+    MemorySource mem(&data);
+    SlowSource card(&mem);
+    QOIF2 img(&sink, &card);
+    std::vector<uint32_t> exact[TELEMETRY_METRICS];
+
+    if (img.open() != 0) {
+        printf("%-24s can't open\n", name.c_str());
+        return false;
+    }
+    telemetry->begin(name.c_str());
+    int passes = 0;
+    while (passes < loops) {
+        int res = img.read_and_render_block();
+        if (res == QOIF2_B_END || res == QOIF2_B_ONE_FRAME) {
+            passes++;
+            continue;
+        }
+        if (res != QOIF2_B_DELAY && res != QOIF2_B_CONTINUE) {
+            printf("%-24s can't play\n", name.c_str());
+            return false;
+        }
+        if (img.get_block_flags() & QOIF2_F_END) {
+            telemetry->add(&img.frame_stats);
+            const QOIF2FrameStats& f = img.frame_stats;
+            uint32_t waiting = f.read_us + f.dma_us;
+            uint32_t values[TELEMETRY_METRICS] = {f.busy_us > waiting ? f.busy_us - waiting : 0, f.read_us, f.dma_us, f.bytes, f.pixels, f.late_ms};
+            for (uint8_t i = 0; i < TELEMETRY_METRICS; i++)
+                exact[i].push_back(values[i]);
+        }
+        if (res == QOIF2_B_DELAY && img.delay_ms > 0)
+            host_skip_ms(img.delay_ms);
+    }
+    telemetry->print();
+
+    bool ok = true;
+    for (uint8_t i = 0; i < TELEMETRY_METRICS; i++) {
+        Histogram* h = telemetry->metric(i);
+        uint32_t counted = 0;
+        for (uint8_t b = 0; b < TELEMETRY_BUCKETS; b++)
+            counted += h->counts[b];
+        ok &= check(Telemetry::metric_name(i), h->n == exact[i].size() && counted == h->n);
+        for (uint8_t pct : {50, 90, 99}) {
+            uint32_t want = exact_percentile(exact[i], pct), got = h->percentile(pct);
+            if (got < want || got > want * 2) {
+                printf("FAILED: %s p%u is %u, exactly %u\n", Telemetry::metric_name(i), pct, got, want);
+                ok = false;
+            }
+        }
+    }
+    return ok;
+}
+
+// Every row after the header has each metric's buckets adding up to its frames
+bool check_csv(int files) {
+    auto csv = host_sd.find(CSV_PATH);
+    if (!check("csv written", csv != NULL))
+        return false;
+    std::istringstream in(std::string(csv->data.begin(), csv->data.end()));
+    std::string line;
+    int rows = 0;
+    bool ok = true;
+    std::getline(in, line);
+    ok &= check("csv header", line.rfind("file,metric,frames,mean,max,", 0) == 0);
+    while (std::getline(in, line)) {
+        std::vector<std::string> fields;
+        std::istringstream row(line);
+        std::string field;
+        while (std::getline(row, field, ','))
+            fields.push_back(field);
+        if (!check("csv row", fields.size() == 5 + TELEMETRY_BUCKETS))
+            return false;
+        uint64_t counted = 0;
+        for (size_t b = 5; b < fields.size(); b++)
+            counted += std::stoul(fields[b]);
+        ok &= check("csv buckets", counted == std::stoul(fields[2]));
+        rows++;
+    }
+    return ok && check("csv rows", rows == files * TELEMETRY_METRICS);
+}
+
+// Rows added through finish() and csv_idle() again and again, as the player would over a long
+// slideshow - the CSV never gets bigger than TELEMETRY_CSV_MAX and one write
+bool check_csv_bound(Telemetry* telemetry) {
+    size_t largest = 0, last = 0, write = 0;
+    uint32_t removes = host_sd.stats.removes;
+    for (int i = 0; i < 100; i++) {
+        telemetry->finish();
+        telemetry->csv_idle(CSV_PATH);
+        auto csv = host_sd.find(CSV_PATH);
+        if (!check("csv written", csv != NULL && !telemetry->csv_pending))
+            return false;
+        size_t size = csv->data.size();
+        if (size > last)
+            write = max(write, size - last);
+        largest = max(largest, size);
+        last = size;
+    }
+    return check("csv started again", host_sd.stats.removes > removes)
+        && check("csv bounded", largest <= TELEMETRY_CSV_MAX + write);
+}
+
+int main(int argc, char** argv) {
+    int loops = 3;
+    std::vector<std::string> args;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-l") == 0 && i + 1 < argc)
+            loops = atoi(argv[++i]);
+        else
+            args.push_back(argv[i]);
+    }
+
+    std::vector<std::string> files = bench_collect_files(args);
+    if (files.empty()) {
+        fprintf(stderr, "usage: %s [-l loops] <file.qox|directory>...\n", argv[0]);
+        return 1;
+    }
+
+    Serial.out = stdout;
+    host_sd = HostSDCard();
+    Telemetry telemetry;
+    bool ok = true;
+    int written = 0;
+    for (const std::string& path : files) {
+        std::vector<uint8_t> data;
+        if (!bench_load_file(path, &data)) {
+            printf("%-24s can't read\n", bench_basename(path).c_str());
+            continue;
+        }
+        ok &= bench_file(data, bench_basename(path), loops, &telemetry);
+        ok &= check("csv write", telemetry.write_csv(CSV_PATH));
+        written++;
+        printf("\n");
+    }
+    ok &= check_csv(written);
+    ok &= check_csv_bound(&telemetry);
+
+    QOIF2FrameStats frame = {0, 0, 0, 0, 0, 0};
+    uint64_t start = bench_now_ns();
+    for (uint32_t i = 0; i < 1000000; i++) {
+        frame.busy_us = i & 0xffff;
+        frame.bytes = i;
+        telemetry.add(&frame);
+    }
+    printf("%-24s %8.1f ns/frame, %zu bytes\n", "telemetry", (bench_now_ns() - start) / 1e6, sizeof(Telemetry));
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,150 @@
+// Touch handling benchmark, the main screen reading the touchscreen itself against TouchSampler
+//
+//   touch_bench [-r runs] [-g glitch %]
+//
+// Plays gestures on the main screen's buttons - taps, holding lock, sliding off a button - on a
+// scripted touchscreen (see host/TouchScreen.h), runs times each (default 100) with readings
+// jittered and glitch % of the touched ones (default 5) bad: reading as lifted, or as somewhere
+// else on the screen. Both see the same readings at TOUCH_SAMPLE_HZ. Prints how often each got
+// the right button (or none, where none's right), then what the filtering costs a second on the
+// host. The sampler has to get at least as many right as before, and nearly all.
+
+#include <Arduino.h>
+
+#include <random>
+#include <vector>
+
+#include "bench_impl.h"
+#include "main_touch_impl.h"
+#include "LegacyMainTouch_impl.h"
+
+#define SAMPLE_MS (1000 / TOUCH_SAMPLE_HZ)
+#define JITTER 6
+// Between gestures
+#define IDLE_MS 300
+
+
+struct Stroke {
+    int ms;
+    int16_t x, y;
+};
+
+struct Gesture {
+    const char* name;
+    std::vector<Stroke> strokes;
+    uint8_t expect;
+};
+
+struct Reading {
+    int16_t x, y;
+    bool pressed;
+};
+
+std::mt19937 rng(1);
+
+int rand_int(int lo, int hi) {
+    return std::uniform_int_distribution<int>(lo, hi)(rng);
+}
+
+// What the touchscreen reads every sample through a gesture and the idle after it
+std::vector<Reading> readings(const Gesture& gesture, int glitch_pct) {
+    std::vector<Reading> out;
+    for (const Stroke& stroke : gesture.strokes) {
+        for (int t = 0; t < stroke.ms; t += SAMPLE_MS)
+            out.push_back({(int16_t) (stroke.x + rand_int(-JITTER, JITTER)), (int16_t) (stroke.y + rand_int(-JITTER, JITTER)), true});
+    }
+    for (int t = 0; t < IDLE_MS; t += SAMPLE_MS)
+        out.push_back({0, 0, false});
+
+    for (Reading& r : out) {
+        if (!r.pressed || rand_int(0, 99) >= glitch_pct)
+            continue;
+        if (r.pressed && rand_int(0, 1)) {
+            r.pressed = false;
+        } else {
+            r = {(int16_t) rand_int(0, SCREEN_WIDTH - 1), (int16_t) rand_int(0, SCREEN_HEIGHT - 1), true};
+        }
+    }
+    return out;
+}
+
+// The buttons each one pressed
+void play(const std::vector<Reading>& in, TouchScreen* ts, TouchSampler* touch, std::vector<uint8_t>* before, std::vector<uint8_t>* after) {
+    for (const Reading& r : in) {
+        ts->point.x = X_MIN + (long) r.x * (X_MAX - X_MIN) / SCREEN_WIDTH;
+        ts->point.y = Y_MIN + (long) r.y * (Y_MAX - Y_MIN) / SCREEN_HEIGHT;
+        ts->point.z = r.pressed ? 200 : 0;
+        uint8_t button = legacy_get_main_screen_touch(ts);
+        if (button)
+            before->push_back(button);
+
+        touch->add(r.x, r.y, r.pressed, millis());
+        button = get_main_screen_touch(touch);
+        if (button)
+            after->push_back(button);
+        host_skip_ms(SAMPLE_MS);
+    }
+}
+
+int main(int argc, char** argv) {
+    int runs = 100, glitch_pct = 5;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+            runs = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-g") == 0 && i + 1 < argc)
+            glitch_pct = atoi(argv[++i]);
+    }
+
+    std::vector<Gesture> gestures = {
+        {"tap left", {{150, 40, 160}}, MAIN_BTN_LEFT},
+        {"tap pause", {{150, 120, 160}}, MAIN_BTN_PAUSE},
+        {"tap right", {{150, 200, 160}}, MAIN_BTN_RIGHT},
+        {"tap menu", {{150, 120, 290}}, MAIN_BTN_MENU},
+        {"hold lock", {{3500, 120, 30}}, MAIN_BTN_LOCK},
+        {"tap lock", {{1000, 120, 30}}, 0},
+        {"slide left to pause", {{150, 40, 160}, {150, 120, 160}}, 0},
+    };
+
+    TouchScreen ts(0, 0, 0, 0, 300);
+    TouchSampler touch;
+    touch.begin();
+    bool ok = true;
+
+    printf("%d runs, %d%% glitches, %d Hz\n", runs, glitch_pct, TOUCH_SAMPLE_HZ);
+    printf("%-22s %10s %10s\n", "", "before %", "after %");
+    for (const Gesture& gesture : gestures) {
+        int before_ok = 0, after_ok = 0;
+        for (int i = 0; i < runs; i++) {
+            std::vector<uint8_t> before, after, expect;
+            if (gesture.expect)
+                expect.push_back(gesture.expect);
+            play(readings(gesture, glitch_pct), &ts, &touch, &before, &after);
+            before_ok += before == expect;
+            after_ok += after == expect;
+        }
+        printf("%-22s %10.1f %10.1f\n", gesture.name, 100.0 * before_ok / runs, 100.0 * after_ok / runs);
+        ok &= after_ok >= before_ok && after_ok >= runs * 98 / 100;
+    }
+
+    // What the filter and debouncing cost, without the reads themselves
+    std::vector<Reading> in;
+    for (int i = 0; i < 50; i++) {
+        std::vector<Reading> more = readings(gestures[i % gestures.size()], glitch_pct);
+        in.insert(in.end(), more.begin(), more.end());
+    }
+    uint32_t ms = 0;
+    uint64_t start = bench_now_ns();
+    for (int i = 0; i < 20; i++) {
+        for (const Reading& r : in) {
+            touch.add(r.x, r.y, r.pressed, ms += SAMPLE_MS);
+            get_main_screen_touch(&touch);
+        }
+    }
+    double ns = (double) (bench_now_ns() - start) / (20 * in.size());
+    printf("%-22s %10.1f ns/sample, %.2f us/s\n", "filter", ns, ns * TOUCH_SAMPLE_HZ / 1000);
+
+    if (!ok)
+        printf("SAMPLER MISSED PRESSES\n");
+    return ok ? 0 : 1;
+}
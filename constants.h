@@ -43,4 +43,28 @@
 
 #define FILE_DIRECTORY "/"
 
+// RAM for keeping short animations' frames, so later loops don't touch the SD card - 0 to disable
+#define FRAME_CACHE_BYTES 65536
+// Most the decoders, their buffers and the frame cache can take between them (see Arena_impl.h),
+// leaving at least 32K of the 192K for the stack, the SD library and everything else. The file
+// playing can be read into memory whole if it's up to QOIF2_RESIDENT_BYTES.
+#define ARENA_BUDGET_BYTES ((192 - 32) * 1024)
+// How long before an animation's due to finish that the next one's opened and buffered
+#define PREFETCH_LEAD_MS 1000
+// Longest the decoder goes before handing back to the player to check for input - a block that
+// takes longer is finished over more than one call
+#define DECODE_BUDGET_US 4000
+// Time each frame's transfers to the panel's refresh (see SyncSource_impl.h) so they don't tear - 1
+// to turn on. Frames wait for the panel, which the decoder spends back in the player when it has
+// a budget, but that's still time it isn't decoding.
+#define DISPLAY_TE_SYNC 0
+// Where each file's frame telemetry is added after it changes, as well as printed to Serial (see
+// Telemetry_impl.h) - uncomment to have it on the card, written between frames and kept under
+// TELEMETRY_CSV_MAX
+// #define TELEMETRY_CSV "/telemetry.csv"
+// Time the zones marked in the hot paths (see Profiler_impl.h) - 1 to turn on
+#ifndef PROFILER
+#define PROFILER 0
+#endif
+
 #endif
\ No newline at end of file
@@ -168,7 +168,8 @@ class ImageParser:
         for frame_num in range(self.frames):
             self.img.seek(frame_num)
             frame = ImageFrame(self.args, frame_num, self.img.convert('RGB'), self.img.info.get('duration', 0), self.bgcolor, self.width, self.height)
-            diff = list(diff_images(last_frame.frame, frame.frame)) if last_frame else None
+            # top to bottom, so drawing them can follow the panel's scan down the screen
+            diff = sorted(diff_images(last_frame.frame, frame.frame), key=lambda r: (r[1] + r[3], r[0])) if last_frame else None
             yield diff, frame
             last_frame = frame
 
@@ -218,44 +219,70 @@ class ImageFrame:
             for xv in range(x, x + w):
                 yield self.frame.getpixel((xv, yv))
 
-    def get_pixels_rle(self, max_chunk_size, x=None, y=None, w=None, h=None, only_chunk_rle=False):
-        def chunk_list(data, is_rle=False):
-            out = []
-            for v in data:
-                out.append(v)
-                if max_chunk_size and (not only_chunk_rle or is_rle) and len(out) == max_chunk_size:
-                    yield out
-                    out = []
-            if out:
-                yield out
+    def solid_strips(self, x, y, w, h, min_rows):
+        """Splits a rect into strips of whole rows, as (x, y, w, h, color) - where color is the 565
+        color of a strip of at least min_rows rows that are all that one color, or of the whole rect
+        if it's all one color, and None for everything else"""
+        rgb = np.asarray(self.frame, dtype=np.uint16)[y:y + h, x:x + w]
+        px = ((rgb[:, :, 0] & 0xf8) << 8) | ((rgb[:, :, 1] & 0xfc) << 3) | (rgb[:, :, 2] >> 3)
+        # each row's color, or None if it has more than one
+        rows = [int(row[0]) if (row == row[0]).all() else None for row in px]
+        strips = []
+        for color, group in itertools.groupby(range(h), key=lambda i: rows[i]):
+            group = list(group)
+            if color is not None and len(group) < min_rows and len(group) < h:
+                color = None
+            if strips and color is None and strips[-1][4] is None:
+                sx, sy, sw, sh, _ = strips.pop()
+                strips.append((sx, sy, sw, sh + len(group), None))
+            else:
+                strips.append((x, y + group[0], w, len(group), color))
+        return strips
 
+    def get_pixels_rle(self, max_chunk_size, x=None, y=None, w=None, h=None, only_chunk_rle=False):
         expected_size = (w or self.frame.size[0]) * (h or self.frame.size[1])
 
         all_pixels = list(self.get_pixels(x, y, w, h))
         assert len(all_pixels) == expected_size
 
-        total_px = 0
-        out = list(map(lambda v: list(v[1]), itertools.groupby(all_pixels)))
-        # out is a list of lists of pixel values that are all the same
-        raw_px = []
-        for group in out:
-            if len(group) > 3:
-                # The group is a long enough run of pixels to RLE-encode
-                if raw_px:
-                    for v in chunk_list(raw_px):
-                        total_px += len(v)
-                        yield 0, v
-                    raw_px = []
-                for v in chunk_list(group, True):
-                    if v:
-                        total_px += len(v)
-                        yield len(v), [v[0]]
-            else:
-                raw_px += group
-        if raw_px:
-            for v in chunk_list(raw_px):
-                if v:
+        return rle_pixels(all_pixels, max_chunk_size, only_chunk_rle)
+
+
+def rle_pixels(all_pixels, max_chunk_size, only_chunk_rle=False):
+    """Groups pixels into (run length, [pixel]) for runs, and (0, pixels) for everything else"""
+    def chunk_list(data, is_rle=False):
+        out = []
+        for v in data:
+            out.append(v)
+            if max_chunk_size and (not only_chunk_rle or is_rle) and len(out) == max_chunk_size:
+                yield out
+                out = []
+        if out:
+            yield out
+
+    expected_size = len(all_pixels)
+    total_px = 0
+    out = list(map(lambda v: list(v[1]), itertools.groupby(all_pixels)))
+    # out is a list of lists of pixel values that are all the same
+    raw_px = []
+    for group in out:
+        if len(group) > 3:
+            # The group is a long enough run of pixels to RLE-encode
+            if raw_px:
+                for v in chunk_list(raw_px):
                     total_px += len(v)
                     yield 0, v
-
-        assert total_px == expected_size
+                raw_px = []
+            for v in chunk_list(group, True):
+                if v:
+                    total_px += len(v)
+                    yield len(v), [v[0]]
+        else:
+            raw_px += group
+    if raw_px:
+        for v in chunk_list(raw_px):
+            if v:
+                total_px += len(v)
+                yield 0, v
+
+    assert total_px == expected_size
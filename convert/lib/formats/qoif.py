@@ -243,6 +243,7 @@ import numpy as np
 
 from PIL import Image
 
+from .. import rle_pixels
 from . import (
     EndOfFile,
     ImageFormat,
@@ -263,7 +264,7 @@ class QOIF2Base:
 
       * Magic string is "qoiF"
       * Header has an additional field at the end:
-        * 1b version (must be 2)
+        * 1b version (2, 3 or 4)
       * Channels may be 2, for 16 bit 5-6-5 RGB encoding (in this case, alpha is not supported, so the rgba op tag must not be present)
         * In the case of 2 "channels", the rgb op tag is followed by 2b of rgb565
         * To calculate the index in the cache, multiply the 16 bit color by 6311 (0b0001100010100111) & modulo 64
@@ -274,6 +275,7 @@ class QOIF2Base:
             * F_START: 2 - This block is the start of a displayed frame
             * F_END: 4 - This block is the end of a displayed frame, this is the only case when a duration should be set
             * F_BIG: 8 - The second header is the "big" version, supporting larger pixel sizes
+            * F_KEY: 16 - (version 3) The decoder state (previous pixel and cache) is reset to its initial value before this block. Only set on the first block of a frame that covers the whole image, so decoding can start from it
           * 2b duration, in ms
           * 4b datalen, length of block data (excluding headers)
         * Header 2 - differs depending on the dimensions of the block (a larger version is required to support the maximum dimensions as per the header, the smaller version is suitable for small images)
@@ -281,6 +283,29 @@ class QOIF2Base:
             * If F_BIG is not set, all fields are 2b
             * Otherwise, all fields are 4b (required if any dimension or position is >65535 px)
 
+      * Version 3 files have an index after the trailer, for seeking:
+        * One entry per frame, in order: 4b frame number, 4b file offset of the frame's first block, 4b time the frame starts at in ms, 1b flags of the frame's first block
+        * Followed by a footer at the very end of the file: 4b number of entries, 4b file offset of the index, 4b magic "qoiI"
+
+      * Version 4 files with 2 "channels" may have a skip op in place of the rgba op tag:
+        * 0xff followed by 2b count of pixels to leave as they are on the screen - they aren't sent to it
+        * The previous pixel and cache are left as they were before the skip
+        * Never in a block with F_KEY, which has to draw everything
+        * If the count has its top bit (0x8000) set, it's a literal instead - the rest of it is a count of
+          pixels that follow as 2b rgb565 each, to be drawn as they are
+          * They aren't added to the cache, but the last of them becomes the previous pixel
+          * May be in any block
+      * Version 4 files may have 1 "channel", for 8 bit indexes into a palette of 5-6-5 RGB colors:
+        * The palette follows the file header: 2b count of entries (at most 256), then each entry as 2b rgb565
+        * The rgb op tag is followed by 1b index, and literals are 1b index per pixel
+        * Everything else works on the rgb565 colors the indexes stand for, as with 2 "channels"
+        * F_PALETTE: 32 - The block data starts with a palette in the same form, which is used from this block on
+        * F_KEY goes back to the palette after the file header
+      * Version 4 files with 3 "channels" (24 bit) have no skip or literal ops - 0xff is QOI's rgba op in them
+      * Version 4 blocks may be all one color:
+        * F_FILL: 64 - The block data (after the palette, with F_PALETTE) is just the block's color, 2b rgb565 whatever the "channels"
+        * The previous pixel and cache are left as they were
+
     Image data is otherwise stored identically to QOIF, except as described above for 16 bit color
     """
 
@@ -291,15 +316,26 @@ class QOIF2Base:
     FM_BLOCK1 = ('<BHI', ('flags', 'duration', 'datalen'))
     FM_BLOCK2 = ('<HHHH', ('width', 'height', 'x', 'y'))
     FM_BLOCK2_BIG = ('<IIII', ('width', 'height', 'x', 'y'))
+    FM_INDEX = ('<IIIB', ('frame', 'offset', 'time', 'flags'))
+    FM_FOOTER = ('<III', ('count', 'index_offset', 'magic'))
 
     F_THUMB = 1
     F_START = 2
     F_END = 4
     F_BIG = 8
+    F_KEY = 16
+    F_PALETTE = 32
+    F_FILL = 64
 
     MAGIC = struct.unpack('<I', b'qoiF')[0]
-    VERSION = 2
+    INDEX_MAGIC = struct.unpack('<I', b'qoiI')[0]
+    VERSION = 4
+    VERSIONS = (2, 3, 4)
     TRAILER = b'\x00\x00\x00\x00\x00\x00\x00\x01'
+    # most pixels one skip or literal op covers, and the bit that makes it a literal
+    SPAN_MAX = 0x7fff
+    SPAN_LITERAL = 0x8000
+    PALETTE_SIZE = 256
 
     def __init__(self, *args, **kwargs):
         super().__init__(*args, **kwargs)
@@ -329,34 +365,121 @@ class QOIF2Base:
     def _get_cache_idx(self, idx):
         return self.prev_cache[idx]
 
+    def _pack_palette(self, palette):
+        return struct.pack('<H{}H'.format(len(palette)), len(palette), *palette)
+
 
 class QOIF2Writer(QOIF2Base, ImageFormatWriter):
     def __init__(self, *args, **kwargs):
         super().__init__(*args, **kwargs)
         self.bpp = self.args.bpp
         self.exclude_tags = []
+        self.version = self.VERSION
+        # every this many frames is a keyframe - 0 for only the first
+        self.keyframe = 0
+        # shortest stretch of pixels that are already on the screen to skip rather than send
+        # again - 0 to send everything
+        self.skip = 16
+        # shortest stretch of pixels that would all need rgb ops to send as a literal instead, which
+        # the decoder just copies - 0 to never use them
+        self.literal = 4
+        # fewest rows of a rect, all one color, to fill as a block of their own - a rect that's all
+        # one color is always filled. 0 to never fill.
+        self.fill = 8
         if self.args.format_args:
             for k, v in self.args.format_args:
                 if k == 'notags':
                     self.exclude_tags = v.split(',')
+                elif k == 'version':
+                    self.version = int(v)
+                elif k == 'keyframe':
+                    self.keyframe = int(v)
+                elif k == 'skip':
+                    self.skip = int(v)
+                elif k == 'literal':
+                    self.literal = int(v)
+                elif k == 'fill':
+                    self.fill = int(v)
+        if self.version not in self.VERSIONS:
+            raise ValueError("Can't write version {}".format(self.version))
+        # set once the frames' colors are known to fit, see _pick_palette
+        self.file_palette = None
+        self.palette = None
+        self.palette_idx = None
         self.setup()
 
+    def _frame_colors(self, frame):
+        return set(self.color_565(px) for px in frame.get_pixels())
+
+    def _pick_palette(self, frames):
+        """The file's palette - every color if there are few enough, otherwise the first frame's
+        if every frame's colors fit, with the others' in their own blocks. None if they don't fit."""
+        colors = [self._frame_colors(frame) for _, frame in frames]
+        if any(len(c) > self.PALETTE_SIZE for c in colors):
+            logger.info("Too many colors for a palette, %d in one frame", max(len(c) for c in colors))
+            return None, colors
+        everything = set().union(*colors)
+        if len(everything) <= self.PALETTE_SIZE:
+            return sorted(everything), colors
+        return sorted(colors[0]), colors
+
+    def _use_palette(self, palette):
+        self.palette = palette
+        self.palette_idx = {px: i for i, px in enumerate(palette)}
+
     def __iter__(self):
-        yield self.pack_fmt_keys(
+        frames = self.image
+        frame_colors = None
+        if getattr(self.args, 'palette', False) and self.version >= 4 and self.bpp == 16:
+            # every frame's needed up front to count the colors
+            frames = list(self.image)
+            self.file_palette, frame_colors = self._pick_palette(frames)
+
+        header = self.pack_fmt_keys(
             self.FM_HEADER,
             magic=self.MAGIC,
             width=self.image.width,
             height=self.image.height,
-            channels=int(self.args.bpp / 8),
+            channels=1 if self.file_palette else int(self.args.bpp / 8),
             colorspace=1,
-            version=self.VERSION,
+            version=self.version,
         )
-
-        for diff, frame in self.image:
-            yield from self.process_frame(diff, frame)
+        if self.file_palette:
+            header += self._pack_palette(self.file_palette)
+            self._use_palette(self.file_palette)
+        yield header
+
+        offset = len(header)
+        time = 0
+        index = []
+        # what's on the screen, as 565 colors, when pixels already there can be skipped - not
+        # always the last frame, the diff can miss changes
+        screen = [None] * (self.image.width * self.image.height) if self.skip and self.version >= 4 and self.bpp < 24 else None
+        for frame_num, (diff, frame) in enumerate(frames):
+            key = self.version >= 3 and (frame_num == 0 or (self.keyframe and frame_num % self.keyframe == 0))
+            if key:
+                # A keyframe is drawn whole, from the initial state, so nothing before it is needed
+                diff = None
+                self.setup()
+                if self.file_palette:
+                    self._use_palette(self.file_palette)
+            palette = None
+            if self.file_palette and not frame_colors[frame_num] <= self.palette_idx.keys():
+                palette = sorted(frame_colors[frame_num])
+                self._use_palette(palette)
+            blocks = b''.join(self.process_frame(diff, frame, key, screen, palette))
+            index.append(self.pack_fmt_keys(self.FM_INDEX, frame=frame_num, offset=offset, time=time, flags=blocks[0]))
+            offset += len(blocks)
+            time += frame.duration
+            yield blocks
 
         # trailer
         yield self.TRAILER
+        offset += len(self.TRAILER)
+
+        if self.version >= 3:
+            yield b''.join(index)
+            yield self.pack_fmt_keys(self.FM_FOOTER, count=len(index), index_offset=offset, magic=self.INDEX_MAGIC)
 
     def _unpack_px(self, px):
         if self.bpp < 24:
@@ -428,6 +551,12 @@ class QOIF2Writer(QOIF2Base, ImageFormatWriter):
                 0b11111110,
                 *px[:3]
             )
+        elif self.palette:
+            return struct.pack(
+                '<BB',
+                0b11111110,
+                self.palette_idx[px]
+            )
         elif self.args.bpp == 16:
             return struct.pack(
                 '<BH',
@@ -435,8 +564,36 @@ class QOIF2Writer(QOIF2Base, ImageFormatWriter):
                 px
             )
 
-    def process_frame_data(self, frame, x=None, y=None, w=None, h=None):
-        for rle_len, pixels in frame.get_pixels_rle(63, x, y, w, h, only_chunk_rle=True):
+    def process_frame_data(self, frame, x=None, y=None, w=None, h=None, screen=None, key=False):
+        if screen is None:
+            yield from self._encode_pixels(frame.get_pixels_rle(63, x, y, w, h, only_chunk_rle=True))
+            return
+
+        # Stretches of at least self.skip pixels that are already on the screen are skipped,
+        # everything between them is encoded as usual. Keyframes draw everything.
+        if x is None:
+            x = y = 0
+            w, h = self.image.width, self.image.height
+        pixels = list(frame.get_pixels(x, y, w, h))
+        at = [(y + i // w) * self.image.width + x + i % w for i in range(len(pixels))]
+        shown = [not key and screen[at[i]] == self.color_565(px) for i, px in enumerate(pixels)]
+        for i, px in enumerate(pixels):
+            screen[at[i]] = self.color_565(px)
+        start = 0
+        for same, group in itertools.groupby(range(len(pixels)), key=lambda i: shown[i]):
+            group = list(group)
+            if not same or len(group) < self.skip:
+                continue
+            if start < group[0]:
+                yield from self._encode_pixels(rle_pixels(pixels[start:group[0]], 63, only_chunk_rle=True))
+            for n in range(0, len(group), self.SPAN_MAX):
+                yield struct.pack('<BH', 0b11111111, min(len(group) - n, self.SPAN_MAX))
+            start = group[-1] + 1
+        if start < len(pixels):
+            yield from self._encode_pixels(rle_pixels(pixels[start:], 63, only_chunk_rle=True))
+
+    def _encode_pixels(self, chunks):
+        for rle_len, pixels in chunks:
             if rle_len > 1 and 'run' in self.exclude_tags:
                 pixels = [pixels[0] for _ in range(rle_len)]
                 rle_len = 1
@@ -457,25 +614,74 @@ class QOIF2Writer(QOIF2Base, ImageFormatWriter):
                 self._set_cache(px)
                 self.prev_px = px
             else:
-                for px in pixels:
-                    if self.args.bpp < 24:
-                        px = self.color_565(px)
-                    else:
-                        px = tuple(list(px) + [255])
+                if self.args.bpp < 24:
+                    pixels = [self.color_565(px) for px in pixels]
+                else:
+                    pixels = [tuple(list(px) + [255]) for px in pixels]
+                i = 0
+                while i < len(pixels):
+                    n = self._literal_len(pixels, i)
+                    if n:
+                        yield struct.pack('<BH', 0b11111111, self.SPAN_LITERAL | n)
+                        if self.palette:
+                            yield bytes(self.palette_idx[px] for px in pixels[i:i + n])
+                        else:
+                            yield struct.pack('<{}H'.format(n), *pixels[i:i + n])
+                        self.prev_px = pixels[i + n - 1]
+                        i += n
+                        continue
+                    px = pixels[i]
                     yield self._get_op(px)
                     self._set_cache(px)
                     self.prev_px = px
-
-    def process_frame(self, diff, frame):
+                    i += 1
+
+    def _literal_len(self, pixels, i):
+        """How many pixels from i on would each need an rgb op, given the ones before it were sent in
+        a literal, which leaves the cache alone - 0 if it's too few to be worth a literal"""
+        if not self.literal or self.version < 4 or self.bpp >= 24:
+            return 0
+        prev = self.prev_px
+        n = 0
+        while i + n < len(pixels) and n < self.SPAN_MAX and self._get_op(pixels[i + n])[0] == 0b11111110:
+            self.prev_px = pixels[i + n]
+            n += 1
+        self.prev_px = prev
+        return n if n >= self.literal else 0
+
+    def process_frame(self, diff, frame, key=False, screen=None, palette=None):
         diff = diff or [(None, None, None, None)]
-        for i, (x, y, w, h) in enumerate(diff):
-            pixel_data = b''.join(self.process_frame_data(frame, x, y, w, h))
+        if self.fill and self.version >= 4:
+            # strips of each rect that are all one color are blocks of their own, which are filled
+            diff = [
+                strip
+                for x, y, w, h in diff
+                for strip in frame.solid_strips(x or 0, y or 0, w or self.image.width, h or self.image.height, self.fill)
+            ]
+        else:
+            diff = [(x, y, w, h, None) for x, y, w, h in diff]
+        for i, (x, y, w, h, color) in enumerate(diff):
+            if color is None:
+                pixel_data = b''.join(self.process_frame_data(frame, x, y, w, h, screen, key))
+            else:
+                pixel_data = struct.pack('<H', color)
+                if screen is not None:
+                    for row in range(y, y + h):
+                        screen[row * self.image.width + x:row * self.image.width + x + w] = [color] * w
 
             duration = 0
             flags = 0
             if i == 0:
                 # First chunk
                 flags |= self.F_START
+                if key:
+                    flags |= self.F_KEY
+                if palette:
+                    # the frame's colors, which are used for all its blocks
+                    flags |= self.F_PALETTE
+                    pixel_data = self._pack_palette(palette) + pixel_data
+            if color is not None:
+                flags |= self.F_FILL
             if i + 1 == len(diff):
                 # Last chunk
                 flags |= self.F_END
@@ -514,12 +720,20 @@ class QOIF2Reader(QOIF2Base, ImageFormatReader):
         if self.header['magic'] != self.MAGIC:
             raise BadFileTypeForReader("Magic does not match")
 
-        if self.header['version'] != self.VERSION:
+        if self.header['version'] not in self.VERSIONS:
             raise BadFileTypeForReader("Version does not match")
 
         self.bpp = self.header['channels'] * 8
+        self.file_palette = None
+        if self.bpp == 8:
+            self.file_palette = self._read_palette()
+        self.palette = self.file_palette
         self.setup()
 
+    def _read_palette(self):
+        count = struct.unpack('<H', self.fp.read(2))[0]
+        return list(struct.unpack('<{}H'.format(count), self.fp.read(2 * count)))
+
     def read_header(self):
         return (self.header['width'], self.header['height'], self.bpp, {})
 
@@ -531,12 +745,34 @@ class QOIF2Reader(QOIF2Base, ImageFormatReader):
             tag = struct.unpack('<B', self.fp.read(1))[0]
             read += 1
             if tag == 0b11111110:
-                if self.bpp < 24:
+                if self.palette:
+                    px = self.palette[struct.unpack('<B', self.fp.read(1))[0]]
+                    read += 1
+                elif self.bpp < 24:
                     px = struct.unpack('<H', self.fp.read(2))[0]
                     read += 2
                 else:
                     px = tuple(list(struct.unpack('<BBB', self.fp.read(3))) + [255])
                     read += 3
+            elif tag == 0b11111111 and self.bpp < 24:
+                n = struct.unpack('<H', self.fp.read(2))[0]
+                read += 2
+                if n & self.SPAN_LITERAL:
+                    # literal, the pixels as they are - only the last one's kept
+                    n &= self.SPAN_MAX
+                    if self.palette:
+                        lits = [self.palette[i] for i in self.fp.read(n)]
+                        read += n
+                    else:
+                        lits = struct.unpack('<{}H'.format(n), self.fp.read(2 * n))
+                        read += 2 * n
+                    for lit in lits:
+                        yield lit
+                    self.prev_px = lit
+                else:
+                    # skip, the pixels are left as they were
+                    for _ in range(n):
+                        yield None
             elif tag == 0b11111111:
                 px = tuple(struct.unpack('<BBBB'), self.fp.read(4))
                 read += 4
@@ -597,18 +833,32 @@ class QOIF2Reader(QOIF2Base, ImageFormatReader):
 
     def read_block(self):
         bh = self.read_fmt(self.FM_BLOCK1, self.fp)
-        bh['flags'] = {f: bool(bh['flags'] & getattr(self, f)) for f in ('F_START', 'F_END', 'F_THUMB', 'F_BIG')}
+        bh['flags'] = {f: bool(bh['flags'] & getattr(self, f)) for f in ('F_START', 'F_END', 'F_THUMB', 'F_BIG', 'F_KEY', 'F_PALETTE', 'F_FILL')}
+        if bh['flags']['F_KEY']:
+            self.setup()
+            self.palette = self.file_palette
         logger.debug("Read bh1: %s", bh)
         bh.update(self.read_fmt(self.FM_BLOCK2_BIG if bh['flags']['F_BIG'] else self.FM_BLOCK2, self.fp))
+        if bh['flags']['F_PALETTE']:
+            self.palette = self._read_palette()
+            bh['datalen'] -= 2 + 2 * len(self.palette)
         logger.debug("Read bh2: %s", bh)
         block = Image.new('RGBA', (self.header['width'], self.header['height']), (0, 0, 0, 0))
+        if bh['flags']['F_FILL']:
+            color = self.color_565_to_888(struct.unpack('<H', self.fp.read(2))[0])
+            block.paste(color + (255,), (bh['x'], bh['y'], bh['x'] + bh['width'], bh['y'] + bh['height']))
+            return bh, block
         pixels = iter(self._read_pixels_from_frame(bh['datalen']))
         for y in range(bh['height']):
             for x in range(bh['width']):
                 px = next(pixels)
+                if px is None:
+                    continue
                 if self.bpp < 24:
                     px = self.color_565_to_888(px)
                 block.putpixel((x + bh['x'], y + bh['y']), px)
+        # the last op only updates the state for the next block once its pixels are all taken
+        next(pixels, None)
         return bh, block
 
     def read_frames(self):
@@ -623,6 +873,7 @@ class QOIF2Reader(QOIF2Base, ImageFormatReader):
         logger.debug("Read frames")
         while True:
             if self.fp.read(8) == self.TRAILER:
+                # version 3's index follows, but it's not needed to read everything in order
                 logger.debug("Read trailer, end read frames")
                 break
             self.fp.seek(self.fp.tell() - 8)
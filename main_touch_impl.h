@@ -1,60 +1,51 @@
 #ifndef _MAIN_TOUCH_IMPL_H_
 #define _MAIN_TOUCH_IMPL_H_
 
+#include "TouchSampler_impl.h"
+#include "Profiler_impl.h"
+
 #define MAIN_BTN_LOCK 1
 #define MAIN_BTN_MENU 2
 #define MAIN_BTN_LEFT 3
 #define MAIN_BTN_PAUSE 4
 #define MAIN_BTN_RIGHT 5
+// How long lock has to be held
+#define MAIN_LOCK_HOLD_MS 3000
 
 
-uint8_t get_main_screen_touch(TouchScreen* touchscreen) {
-    static uint8_t button = 0, last_button = 0;
-    static long button_pressed_at = 0, button_released_at = 0;
-
-    uint8_t rval = 0;
-    TSPoint p = touchscreen->getPoint();
+uint8_t get_main_screen_button(int16_t x, int16_t y) {
+    if (y < 64) {
+        return MAIN_BTN_LOCK;
+    } else if (y > 256) {
+        return MAIN_BTN_MENU;
+    } else if (x < 80) {
+        return MAIN_BTN_LEFT;
+    } else if (x < 160) {
+        return MAIN_BTN_PAUSE;
+    }
+    return MAIN_BTN_RIGHT;
+}
 
-    if (p.z > touchscreen->pressureThreshhold) {
-        int16_t x = map(p.x, X_MIN, X_MAX, 0, SCREEN_WIDTH);
-        int16_t y = map(p.y, Y_MIN, Y_MAX, 0, SCREEN_HEIGHT);
-        uint8_t new_button;
-        if (y < 64) {
-            new_button = MAIN_BTN_LOCK;
-        } else if (y > 256) {
-            new_button = MAIN_BTN_MENU;
-        } else if (x < 80) {
-            new_button = MAIN_BTN_LEFT;
-        } else if (x < 160) {
-            new_button = MAIN_BTN_PAUSE;
-        } else {
-            new_button = MAIN_BTN_RIGHT;
-        }
-        if (!button) {
-            button = new_button;
-            button_pressed_at = millis();
-        }
-        last_button = new_button;
-        button_released_at = 0;
-    } else {
-        if (button && button_released_at && millis() - button_released_at > 50 && button == last_button) {
-            if (button == MAIN_BTN_LOCK) {
-                if (millis() - button_pressed_at >= 3000) {
-                    rval = MAIN_BTN_LOCK;
-                }
-            } else {
-                rval = button;
-            }
+// A button's pressed when the touch is let go of on the same button it went down on. queued_ms
+// is set to when that was seen.
+uint8_t get_main_screen_touch(TouchSampler* touch, uint32_t* queued_ms = NULL) {
+    PROFILE_ZONE("main touch");
+    TouchEvent event;
 
-            button = 0;
-            last_button = 0;
-            button_pressed_at = 0;
-            button_released_at = 0;
-        } else if (!button_released_at) {
-            button_released_at = millis();
-        }
+    touch->poll();
+    while (touch->next_event(&event)) {
+        if (event.type != TOUCH_UP)
+            continue;
+        uint8_t button = get_main_screen_button(event.down_x, event.down_y);
+        if (button != get_main_screen_button(event.x, event.y))
+            continue;
+        if (button == MAIN_BTN_LOCK && event.held_ms < MAIN_LOCK_HOLD_MS)
+            continue;
+        if (queued_ms != NULL)
+            *queued_ms = event.ms;
+        return button;
     }
-    return rval;
+    return 0;
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -1,6 +1,123 @@
+#include <stddef.h>
 #include <SD.h>
 #include "prefs.h"
 
+// Bytes of Prefs each version had - versions only ever add fields to the end
+static const uint16_t prefs_sizes[PREFS_VERSION + 1] = {0, 132, 133, 137};
+
+static const char* journal_names[2] = {PREFS_JOURNAL_A, PREFS_JOURNAL_B};
+
+// What's on the card, and where the next record goes
+static Prefs saved;
+static uint32_t seq = 0, journal_size = 0;
+static uint8_t journal = 0;
+// set when the journal ends in a record that didn't get finished, so nothing can go after it
+static bool compact = false;
+static bool dirty = false;
+static unsigned long dirty_since = 0;
+
+static uint32_t crc32(const uint8_t* data, size_t len, uint32_t crc = 0) {
+    crc = ~crc;
+    while (len--) {
+        crc ^= *data++;
+        for (int i = 0; i < 8; i++)
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+static uint32_t record_crc(PrefsRecordHeader* header, const uint8_t* data) {
+    uint32_t crc = crc32((uint8_t*) &header->len, sizeof(header->len));
+    crc = crc32((uint8_t*) &header->seq, sizeof(header->seq), crc);
+    return crc32(data, header->len, crc);
+}
+
+// Fills in prefs from a saved copy of any version, leaving anything it didn't have alone
+static bool migrate_prefs(Prefs* prefs, const uint8_t* data, int len) {
+    uint16_t version;
+
+    if (len < (int) sizeof(version))
+        return false;
+    memcpy(&version, data, sizeof(version));
+    if (version < 1 || version > PREFS_VERSION || len < prefs_sizes[version]) {
+        Serial.print("Invalid prefs version, expected up to ");
+        Serial.print(PREFS_VERSION);
+        Serial.print(", got ");
+        Serial.println(version);
+        return false;
+    }
+    memcpy(prefs, data, prefs_sizes[version]);
+    prefs->version = PREFS_VERSION;
+    return true;
+}
+
+// Finds the newest good record in a journal, if it's newer than *best_seq. Returns the length of
+// the journal up to the end of its last good record.
+static uint32_t read_journal(const char* name, Prefs* prefs, uint32_t* best_seq, bool* found, bool* torn) {
+    PrefsRecordHeader header;
+    uint8_t data[sizeof(Prefs)];
+    uint32_t end = 0;
+
+    *torn = false;
+    File file = SD.open(name);
+    if (!file)
+        return 0;
+
+    while (file.read((uint8_t*) &header, sizeof(header)) == sizeof(header)) {
+        if (header.magic != PREFS_RECORD_MAGIC || header.len > sizeof(data))
+            break;
+        if (file.read(data, header.len) != header.len || record_crc(&header, data) != header.crc)
+            break;
+        end += sizeof(header) + header.len;
+        if ((!*found || header.seq > *best_seq) && migrate_prefs(prefs, data, header.len)) {
+            *best_seq = header.seq;
+            *found = true;
+        }
+    }
+    *torn = end != file.size();
+    file.close();
+    return end;
+}
+
+static void write_record(Prefs* prefs) {
+    uint8_t record[sizeof(PrefsRecordHeader) + sizeof(Prefs)];
+    PrefsRecordHeader* header = (PrefsRecordHeader*) record;
+
+    prefs->version = PREFS_VERSION;
+    header->magic = PREFS_RECORD_MAGIC;
+    header->len = sizeof(Prefs);
+    header->seq = ++seq;
+    memcpy(record + sizeof(PrefsRecordHeader), prefs, sizeof(Prefs));
+    header->crc = record_crc(header, record + sizeof(PrefsRecordHeader));
+
+    bool start_other = compact || journal_size + sizeof(record) > PREFS_JOURNAL_MAX;
+    uint8_t to = start_other ? !journal : journal;
+    if (start_other)
+        SD.remove(journal_names[to]);
+
+    File file = SD.open(journal_names[to], FILE_WRITE);
+    if (!file) {
+        Serial.print("Can't write to ");
+        Serial.println(journal_names[to]);
+        return;
+    }
+    bool ok = file.write(record, sizeof(record)) == sizeof(record);
+    file.close();
+    if (!ok)
+        return;
+
+    if (start_other) {
+        // only once the new one's safely written
+        SD.remove(journal_names[journal]);
+        journal = to;
+        journal_size = 0;
+        compact = false;
+    }
+    journal_size += sizeof(record);
+    saved = *prefs;
+    dirty = false;
+}
+
 void set_pref_last_filename(Prefs* prefs, const char* filename) {
     prefs->last_filename[0] = 0;
 
@@ -11,22 +128,32 @@ void set_pref_last_filename(Prefs* prefs, const char* filename) {
 }
 
 void write_prefs(Prefs* prefs) {
-    File file;
-    file = SD.open(PREFS_FILENAME, FILE_WRITE);
-    if (!file) {
-        Serial.print("Can't write to ");
-        Serial.println(PREFS_FILENAME);
-        return;
-    }
+    if (!dirty)
+        dirty_since = millis();
+    dirty = true;
+}
 
-    prefs->version = PREFS_VERSION;
-    file.write((uint8_t*)prefs, sizeof(Prefs));
-    file.close();
+void flush_prefs(Prefs* prefs) {
+    if (memcmp(prefs, &saved, sizeof(Prefs)) != 0)
+        write_record(prefs);
+    dirty = false;
+}
+
+void prefs_idle(Prefs* prefs) {
+    if (!dirty)
+        return;
+    // anything but the filename changing is a setting
+    bool settings = memcmp(prefs, &saved, offsetof(Prefs, last_filename)) != 0
+        || memcmp(&prefs->brightness, &saved.brightness, sizeof(Prefs) - offsetof(Prefs, brightness)) != 0;
+    if (millis() - dirty_since >= (settings ? PREFS_SETTINGS_DELAY_MS : PREFS_FILENAME_DELAY_MS))
+        flush_prefs(prefs);
 }
 
 void read_prefs(Prefs* prefs) {
     File file;
-    uint16_t version;
+    uint8_t data[sizeof(Prefs)];
+    uint32_t ends[2];
+    bool found = false, migrated = false, torn[2], newest[2];
 
     prefs->version = PREFS_VERSION;
     prefs->display_time_s = 10;
@@ -35,29 +162,47 @@ void read_prefs(Prefs* prefs) {
     prefs->flags = 0;
     prefs->bri_auto_min = 25;
     prefs->bri_auto_max = 255;
+    saved = *prefs;
+    seq = 0;
+    dirty = false;
 
-    file = SD.open(PREFS_FILENAME);
-    if (!file) {
-        write_prefs(prefs);
+    for (int i = 0; i < 2; i++) {
+        bool was_found = found;
+        uint32_t was_seq = seq;
+        ends[i] = read_journal(journal_names[i], prefs, &seq, &found, &torn[i]);
+        newest[i] = found && (!was_found || seq != was_seq);
+    }
+    if (found) {
+        // carry on from the journal with the newest record
+        journal = newest[1] ? 1 : 0;
+        journal_size = ends[journal];
+        compact = torn[journal];
+        saved = *prefs;
         return;
     }
 
-    file.read((uint8_t*) &version, 2);
-    if (version < 1 || version > 2) {
-        Serial.print("Invalid prefs version, expected ");
-        Serial.print(PREFS_VERSION);
-        Serial.print(", got ");
-        Serial.println(version);
+    // whatever's in the journals is no good, so start A again and clear out B
+    journal = 1;
+    journal_size = 0;
+    compact = true;
+    file = SD.open(PREFS_FILENAME);
+    if (file) {
+        // Every save was added to the end of it, so if they're all the same version the last
+        // one's the one to keep
+        uint16_t version = 0;
+        file.read((uint8_t*) &version, sizeof(version));
+        if (version >= 1 && version <= PREFS_VERSION && file.size() % prefs_sizes[version] == 0)
+            file.seek(file.size() - prefs_sizes[version]);
+        else
+            file.seek(0);
+        int len = file.read(data, sizeof(data));
         file.close();
-        return;
+        migrated = migrate_prefs(prefs, data, len);
     }
-    file.seek(0);
-
-    if (version == 1)
-        file.read((uint8_t*)prefs, 132);
-    else if (version == 2)
-        file.read((uint8_t*)prefs, 133);
-    file.close();
+    // save them as they are now, defaults or not, before letting go of the old file
+    write_record(prefs);
+    if (migrated && journal_size)
+        SD.remove(PREFS_FILENAME);
 }
 
 void set_pref_flag(Prefs* prefs, int flag, bool value) {
@@ -70,4 +215,4 @@ void set_pref_flag(Prefs* prefs, int flag, bool value) {
 
 bool read_pref_flag(Prefs* prefs, int flag) {
     return prefs->flags & (1 << flag);
-}
\ No newline at end of file
+}
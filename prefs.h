@@ -4,8 +4,20 @@
 #include <SD.h>
 
 #define PREFS_VERSION 3
+// Where prefs were kept before the journal, read once to carry them over
 #define PREFS_FILENAME "/preferences.bin"
 
+// Prefs are saved as records appended to a journal. When the journal's full, the latest record
+// starts the other one and the full one's removed, so there's always a complete copy on the card.
+#define PREFS_JOURNAL_A "/prefs_a.jnl"
+#define PREFS_JOURNAL_B "/prefs_b.jnl"
+#define PREFS_JOURNAL_MAX 4096
+#define PREFS_RECORD_MAGIC 0x5270 // "pR"
+// How long prefs_idle() lets changes build up before saving them - settings soon, the file
+// being shown (which changes all the time in a slideshow) only now and then
+#define PREFS_SETTINGS_DELAY_MS 2000
+#define PREFS_FILENAME_DELAY_MS 60000
+
 #define PREFS_FLAG_BL_AUTO 0
 
 typedef struct {
@@ -18,10 +30,23 @@ typedef struct {
     uint8_t bri_auto_max;
 } __attribute__ ((packed)) Prefs;
 
+// Followed by len bytes of Prefs. crc covers seq, len and the Prefs.
+typedef struct {
+    uint16_t magic;
+    uint16_t len;
+    uint32_t seq;
+    uint32_t crc;
+} __attribute__ ((packed)) PrefsRecordHeader;
+
 void set_pref_last_filename(Prefs* prefs, const char* filename);
 void set_pref_flag(Prefs* prefs, int flag, bool value);
 bool read_pref_flag(Prefs* prefs, int flag);
+// Saves prefs in prefs_idle(), once changes have stopped for a bit
 void write_prefs(Prefs* prefs);
+// Saves prefs now, if they've changed
+void flush_prefs(Prefs* prefs);
+// Call whenever there's time to write to the card
+void prefs_idle(Prefs* prefs);
 void read_prefs(Prefs* prefs);
 
-#endif
\ No newline at end of file
+#endif